@@ -0,0 +1,192 @@
+"""
+Encode/decode benchmarks for binaryplist.
+
+    python bench/bench.py                       # run every corpus
+    python bench/bench.py wide dates            # run some of them
+    python bench/bench.py --save base.json      # record a baseline
+    python bench/bench.py --compare base.json   # fail on slowdowns
+
+Each corpus runs in its own process so peak RSS is per corpus. Output is
+also checked for a round trip: decode(encode(o)) must equal o (with
+tuples, arrays and dates in their decoded form) and, without dedup,
+must encode back to the same number of bytes. plistlib (xml in python 2) is timed alongside
+for reference.
+"""
+import array
+import datetime
+import json
+import os
+import plistlib
+import random
+import resource
+import subprocess
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import binaryplist as plist
+
+REPEAT = 5
+
+
+def wide():
+    r = random.Random(1)
+    return dict(('key%06d' % i, r.choice([i, i * 0.5, 'v%d' % i, True, None]))
+                for i in xrange(200000))
+
+def deep():
+    root = node = []
+    for i in xrange(2000):
+        child = [i, 'level%d' % i]
+        node.append({'child': child})
+        node = child
+    return root
+
+def unicode_text():
+    r = random.Random(2)
+    alphabet = u'abcdefghij \xe9\xfc\u4e2d\u6587\u0416\U0001f600'
+    return [u''.join(r.choice(alphabet) for _ in xrange(r.randint(200, 4000)))
+            for _ in xrange(500)]
+
+def numeric():
+    r = random.Random(3)
+    return {'floats': [r.random() for _ in xrange(300000)],
+            'ints': [r.randint(-2**40, 2**40) for _ in xrange(300000)],
+            'samples': array.array('d', (r.random() for _ in xrange(300000)))}
+
+def duplicates():
+    rows = []
+    for i in xrange(50000):
+        rows.append({'status': 'ok', 'region': 'us-east-%d' % (i % 4),
+                     'tags': ['a', 'b', 'c'], 'score': i % 10, 'flag': i % 2 == 0})
+    return rows
+
+def dates():
+    start = datetime.datetime(2015, 1, 1)
+    return [{'ts': start + datetime.timedelta(seconds=i, microseconds=i),
+             'day': (start + datetime.timedelta(days=i % 365)).date()}
+            for i in xrange(100000)]
+
+def blobs():
+    r = random.Random(4)
+    return [plist.Data(os.urandom(r.randint(16, 65536))) for _ in xrange(400)]
+
+CORPORA = [('wide', wide), ('deep', deep), ('unicode', unicode_text),
+           ('numeric', numeric), ('duplicates', duplicates), ('dates', dates),
+           ('blobs', blobs)]
+
+
+def count(o):
+    if isinstance(o, dict):
+        return 1 + sum(count(k) + count(v) for k, v in o.iteritems())
+    if isinstance(o, (list, tuple)):
+        return 1 + sum(count(v) for v in o)
+    if isinstance(o, array.array):
+        return 1 + len(o)
+    return 1
+
+def decoded_form(o):
+    if isinstance(o, dict):
+        return dict((k, decoded_form(v)) for k, v in o.iteritems())
+    if isinstance(o, (list, tuple, array.array)):
+        return [decoded_form(v) for v in o]
+    if isinstance(o, datetime.date) and not isinstance(o, datetime.datetime):
+        return datetime.datetime(o.year, o.month, o.day)
+    return o
+
+def best(fn):
+    times = []
+    for _ in xrange(REPEAT):
+        t = time.time()
+        fn()
+        times.append(time.time() - t)
+    return min(times)
+
+def xml_ready(o):
+    # plistlib has no null, Data or date-only support
+    if isinstance(o, dict):
+        return dict((k, xml_ready(v)) for k, v in o.iteritems())
+    if isinstance(o, (list, tuple, array.array)):
+        return [xml_ready(v) for v in o]
+    if o is None:
+        return ''
+    if isinstance(o, plist.Data):
+        return plistlib.Data(str(o))
+    if isinstance(o, datetime.date) and not isinstance(o, datetime.datetime):
+        return datetime.datetime(o.year, o.month, o.day)
+    return o
+
+def run_one(name):
+    sys.setrecursionlimit(100000)
+    obj = dict(CORPORA)[name]()
+    objects = count(obj)
+    data = plist.encode(obj)
+    decoded = plist.decode(data, max_recursion=100000)
+    roundtrip = decoded == decoded_form(obj) and \
+        len(plist.encode(decoded, unique=False)) == len(plist.encode(obj, unique=False))
+    encode = best(lambda: plist.encode(obj))
+    decode = best(lambda: plist.decode(data, max_recursion=100000))
+    try:
+        xml = xml_ready(obj)
+        reference = best(lambda: plistlib.writePlistToString(xml))
+    except (RuntimeError, TypeError):
+        reference = None
+    return {'name': name, 'objects': objects, 'size': len(data),
+            'encode': encode, 'decode': decode, 'plistlib': reference,
+            'roundtrip': roundtrip,
+            'rss': resource.getrusage(resource.RUSAGE_SELF).ru_maxrss}
+
+def report(r):
+    mb = r['size'] / 1048576.0
+    print '%-11s %9d objs %8.2f MB  encode %7.1f MB/s %10.0f objs/s  ' \
+          'decode %7.1f MB/s  plistlib %s  rss %6d KB  %s' % (
+        r['name'], r['objects'], mb, mb / r['encode'], r['objects'] / r['encode'],
+        mb / r['decode'],
+        '%6.1fx' % (r['plistlib'] / r['encode']) if r['plistlib'] else '   n/a',
+        r['rss'], 'ok' if r['roundtrip'] else 'ROUNDTRIP MISMATCH')
+
+def main(argv):
+    save = compare = None
+    tolerance = 0.15
+    names = []
+    while argv:
+        arg = argv.pop(0)
+        if arg == '--one':
+            print json.dumps(run_one(argv.pop(0)))
+            return 0
+        elif arg == '--save':
+            save = argv.pop(0)
+        elif arg == '--compare':
+            compare = argv.pop(0)
+        elif arg == '--tolerance':
+            tolerance = float(argv.pop(0))
+        else:
+            names.append(arg)
+    names = names or [name for name, _ in CORPORA]
+
+    results = {}
+    failed = False
+    for name in names:
+        out = subprocess.check_output([sys.executable, os.path.abspath(__file__), '--one', name])
+        results[name] = r = json.loads(out)
+        report(r)
+        failed |= not r['roundtrip']
+
+    if save:
+        with open(save, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    if compare:
+        with open(compare) as f:
+            baseline = json.load(f)
+        for name in names:
+            if name not in baseline:
+                continue
+            for key in ('encode', 'decode'):
+                ratio = results[name][key] / baseline[name][key]
+                if ratio > 1 + tolerance:
+                    print 'REGRESSION %s %s: %.0f%% slower' % (name, key, (ratio - 1) * 100)
+                    failed = True
+    return 1 if failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -1,64 +1,363 @@
 #include "binaryplist.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define BINARYPLIST_CMD_STR \
 "class Uid(int):__module__='binaryplist'\n" \
 "class Data(str):__module__='binaryplist'\n"
 
+PyObject *PLIST_Error = NULL;
+PyObject *binaryplist_uid_type = NULL;
+PyObject *binaryplist_data_type = NULL;
+PyObject *binaryplist_frozen_type = NULL;
+
 /*
  * Python command initialization and callbacks.
  *
  */
 
+/* Copy the stats of a finished encode into the dict the caller passed. */
+static int update_stats(PyObject *ostats, binaryplist_encoder *encoder)
+{
+    PyObject *stats = encoder_stats(encoder);
+    int status = stats ? PyDict_Update(ostats, stats) : -1;
+
+    Py_XDECREF(stats);
+    return status == 0 ? BINARYPLIST_OK : BINARYPLIST_ERROR;
+}
+
 static PyObject* binaryplist_encode(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     static char *kwlist[] = {"obj", "unique", "debug", "convert_nulls",
-                             "max_recursion", "object_hook", "as_ascii", NULL};
+                             "max_recursion", "object_hook", "as_ascii", "stats", "threads",
+                             NULL};
     PyObject *newobj = NULL;
     PyObject *oinput = NULL;
     PyObject *ounique = NULL;
     PyObject *odebug = NULL;
     PyObject *orecursion = NULL;
+    PyObject *oascii = NULL;
+    PyObject *ostats = NULL;
+    long root;
+    int status;
     binaryplist_encoder encoder;
+    binaryplist_stats stats;
     
     memset(&encoder, 0, sizeof(binaryplist_encoder));
     encoder.convert_nulls = Py_False;
-    encoder.as_ascii = Py_False;
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOOOO", kwlist, &oinput, &ounique,
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOOOOO!i", kwlist, &oinput, &ounique,
         &odebug, &(encoder.convert_nulls), &orecursion, &(encoder.object_hook),
-        &(encoder.as_ascii))) {   
+        &oascii, &PyDict_Type, &ostats, &(encoder.threads))) {   
+        return NULL;
+    }
+    if (ostats) {
+        memset(&stats, 0, sizeof(binaryplist_stats));
+        encoder.stats = &stats;
+    }
+
+    /*
+     * the output is sized exactly up front and written in place, with
+     * threads > 1 large outputs are written by that many threads
+     */
+    if (encoder_setup(&encoder, ounique, odebug, orecursion) == BINARYPLIST_OK
+        && encoder_encode_object(&encoder, oinput, &root) == BINARYPLIST_OK
+        && encoder_size(&encoder) >= 0
+        && (newobj = PyString_FromStringAndSize(NULL, encoder.size))) {
+        bplist_output_init(&encoder.out, (uint8_t *)PyString_AS_STRING(newobj),
+            encoder.size, NULL, NULL);
+        if (encoder.debug) {
+            status = encoder_write(&encoder);
+        } else {
+            Py_BEGIN_ALLOW_THREADS
+            status = encoder_write(&encoder);
+            Py_END_ALLOW_THREADS
+        }
+        if (status != BINARYPLIST_OK) {
+            encoder_set_error(&encoder);
+            Py_CLEAR(newobj);
+        } else if (ostats && update_stats(ostats, &encoder) != BINARYPLIST_OK) {
+            Py_CLEAR(newobj);
+        }
+    }
+
+    encoder_free(&encoder);
+    return newobj;
+}
+
+typedef struct write_batch {
+    binaryplist_encoder *encoders;
+    Py_ssize_t n;
+    Py_ssize_t next;
+} write_batch;
+
+/* Runs without the GIL, pulling encoders off the batch until it is empty. */
+static void *write_worker(void *arg)
+{
+    write_batch *batch = arg;
+    Py_ssize_t i;
+
+    while ((i = __sync_fetch_and_add(&batch->next, 1)) < batch->n) {
+        encoder_write(&batch->encoders[i]);
+    }
+    return NULL;
+}
+
+static PyObject* binaryplist_encode_many(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"objs", "threads", "unique", "convert_nulls",
+                             "max_recursion", "object_hook", "as_ascii", NULL};
+    PyObject *newobj = NULL;
+    PyObject *oinputs = NULL;
+    PyObject *ounique = NULL;
+    PyObject *orecursion = NULL;
+    PyObject *oascii = NULL;
+    PyObject *seq, *out;
+    int nthreads = 1, nstarted = 0, i;
+    long root;
+    pthread_t *threads = NULL;
+    write_batch batch;
+    binaryplist_encoder options;
+
+    memset(&options, 0, sizeof(binaryplist_encoder));
+    options.convert_nulls = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOOOOO", kwlist, &oinputs, &nthreads,
+        &ounique, &(options.convert_nulls), &orecursion, &(options.object_hook),
+        &oascii)) {
         return NULL;
     }
-    if (encoder.object_hook && !PyCallable_Check(encoder.object_hook)) {
-        PyErr_SetString(PLIST_Error, "object_hook is not callable");
+    if (!(seq = PySequence_Fast(oinputs, "objs must be a sequence"))) {
         return NULL;
     }
-    encoder.ref_table = PyDict_New();
-    encoder.objects = PyList_New(0);
-    utstring_new(encoder.output);
-    if (!ounique || (ounique && PyObject_IsTrue(ounique))) {
-        /* default to True */
-        encoder.dounique = 1;
-        encoder.uniques = PyDict_New();
+    memset(&batch, 0, sizeof(write_batch));
+    batch.n = PySequence_Fast_GET_SIZE(seq);
+    if (!(newobj = PyList_New(batch.n))
+        || !(batch.encoders = calloc(batch.n ? batch.n : 1, sizeof(binaryplist_encoder)))) {
+        Py_XDECREF(newobj);
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    /* traversal needs the GIL, do it up front for every object */
+    for (i = 0; i < batch.n; i++) {
+        binaryplist_encoder *encoder = &batch.encoders[i];
+
+        memcpy(encoder, &options, sizeof(binaryplist_encoder));
+        if (encoder_setup(encoder, ounique, NULL, orecursion) != BINARYPLIST_OK
+            || encoder_encode_object(encoder, PySequence_Fast_GET_ITEM(seq, i), &root)
+                != BINARYPLIST_OK
+            || encoder_size(encoder) < 0
+            || !(out = PyString_FromStringAndSize(NULL, encoder->size))) {
+            Py_CLEAR(newobj);
+            batch.n = i + 1;
+            goto done;
+        }
+        PyList_SET_ITEM(newobj, i, out);
+        bplist_output_init(&encoder->out, (uint8_t *)PyString_AS_STRING(out),
+            encoder->size, NULL, NULL);
+    }
+
+    /* the writes only touch native state, fan them out */
+    if (nthreads > batch.n) {
+        nthreads = batch.n;
     }
-    if (odebug && PyObject_IsTrue(odebug)) {
-        encoder.debug = 1;
+    if (nthreads > 1 && !(threads = calloc(nthreads - 1, sizeof(pthread_t)))) {
+        nthreads = 1;
     }
-    if (orecursion && PyInt_Check(orecursion)) {
-        encoder.max_recursion = PyInt_AsLong(orecursion);
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < nthreads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, write_worker, &batch) != 0) {
+            break;
+        }
+        nstarted++;
+    }
+    write_worker(&batch);
+    for (i = 0; i < nstarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    Py_END_ALLOW_THREADS
+    free(threads);
+
+    for (i = 0; i < batch.n; i++) {
+        if (batch.encoders[i].error) {
+            encoder_set_error(&batch.encoders[i]);
+            Py_CLEAR(newobj);
+            break;
+        }
+    }
+
+done:
+    for (i = 0; i < batch.n; i++) {
+        encoder_free(&batch.encoders[i]);
+    }
+    free(batch.encoders);
+    Py_DECREF(seq);
+    return newobj;
+}
+
+int flush_fd(void *sink, const uint8_t *data, size_t len)
+{
+    int fd = *(int *)sink;
+    ssize_t n = 0;
+
+    while (len > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        n = write(fd, data, len);
+        Py_END_ALLOW_THREADS
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PyErr_SetFromErrno(PyExc_IOError);
+            return BINARYPLIST_ERROR;
+        }
+        data += n;
+        len -= n;
+    }
+    return BINARYPLIST_OK;
+}
+
+/* head and data in one writev, so large payloads never pass through the chunk */
+int gather_fd(void *sink, const uint8_t *head, size_t head_len, const uint8_t *data,
+    size_t len)
+{
+    int fd = *(int *)sink;
+    struct iovec iov[2];
+    ssize_t n = 0;
+
+    iov[0].iov_base = (void *)head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    while (head_len > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        n = writev(fd, iov, 2);
+        Py_END_ALLOW_THREADS
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PyErr_SetFromErrno(PyExc_IOError);
+            return BINARYPLIST_ERROR;
+        }
+        if ((size_t)n < head_len) {
+            head_len -= n;
+            iov[0].iov_base = (uint8_t *)iov[0].iov_base + n;
+            iov[0].iov_len = head_len;
+            continue;
+        }
+        n -= head_len;
+        head_len = 0;
+    }
+    /* whatever a short write left of data */
+    return flush_fd(sink, data + n, len - n);
+}
+
+int flush_file(void *sink, const uint8_t *data, size_t len)
+{
+    PyObject *ret = PyObject_CallMethod((PyObject *)sink, "write", "s#", data, (Py_ssize_t)len);
+
+    if (!ret) {
+        return BINARYPLIST_ERROR;
+    }
+    Py_DECREF(ret);
+    return BINARYPLIST_OK;
+}
+
+static PyObject* binaryplist_encode_to(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"obj", "file", "unique", "debug", "convert_nulls",
+                             "max_recursion", "object_hook", "as_ascii", "chunk_size",
+                             "stats", NULL};
+    PyObject *newobj = NULL;
+    PyObject *oinput = NULL;
+    PyObject *ofile = NULL;
+    PyObject *ounique = NULL;
+    PyObject *odebug = NULL;
+    PyObject *orecursion = NULL;
+    PyObject *oascii = NULL;
+    PyObject *ostats = NULL;
+    Py_ssize_t chunk_size = DEFAULT_CHUNK_SIZE;
+    uint8_t *chunk = NULL;
+    long root;
+    int fd;
+    binaryplist_encoder encoder;
+    binaryplist_stats stats;
+
+    memset(&encoder, 0, sizeof(binaryplist_encoder));
+    encoder.convert_nulls = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OOOOOOnO!", kwlist, &oinput, &ofile,
+        &ounique, &odebug, &(encoder.convert_nulls), &orecursion, &(encoder.object_hook),
+        &oascii, &chunk_size, &PyDict_Type, &ostats)) {
+        return NULL;
+    }
+    if (ostats) {
+        memset(&stats, 0, sizeof(binaryplist_stats));
+        encoder.stats = &stats;
+    }
+    if (chunk_size < 16) {
+        PyErr_SetString(PLIST_Error, "chunk_size is too small");
+        return NULL;
+    }
+    if (PyInt_Check(ofile) || PyLong_Check(ofile)) {
+        fd = PyInt_AsLong(ofile);
+        encoder.flush = flush_fd;
+        encoder.gather = gather_fd;
+        encoder.sink = &fd;
+    } else if (PyObject_HasAttrString(ofile, "write")) {
+        encoder.flush = flush_file;
+        encoder.sink = ofile;
     } else {
-        encoder.max_recursion = 1024*16;
+        PyErr_SetString(PLIST_Error, "file must be a file descriptor or have a write method");
+        return NULL;
+    }
+
+    /* objects are written through one fixed size chunk */
+    if (encoder_setup(&encoder, ounique, odebug, orecursion) == BINARYPLIST_OK
+        && encoder_encode_object(&encoder, oinput, &root) == BINARYPLIST_OK
+        && encoder_size(&encoder) >= 0) {
+        if (!(chunk = malloc(chunk_size))) {
+            PyErr_NoMemory();
+        } else {
+            bplist_output_init(&encoder.out, chunk, chunk_size, NULL, NULL);
+            if (encoder_write(&encoder) != BINARYPLIST_OK) {
+                encoder_set_error(&encoder);
+            } else if (!ostats || update_stats(ostats, &encoder) == BINARYPLIST_OK) {
+                newobj = PyInt_FromSsize_t(encoder.size);
+            }
+        }
+    }
+
+    free(chunk);
+    encoder_free(&encoder);
+    return newobj;
+}
+
+static PyObject* binaryplist_decode(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "max_recursion", NULL};
+    PyObject *newobj = NULL;
+    Py_buffer view;
+    binaryplist_decoder decoder;
+
+    memset(&decoder, 0, sizeof(binaryplist_decoder));
+    decoder.max_recursion = 1024*16;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*|i", kwlist, &view,
+        &(decoder.max_recursion))) {
+        return NULL;
     }
+    decoder.data = view.buf;
+    decoder.len = view.len;
 
-    if (encoder_encode_object(&encoder, oinput) == BINARYPLIST_OK
-        && encoder_write(&encoder) == BINARYPLIST_OK) {
-        newobj = PyString_FromStringAndSize(utstring_body(encoder.output),
-            utstring_len(encoder.output));
+    if (decoder_read_trailer(&decoder) == BINARYPLIST_OK
+        && decoder_alloc(&decoder) == BINARYPLIST_OK
+        && (newobj = decoder_decode_object(&decoder, decoder.root))) {
+        Py_INCREF(newobj);
     }
 
-    Py_DECREF(encoder.ref_table);
-    Py_DECREF(encoder.objects);
-    Py_XDECREF(encoder.uniques);
-    utstring_free(encoder.output);
+    decoder_free(&decoder);
+    PyBuffer_Release(&view);
 
     return newobj;
 }
@@ -67,6 +366,20 @@ static PyMethodDef binaryplist_methods[] =
 {
     {"encode", (PyCFunction)binaryplist_encode, METH_VARARGS | METH_KEYWORDS,
      "Generate the binary plist representation of an object."},
+    {"encode_many", (PyCFunction)binaryplist_encode_many, METH_VARARGS | METH_KEYWORDS,
+     "Encode a sequence of objects, writing them out on a pool of threads."},
+    {"encode_to", (PyCFunction)binaryplist_encode_to, METH_VARARGS | METH_KEYWORDS,
+     "Stream the binary plist representation of an object to a file or descriptor."},
+    {"decode", (PyCFunction)binaryplist_decode, METH_VARARGS | METH_KEYWORDS,
+     "Build native objects from a binary plist."},
+    {"validate", (PyCFunction)validate, METH_VARARGS | METH_KEYWORDS,
+     "Check that a binary plist decodes without decoding it, raises PLIST_Error if not."},
+    {"encode_update", (PyCFunction)update_encode, METH_VARARGS | METH_KEYWORDS,
+     "Encode the bytes to append to a dict plist to apply changes, or None."},
+    {"transcode", (PyCFunction)transcode, METH_VARARGS | METH_KEYWORDS,
+     "Convert a binary plist to XML plist or JSON text without decoding it."},
+    {"register_type", (PyCFunction)types_register, METH_VARARGS,
+     "Encode instances of a class through a converter, None to unregister."},
     {NULL, NULL, 0, NULL}
 };
  
@@ -78,4 +391,11 @@ initlibbinaryplist(void)
 {
     PyObject *module = Py_InitModule3("libbinaryplist", binaryplist_methods, module_doc);
     encoder_init();
+    types_init();
+    decoder_init();
+    Py_INCREF(PLIST_Error);
+    PyModule_AddObject(module, "Error", PLIST_Error);
+    view_init(module);
+    encoderobject_init(module);
+    iterencode_init(module);
 }
@@ -2,81 +2,347 @@
 #define _BINARYPLIST_H
 
 #include <Python.h>
-#include <datetime.h>
-#include "utstring.h"
+#include "ptrmap.h"
+#include "intern.h"
+#include "trace.h"
+#include "bplist_core.h"
 
 #define BINARYPLIST_OK          0
 #define BINARYPLIST_ERROR       1
-#define APPLE_EPOCH_OFFSET      978307200
+#define APPLE_EPOCH_OFFSET      BPLIST_EPOCH_OFFSET
 
-#define BPLIST_MAGIC            ((uint8_t*)"bplist")
-#define BPLIST_MAGIC_SIZE       6
+/* Window of the streaming writers unless the caller picks chunk_size */
+#define DEFAULT_CHUNK_SIZE      (64*1024)
 
-#define BPLIST_VERSION          ((uint8_t*)"00")
-#define BPLIST_VERSION_SIZE     3
+/* dounique levels: scalars only, or scalars and whole containers */
+#define UNIQUE_SCALARS          1
+#define UNIQUE_DEEP             2
 
-#define UNIQABLE(o) ( !PyCallable_Check(o) && ( o == Py_True || o == Py_False || o == Py_None \
-    || PyString_Check(o) || PyUnicode_Check(o) || PyFloat_Check(o) || PyInt_Check(o) \
-    || PyDateTime_Check(o) || PyDate_Check(o) || PyLong_Check(o) ))
+/* encoder only, written by a native converter */
+#define BPLIST_NATIVE           0x10
 
+/*
+ * Native converter for register_type, handed over in a PyCapsule named
+ * BINARYPLIST_CONVERTER_CAPSULE. size is called with the GIL held when
+ * the object is reached and returns the encoded length of one scalar,
+ * marker byte included, or -1 with an exception set. write runs later
+ * without the GIL and must fill exactly that many bytes from the
+ * object's C level state; the object is kept alive until then.
+ */
+typedef struct binaryplist_converter {
+    Py_ssize_t (*size)(PyObject *object, void *context);
+    void (*write)(PyObject *object, uint8_t *out, void *context);
+    void *context;
+} binaryplist_converter;
+
+#define BINARYPLIST_CONVERTER_CAPSULE "binaryplist.converter"
+
+/* How the encoder handles a type, see types.c */
 enum
 {
-    BPLIST_NULL = 0x00,
-    BPLIST_FALSE = 0x08,
-    BPLIST_TRUE = 0x09,
-    BPLIST_FILL = 0x0F,                 /* will be used for length grabbing */
-    BPLIST_UINT = 0x1,
-    BPLIST_REAL = 0x2,
-    BPLIST_DATE = 0x3,
-    BPLIST_DATA = 0x4,
-    BPLIST_STRING = 0x5,
-    BPLIST_UNICODE = 0x6,
-    BPLIST_UID = 0x7,
-    BPLIST_ARRAY = 0xA,
-    BPLIST_SET = 0xC,
-    BPLIST_DICT = 0xD,
-    BPLIST_MASK = 0xF
+    TYPE_UNKNOWN,
+    TYPE_NONE,
+    TYPE_BOOL,
+    TYPE_INT,
+    TYPE_FLOAT,
+    TYPE_STRING,
+    TYPE_UNICODE,
+    TYPE_DATE,
+    TYPE_DATA,
+    TYPE_UID,
+    TYPE_ARRAY,
+    TYPE_DICT,
+    /* array.array or a new style buffer, encoded if its items are numbers */
+    TYPE_BUFFER,
+    /* binaryplist.Frozen, encoded as its value or copied from the cache */
+    TYPE_FROZEN,
+    TYPE_CLASSES,
+    /* Registered with register_type, not in types_builtin */
+    TYPE_CONVERTER = TYPE_CLASSES,
+    TYPE_NATIVE
 };
 
+typedef struct binaryplist_dispatch {
+    int cls;
+    /* Registered callable, or the capsule of a native converter */
+    PyObject *converter;
+    const binaryplist_converter *native;
+} binaryplist_dispatch;
+
+/*
+ * Native form of one flattened object. Filled in during traversal with
+ * everything the writer needs so sizing and writing never touch python.
+ */
+typedef struct binaryplist_object {
+    PyObject *object;
+    /* Type nibble from the enum above, 0 for null/true/false */
+    uint8_t kind;
+    /*
+     * Payload points at Py_UNICODE rather than bytes. For ints, value is
+     * unsigned and above LONG_MAX, written in the 128 bit form.
+     */
+    uint8_t wide;
+    /* Marker byte for kind 0, int and uid values, real and date seconds */
+    union {
+        long i;
+        double r;
+    } value;
+    /*
+     * Data/string payload, length in source units (bytes or Py_UNICODE).
+     * For BPLIST_NATIVE the converter and the length it asked for.
+     */
+    const void *bytes;
+    Py_ssize_t length;
+    /* Length written in the header: bytes, UTF-16 units or entries */
+    Py_ssize_t count;
+    /* Child reference ids live at refs[refs_at .. refs_at + nrefs) */
+    Py_ssize_t refs_at;
+    Py_ssize_t nrefs;
+    /* Byte position in the output, set by encoder_size */
+    Py_ssize_t offset;
+    /* Container is on the traversal stack, seeing it again is a cycle */
+    uint8_t open;
+} binaryplist_object;
+
+/* One container being walked by the traversal */
+typedef struct binaryplist_frame {
+    PyObject *container;
+    /* Dict value waiting for its key to be encoded, owned */
+    PyObject *value;
+    long id;
+    /* Parent refs slot holding id, -1 for the root */
+    Py_ssize_t slot;
+    Py_ssize_t pos;
+    Py_ssize_t k;
+    Py_ssize_t size;
+    Py_ssize_t at;
+} binaryplist_frame;
+
+/* Phases of encoder_write_step */
+enum
+{
+    STEP_HEADER,
+    STEP_OBJECTS,
+    STEP_OFFSETS,
+    STEP_TRAILER,
+    STEP_DONE
+};
+
+/* Where encoder_write_step carries on */
+typedef struct binaryplist_step {
+    int phase;
+    /* Next object, or next offset table entry */
+    Py_ssize_t index;
+    /* A sliced object has its header out and this many payload bytes, chars or refs */
+    int started;
+    Py_ssize_t done;
+} binaryplist_step;
+
 typedef struct binaryplist_encoder {
-    int nobjects;
+    Py_ssize_t nobjects;
     int dounique;
     int ref_id_sz;
     int max_recursion;
+    /* Frames in use on the traversal stack */
     int depth;
     int debug;
-    /* Hack to treat uni as ascii where possible */
-    PyObject *as_ascii;
+    /* Threads encoder_write may split a large in memory output across */
+    int threads;
     /* Hack to treat None as empty string */
     PyObject *convert_nulls;
-    /* This should always be 0th object */
-    PyObject *root;
-    /* PyStrings are immutable, so we use a utstring instead */
-    UT_string *output;
-    /* Dict of obj pointer to reference id */
-    PyObject *ref_table;
-    /* PyList of flattened objects */
+    /*
+     * Appending to an existing plist: local ids are shifted by id_base
+     * when written (refs to old objects are stored as old id - id_base),
+     * objects start at offset_base instead of after the header, and the
+     * old offset table is carried into the new one.
+     */
+    long id_base;
+    Py_ssize_t offset_base;
+    const uint8_t *old_offsets;
+    int old_off_sz;
+    /* Exact output size, offset table position and width */
+    Py_ssize_t size;
+    Py_ssize_t off_pos;
+    int off_sz;
+    /* Output window, see bplist_core.h */
+    bplist_output out;
+    /* Where the chunks go when streaming, NULL when out holds it all */
+    bplist_flush flush;
+    /* Writes the pending chunk and a large payload at once, optional */
+    bplist_gather gather;
+    void *sink;
+    const char *error;
+    /* Map of container pointer to its latest reference id */
+    ptrmap ref_table;
+    /* PyList of flattened objects, keeps hook results alive */
     PyObject *objects;
-    /* 
-     * PyDict of uniq objects.
-     * Followed by a few special case types.
+    /* Flattened objects indexed by reference id */
+    binaryplist_object *entries;
+    Py_ssize_t entries_cap;
+    /* Child reference ids of every container, recorded during traversal */
+    long *refs;
+    Py_ssize_t refs_len;
+    Py_ssize_t refs_cap;
+    /* Explicit traversal stack, containers still being walked */
+    binaryplist_frame *stack;
+    Py_ssize_t stack_cap;
+    /*
+     * Native intern table of everything written once when unique is set:
+     * scalars keyed on type and value or payload hash, containers on
+     * their child ids with unique="deep".
      */
-    PyObject *uniques;
-    PyObject *uNone;
-    PyObject *uTrue;
-    PyObject *uFalse;
+    intern_table interned;
+    /* Flattened immutable subtrees kept across encodes, NULL when off */
+    struct binaryplist_cache *cache;
     /* Callback function when type is unknown or unspported */
     PyObject *object_hook;
+    /* Opt-in instrumentation, NULL when off. Not cleared by encoder_reset */
+    binaryplist_stats *stats;
+    binaryplist_trace *trace;
 } binaryplist_encoder;
 
-static PyObject *PLIST_Error = NULL;
-static PyObject *binaryplist_uid_type = NULL;
-static PyObject *binaryplist_data_type = NULL;
+/* A container being decoded, its entries are added as they resolve */
+typedef struct binaryplist_decode_frame {
+    uint64_t ref;
+    /* Position of its refs, entry count and next entry to decode */
+    uint64_t pos;
+    uint64_t count;
+    uint64_t next;
+    PyObject *container;
+    /* Dict key waiting for its value, borrowed from objects */
+    PyObject *key;
+    uint8_t kind;
+} binaryplist_decode_frame;
+
+typedef struct binaryplist_decoder {
+    const uint8_t *data;
+    Py_ssize_t len;
+    /* Trailer fields as written by encoder_write */
+    int offset_sz;
+    int ref_id_sz;
+    uint64_t nobjects;
+    uint64_t root;
+    uint64_t offset_table;
+    int max_recursion;
+    int depth;
+    /* Decoded object per reference id, each resolved exactly once */
+    PyObject **objects;
+    /* Reference ids currently being decoded, for cycle detection */
+    uint8_t *inprogress;
+    /* Open containers, depth of them in use */
+    binaryplist_decode_frame *stack;
+    int stack_cap;
+} binaryplist_decoder;
+
+/* Broken down UTC time of a plist date */
+typedef struct binaryplist_civil {
+    int year;
+    int month;
+    int day;
+    int hour;
+    int minute;
+    int second;
+    int usec;
+} binaryplist_civil;
+
+/* Shared between translation units, set up by encoder_init */
+extern PyObject *PLIST_Error;
+extern PyObject *binaryplist_uid_type;
+extern PyObject *binaryplist_data_type;
+extern PyObject *binaryplist_frozen_type;
 
 /* encode.c */
-int encoder_encode_object(binaryplist_encoder *encoder, PyObject *object);
+int encoder_encode_object(binaryplist_encoder *encoder, PyObject *object, long *ref);
+Py_ssize_t encoder_size(binaryplist_encoder *encoder);
 int encoder_write(binaryplist_encoder *encoder);
+int encoder_write_step(binaryplist_encoder *encoder, binaryplist_step *step);
+void encoder_set_error(binaryplist_encoder *encoder);
+PyObject *encoder_stats(binaryplist_encoder *encoder);
+long encoder_add_container(binaryplist_encoder *encoder, int kind, Py_ssize_t nrefs);
+long encoder_add_block(binaryplist_encoder *encoder, const binaryplist_object *entries,
+    Py_ssize_t n, const long *refs, Py_ssize_t nrefs, long root);
+int encoder_setup(binaryplist_encoder *encoder, PyObject *ounique, PyObject *odebug,
+    PyObject *orecursion);
+void encoder_reset(binaryplist_encoder *encoder);
+int encoder_shrink(binaryplist_encoder *encoder);
+void encoder_free(binaryplist_encoder *encoder);
 void encoder_init(void);
 
+/* cache.c */
+#define CACHE_SKIP 2
+struct binaryplist_cache *cache_new(binaryplist_encoder *encoder, Py_ssize_t max_blocks);
+int cache_encode(binaryplist_encoder *encoder, PyObject *object, long *ref);
+void cache_start(struct binaryplist_cache *cache);
+void cache_clear(struct binaryplist_cache *cache);
+void cache_free(struct binaryplist_cache *cache);
+
+/* types.c */
+extern const binaryplist_dispatch types_builtin[TYPE_CLASSES];
+extern unsigned long types_generation;
+const binaryplist_dispatch *types_resolve(PyTypeObject *type);
+PyObject *types_register(PyObject *self, PyObject *args);
+void types_init(void);
+
+/* Dispatch record of an object, NULL with an exception set on failure */
+static inline const binaryplist_dispatch *types_lookup(PyObject *object)
+{
+    PyTypeObject *type = Py_TYPE(object);
+
+    if (type == &PyString_Type) return &types_builtin[TYPE_STRING];
+    if (type == &PyUnicode_Type) return &types_builtin[TYPE_UNICODE];
+    if (type == &PyInt_Type) return &types_builtin[TYPE_INT];
+    if (type == &PyFloat_Type) return &types_builtin[TYPE_FLOAT];
+    if (type == &PyDict_Type) return &types_builtin[TYPE_DICT];
+    if (type == &PyList_Type || type == &PyTuple_Type) return &types_builtin[TYPE_ARRAY];
+    if (type == &PyBool_Type) return &types_builtin[TYPE_BOOL];
+    if (object == Py_None) return &types_builtin[TYPE_NONE];
+    return types_resolve(type);
+}
+
+/* binaryplist.c */
+int flush_fd(void *sink, const uint8_t *data, size_t len);
+int flush_file(void *sink, const uint8_t *data, size_t len);
+int gather_fd(void *sink, const uint8_t *head, size_t head_len, const uint8_t *data,
+    size_t len);
+
+/* transcode.c */
+PyObject *transcode(PyObject *self, PyObject *args, PyObject *kwargs);
+
+/* validate.c */
+PyObject *validate(PyObject *self, PyObject *args, PyObject *kwargs);
+uint64_t default_expansion(uint64_t refs);
+int parse_max_expansion(PyObject *oexpansion, uint64_t *max_expansion, int *auto_expansion);
+
+/* update.c */
+PyObject *update_encode(PyObject *self, PyObject *args, PyObject *kwargs);
+
+/* encoderobject.c */
+int encoderobject_init(PyObject *module);
+
+/* iterencode.c */
+int iterencode_init(PyObject *module);
+
+/* unicode.c */
+void unicode_scan(const Py_UNICODE *u, Py_ssize_t n, Py_UCS4 *bits, Py_ssize_t *astral);
+uint8_t *unicode_to_ascii(const Py_UNICODE *u, Py_ssize_t n, uint8_t *out);
+uint8_t *unicode_to_utf16be(const Py_UNICODE *u, Py_ssize_t n, uint8_t *out);
+
+/* view.c */
+int view_init(PyObject *module);
+
+/* decoder.c */
+int decoder_read_trailer(binaryplist_decoder *decoder);
+int decoder_alloc(binaryplist_decoder *decoder);
+void decoder_free(binaryplist_decoder *decoder);
+int decoder_position(binaryplist_decoder *decoder, uint64_t ref, uint64_t *pos);
+int decoder_read_length(binaryplist_decoder *decoder, uint64_t *pos, uint64_t *length);
+int decoder_split_date(double seconds, binaryplist_civil *civil);
+int decoder_object_kind(binaryplist_decoder *decoder, uint64_t ref);
+int decoder_read_container(binaryplist_decoder *decoder, uint64_t ref, uint8_t *kind,
+    uint64_t *pos, uint64_t *count);
+uint64_t decoder_read_ref(binaryplist_decoder *decoder, uint64_t pos, uint64_t index);
+PyObject *decoder_decode_object(binaryplist_decoder *decoder, uint64_t ref);
+void decoder_init(void);
+
 #endif
 
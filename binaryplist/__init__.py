@@ -9,12 +9,180 @@ can be coerced into plist specific data types.
 These are compatible with biplist.
 """
 
+import __builtin__
+import collections
+import mmap
+import os
+import struct
+
 class Uid(int):
     pass
 
 class Data(str):
     pass
 
-# Uid and Data need to exists before this import
+class Frozen(object):
+    """
+    Marks value as never changing once built. An Encoder created with
+    cache=n flattens it once and copies the result into every later
+    encode that contains this same Frozen; other encoders just encode
+    value.
+    """
+    __slots__ = ('value',)
+
+    def __init__(self, value=None):
+        self.value = value
+
+# Uid, Data and Frozen need to exists before this import
 import libbinaryplist
+Error = libbinaryplist.Error
 encode = libbinaryplist.encode
+encode_to = libbinaryplist.encode_to
+iterencode = libbinaryplist.iterencode
+encode_many = libbinaryplist.encode_many
+decode = libbinaryplist.decode
+validate = libbinaryplist.validate
+Encoder = libbinaryplist.Encoder
+encode_update = libbinaryplist.encode_update
+register_type = libbinaryplist.register_type
+transcode = libbinaryplist.transcode
+
+_ARRAY, _SET, _DICT = 0xA, 0xC, 0xD
+
+def _materialize(view, ref):
+    kind = view.kind(ref)
+    if kind == _DICT:
+        return DictView(view, ref)
+    elif kind in (_ARRAY, _SET):
+        return ArrayView(view, ref)
+    return view.value(ref)
+
+class ArrayView(collections.Sequence):
+    """Read only list proxy. Items are decoded when indexed."""
+
+    def __init__(self, view, ref):
+        self._view = view
+        self._refs = view.refs(ref)
+
+    def __len__(self):
+        return len(self._refs)
+
+    def __getitem__(self, index):
+        if isinstance(index, slice):
+            return [_materialize(self._view, r) for r in self._refs[index]]
+        return _materialize(self._view, self._refs[index])
+
+class DictView(collections.Mapping):
+    """Read only dict proxy. Keys are decoded up front, values when accessed."""
+
+    def __init__(self, view, ref):
+        self._view = view
+        refs = view.refs(ref)
+        n = len(refs) / 2
+        self._index = dict((view.value(k), v) for k, v in zip(refs[:n], refs[n:]))
+
+    def __len__(self):
+        return len(self._index)
+
+    def __iter__(self):
+        return iter(self._index)
+
+    def __contains__(self, key):
+        return key in self._index
+
+    def __getitem__(self, key):
+        return _materialize(self._view, self._index[key])
+
+def load_view(buffer):
+    """Lazily decode a binary plist held in any object supporting the buffer protocol."""
+    view = libbinaryplist.View(buffer)
+    return _materialize(view, view.root)
+
+def open(path):
+    """Memory map a binary plist file and return a lazy view of its root object."""
+    with __builtin__.open(path, 'rb') as f:
+        return load_view(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+
+def convert(path, out, format='xml', **kwargs):
+    """
+    Write the plist at path to out (a path, file object or descriptor) as
+    XML plist or JSON text. The input is memory mapped and transcoded in
+    bounded chunks. Returns the bytes written.
+    """
+    with __builtin__.open(path, 'rb') as f:
+        data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        if isinstance(out, basestring):
+            with __builtin__.open(out, 'wb') as f:
+                return transcode(data, format, f.fileno(), **kwargs)
+        return transcode(data, format, out, **kwargs)
+    finally:
+        data.close()
+
+def _replace(path, data):
+    tmp = path + '.tmp'
+    with __builtin__.open(tmp, 'wb') as f:
+        f.write(data)
+        f.flush()
+        os.fsync(f.fileno())
+    os.rename(tmp, path)
+
+def update(path, changes, delete=(), **kwargs):
+    """
+    Set the keys in changes and remove those in delete from the root dict
+    of the plist at path. Only the changed values, a new root dict and a
+    new offset table are appended; the file is rewritten only when the
+    object count outgrows its reference width. Returns the bytes written.
+
+    Each update appends a full offset table, one entry per object, so the
+    file grows by O(n) per update until compact() rewrites it. The
+    append is flushed and synced before update returns.
+    """
+    with __builtin__.open(path, 'r+b') as f:
+        data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        try:
+            tail = encode_update(data, changes, delete, **kwargs)
+            root = decode(data) if tail is None else None
+        finally:
+            data.close()
+        if tail is not None:
+            f.seek(0, 2)
+            f.write(tail)
+            f.flush()
+            os.fsync(f.fileno())
+            return len(tail)
+    for key in delete:
+        root.pop(key, None)
+    root.update(changes)
+    data = encode(root, **kwargs)
+    _replace(path, data)
+    return len(data)
+
+def compact(path, **kwargs):
+    """Rewrite the plist at path without the dead objects left by update()."""
+    with __builtin__.open(path, 'rb') as f:
+        data = f.read()
+    data = encode(decode(data), **kwargs)
+    _replace(path, data)
+    return len(data)
+
+_TRACE_RECORD = struct.Struct('=QIIBBHI')
+_TRACE_EVENTS = {1: 'begin', 2: 'end', 3: 'object', 4: 'unique', 5: 'push', 6: 'pop',
+                 7: 'flush', 8: 'cache'}
+_TRACE_PHASES = {1: 'traverse', 2: 'size', 3: 'write'}
+
+def read_trace(data):
+    """
+    Unpack Encoder.trace() records into (ns, event, kind, id, arg, depth)
+    tuples. ns is a monotonic clock, kind the plist type nibble, id the
+    reference id. arg is the phase name for begin/end, the child count
+    for push, the byte count for flush and the object count for cache.
+    """
+    records = []
+    for offset in xrange(0, len(data), _TRACE_RECORD.size):
+        ns, id, arg, event, kind, depth, _ = _TRACE_RECORD.unpack_from(data, offset)
+        event = _TRACE_EVENTS.get(event, event)
+        if event in ('begin', 'end'):
+            arg = _TRACE_PHASES.get(arg, arg)
+        records.append((ns, event, kind, id, arg, depth))
+    return records
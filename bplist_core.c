@@ -0,0 +1,720 @@
+#include <stdlib.h>
+#include "bplist_core.h"
+#include "intern.h"
+
+
+/*
+ * Output layer and builder of libbplist, see bplist_core.h. Nothing in
+ * here knows about python.
+ *
+ */
+
+void bplist_output_init(bplist_output *out, uint8_t *buffer, size_t size, bplist_flush flush,
+    void *sink)
+{
+    out->buffer = out->cursor = buffer;
+    out->limit = buffer + size;
+    out->flush = flush;
+    out->gather = NULL;
+    out->sink = sink;
+    out->flushed = 0;
+    out->failed = 0;
+}
+
+void bplist_output_flush(bplist_output *out)
+{
+    size_t len = out->cursor - out->buffer;
+
+    if (!out->flush) {
+        /* a preallocated output should never fill up, size was wrong */
+        out->failed = 1;
+    } else if (len && !out->failed && out->flush(out->sink, out->buffer, len) != BPLIST_OK) {
+        out->failed = 1;
+    }
+    out->flushed += len;
+    out->cursor = out->buffer;
+}
+
+void bplist_out_bytes(bplist_output *out, const void *bytes, size_t len)
+{
+    const uint8_t *p = bytes;
+    size_t room;
+
+    while (len) {
+        room = out->limit - out->cursor;
+        if (room == 0) {
+            bplist_output_flush(out);
+            continue;
+        }
+        if (out->flush && len >= (size_t)(out->limit - out->buffer)
+            && (out->cursor == out->buffer || out->gather)) {
+            /* larger than a whole chunk, hand it over without copying */
+            room = out->cursor - out->buffer;
+            if (!out->failed && (room ? out->gather(out->sink, out->buffer, room, p, len)
+                : out->flush(out->sink, p, len)) != BPLIST_OK) {
+                out->failed = 1;
+            }
+            out->flushed += room + len;
+            out->cursor = out->buffer;
+            return;
+        }
+        if (room > len) {
+            room = len;
+        }
+        memcpy(out->cursor, p, room);
+        out->cursor += room;
+        p += room;
+        len -= room;
+    }
+}
+
+/* Marker with the count in its low nibble, or followed by an int */
+void bplist_out_header(bplist_output *out, int kind, uint64_t count)
+{
+    if (count < 15) {
+        bplist_out_byte(out, (kind << 4) + count);
+    } else if (count < 256) {
+        bplist_out_byte(out, (kind << 4) + 15);
+        bplist_out_byte(out, 0x10);
+        bplist_out_be(out, count, 1);
+    } else if (count < 65536) {
+        bplist_out_byte(out, (kind << 4) + 15);
+        bplist_out_byte(out, 0x11);
+        bplist_out_be(out, count, 2);
+    } else if (count < 4294967296ULL) {
+        bplist_out_byte(out, (kind << 4) + 15);
+        bplist_out_byte(out, 0x12);
+        bplist_out_be(out, count, 4);
+    } else {
+        bplist_out_byte(out, (kind << 4) + 15);
+        bplist_out_byte(out, 0x13);
+        bplist_out_be(out, count, 8);
+    }
+}
+
+void bplist_out_int(bplist_output *out, int64_t value)
+{
+    if (value < 0) {
+        bplist_out_byte(out, 0x13);
+        bplist_out_be(out, value, 8);
+    } else if (value <= 0xff) {
+        bplist_out_byte(out, 0x10);
+        bplist_out_be(out, value, 1);
+    } else if (value <= 0xffff) {
+        bplist_out_byte(out, 0x11);
+        bplist_out_be(out, value, 2);
+    } else if (value <= 0xffffffffLL) {
+        bplist_out_byte(out, 0x12);
+        bplist_out_be(out, value, 4);
+    } else {
+        bplist_out_byte(out, 0x13);
+        bplist_out_be(out, value, 8);
+    }
+}
+
+void bplist_out_trailer(bplist_output *out, int offset_size, int ref_size, uint64_t nobjects,
+    uint64_t root, uint64_t offset_table)
+{
+    static const uint8_t padding[6] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
+
+    bplist_out_bytes(out, padding, sizeof(padding));
+    bplist_out_byte(out, offset_size);
+    bplist_out_byte(out, ref_size);
+    bplist_out_be(out, nobjects, 8);
+    bplist_out_be(out, root, 8);
+    bplist_out_be(out, offset_table, 8);
+}
+
+void bplist_out_magic(bplist_output *out)
+{
+    bplist_out_bytes(out, BPLIST_MAGIC, BPLIST_MAGIC_SIZE);
+    bplist_out_bytes(out, BPLIST_VERSION, BPLIST_VERSION_SIZE);
+}
+
+/* Null, bools, ints, reals, dates and uids; i holds the marker for kind 0 */
+void bplist_out_scalar(bplist_output *out, int kind, int wide, int64_t i, double r)
+{
+    uint64_t bits;
+
+    switch (kind) {
+    case BPLIST_UINT:
+        if (wide) {
+            /* 128 bit form, the value in the low half */
+            bplist_out_byte(out, 0x14);
+            bplist_out_be(out, 0, 8);
+            bplist_out_be(out, i, 8);
+        } else {
+            bplist_out_int(out, i);
+        }
+        break;
+    case BPLIST_REAL:
+    case BPLIST_DATE:
+        memcpy(&bits, &r, sizeof bits);
+        bplist_out_byte(out, (kind << 4) | 3);
+        bplist_out_be(out, bits, 8);
+        break;
+    case BPLIST_UID:
+        bplist_out_byte(out, 0x80 + bplist_offset_size(i) - 1);
+        bplist_out_be(out, i, bplist_offset_size(i));
+        break;
+    default:
+        /* null, true and false are their own marker byte */
+        bplist_out_byte(out, (uint8_t)i);
+    }
+}
+
+/* Builder */
+
+typedef struct bplist_entry {
+    uint8_t kind;
+    /* Unsigned int above INT64_MAX, written in the 128 bit form */
+    uint8_t wide;
+    /* Marker byte for kind 0, int and uid values, real and date seconds */
+    union {
+        int64_t i;
+        double r;
+    } value;
+    /* Payload position in the arena, or of the first ref of a container */
+    size_t at;
+    /* Payload bytes, or number of refs */
+    size_t length;
+    /* Length written in the header: bytes, UTF-16 units or entries */
+    uint64_t count;
+    uint64_t offset;
+} bplist_entry;
+
+/* An open container, its children's refs start at pending[start] */
+typedef struct bplist_frame {
+    uint64_t id;
+    size_t start;
+} bplist_frame;
+
+struct bplist_builder {
+    int flags;
+    bplist_entry *entries;
+    size_t nentries;
+    size_t entries_cap;
+    /* Child refs of finished containers */
+    uint64_t *refs;
+    size_t nrefs;
+    size_t refs_cap;
+    /* Child refs of the containers still open, innermost last */
+    uint64_t *pending;
+    size_t npending;
+    size_t pending_cap;
+    bplist_frame *stack;
+    size_t depth;
+    size_t stack_cap;
+    /* Copies of string and data payloads */
+    uint8_t *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    intern_table interned;
+    uint64_t root;
+    int complete;
+    /* Layout from bplist_size */
+    int sized;
+    int ref_size;
+    int offset_size;
+    uint64_t offset_table;
+    uint64_t size;
+    const char *error;
+};
+
+static int fail(bplist_builder *b, const char *error)
+{
+    b->error = error;
+    return BPLIST_ERROR;
+}
+
+/* Make room for need more items of unit bytes in *p */
+static int reserve(bplist_builder *b, void **p, size_t *cap, size_t len, size_t need,
+    size_t unit)
+{
+    size_t n = *cap ? *cap : 64;
+    void *grown;
+
+    if (len + need <= *cap) {
+        return BPLIST_OK;
+    }
+    while (n < len + need) {
+        n *= 2;
+    }
+    if (!(grown = realloc(*p, n * unit))) {
+        return fail(b, "out of memory");
+    }
+    *p = grown;
+    *cap = n;
+    return BPLIST_OK;
+}
+
+bplist_builder *bplist_builder_new(int flags)
+{
+    bplist_builder *b = calloc(1, sizeof(bplist_builder));
+
+    if (b) {
+        b->flags = flags;
+        if ((flags & BPLIST_UNIQUE) && intern_init(&b->interned, 0) != 0) {
+            free(b);
+            return NULL;
+        }
+    }
+    return b;
+}
+
+void bplist_builder_free(bplist_builder *b)
+{
+    if (!b) {
+        return;
+    }
+    free(b->entries);
+    free(b->refs);
+    free(b->pending);
+    free(b->stack);
+    free(b->arena);
+    intern_free(&b->interned);
+    free(b);
+}
+
+void bplist_builder_reset(bplist_builder *b)
+{
+    b->nentries = b->nrefs = b->npending = b->depth = b->arena_len = 0;
+    b->complete = b->sized = 0;
+    b->error = NULL;
+    intern_clear(&b->interned);
+}
+
+const char *bplist_error(const bplist_builder *b)
+{
+    return b->error;
+}
+
+/* The next value goes in a dict's key slot */
+static int wants_key(const bplist_builder *b)
+{
+    const bplist_frame *frame;
+
+    if (!b->depth) {
+        return 0;
+    }
+    frame = &b->stack[b->depth - 1];
+    return b->entries[frame->id].kind == BPLIST_DICT && (b->npending - frame->start) % 2 == 0;
+}
+
+/* Hand a finished value to its container, or make it the root */
+static int place(bplist_builder *b, uint64_t id)
+{
+    if (!b->depth) {
+        b->root = id;
+        b->complete = 1;
+        return BPLIST_OK;
+    }
+    if (reserve(b, (void **)&b->pending, &b->pending_cap, b->npending, 1,
+        sizeof(uint64_t)) != BPLIST_OK) {
+        return BPLIST_ERROR;
+    }
+    b->pending[b->npending++] = id;
+    return BPLIST_OK;
+}
+
+static int check_slot(bplist_builder *b, int kind)
+{
+    if (b->complete) {
+        return fail(b, "the root value is already complete");
+    }
+    if (kind != BPLIST_STRING && kind != BPLIST_UNICODE && wants_key(b)) {
+        return fail(b, "dict keys must be strings");
+    }
+    return BPLIST_OK;
+}
+
+static bplist_entry *new_entry(bplist_builder *b)
+{
+    bplist_entry *entry;
+
+    if (reserve(b, (void **)&b->entries, &b->entries_cap, b->nentries, 1,
+        sizeof(bplist_entry)) != BPLIST_OK) {
+        return NULL;
+    }
+    b->sized = 0;
+    entry = &b->entries[b->nentries];
+    memset(entry, 0, sizeof(bplist_entry));
+    return entry;
+}
+
+/* Add a scalar whose key for unique is its kind and value bits */
+static int add_value(bplist_builder *b, int kind, int wide, int64_t i, double r)
+{
+    bplist_entry *entry;
+    uint64_t bits;
+    long id = b->nentries;
+
+    if (check_slot(b, kind) != BPLIST_OK || !(entry = new_entry(b))) {
+        return BPLIST_ERROR;
+    }
+    entry->kind = kind;
+    entry->wide = wide;
+    if (kind == BPLIST_REAL || kind == BPLIST_DATE) {
+        entry->value.r = r;
+        memcpy(&bits, &r, sizeof bits);
+    } else {
+        entry->value.i = i;
+        bits = (uint64_t)i;
+    }
+    if ((b->flags & BPLIST_UNIQUE)
+        && (id = intern_lookup(&b->interned, wide ? kind | 0x40 : kind, bits, id)) < 0) {
+        return fail(b, "out of memory");
+    }
+    if ((size_t)id == b->nentries) {
+        b->nentries++;
+    }
+    return place(b, id);
+}
+
+/* Add a string or data payload, merged with an equal one when unique */
+static int add_payload(bplist_builder *b, int kind, const void *data, size_t len,
+    uint64_t count)
+{
+    bplist_entry *entry, *other;
+    long id = b->nentries, first;
+
+    if (check_slot(b, kind) != BPLIST_OK || !(entry = new_entry(b))) {
+        return BPLIST_ERROR;
+    }
+    if (b->flags & BPLIST_UNIQUE) {
+        first = intern_lookup(&b->interned, kind | 0x10, intern_hash_bytes(data, len), id);
+        if (first < 0) {
+            return fail(b, "out of memory");
+        }
+        other = &b->entries[first];
+        if (first != id && other->kind == kind && other->length == len
+            && memcmp(b->arena + other->at, data, len) == 0) {
+            return place(b, first);
+        }
+    }
+    if (reserve(b, (void **)&b->arena, &b->arena_cap, b->arena_len, len, 1) != BPLIST_OK) {
+        return BPLIST_ERROR;
+    }
+    entry = &b->entries[id];
+    entry->kind = kind;
+    entry->at = b->arena_len;
+    entry->length = len;
+    entry->count = count;
+    memcpy(b->arena + b->arena_len, data, len);
+    b->arena_len += len;
+    b->nentries++;
+    return place(b, id);
+}
+
+static int begin(bplist_builder *b, int kind)
+{
+    bplist_entry *entry;
+
+    if (check_slot(b, kind) != BPLIST_OK || !(entry = new_entry(b))
+        || reserve(b, (void **)&b->stack, &b->stack_cap, b->depth, 1,
+            sizeof(bplist_frame)) != BPLIST_OK) {
+        return BPLIST_ERROR;
+    }
+    entry->kind = kind;
+    b->stack[b->depth].id = b->nentries++;
+    b->stack[b->depth].start = b->npending;
+    b->depth++;
+    return BPLIST_OK;
+}
+
+int bplist_begin_array(bplist_builder *b)
+{
+    return begin(b, BPLIST_ARRAY);
+}
+
+int bplist_begin_dict(bplist_builder *b)
+{
+    return begin(b, BPLIST_DICT);
+}
+
+/* Close the innermost container, dicts store all keys then all values */
+int bplist_end(bplist_builder *b)
+{
+    bplist_frame *frame;
+    bplist_entry *entry;
+    uint64_t *children;
+    size_t i, n;
+
+    if (!b->depth) {
+        return fail(b, "no container is open");
+    }
+    frame = &b->stack[b->depth - 1];
+    entry = &b->entries[frame->id];
+    children = b->pending + frame->start;
+    n = b->npending - frame->start;
+    if (entry->kind == BPLIST_DICT && n % 2) {
+        return fail(b, "dict key has no value");
+    }
+    if (reserve(b, (void **)&b->refs, &b->refs_cap, b->nrefs, n, sizeof(uint64_t))
+        != BPLIST_OK) {
+        return BPLIST_ERROR;
+    }
+    entry->at = b->nrefs;
+    entry->length = n;
+    if (entry->kind == BPLIST_DICT) {
+        entry->count = n / 2;
+        for (i = 0; i < n / 2; i++) {
+            b->refs[b->nrefs + i] = children[2 * i];
+            b->refs[b->nrefs + n / 2 + i] = children[2 * i + 1];
+        }
+    } else {
+        entry->count = n;
+        memcpy(b->refs + b->nrefs, children, n * sizeof(uint64_t));
+    }
+    b->nrefs += n;
+    b->npending = frame->start;
+    b->depth--;
+    b->sized = 0;
+    return place(b, frame->id);
+}
+
+int bplist_add_null(bplist_builder *b)
+{
+    return add_value(b, 0, 0, BPLIST_NULL, 0);
+}
+
+int bplist_add_bool(bplist_builder *b, int value)
+{
+    return add_value(b, 0, 0, value ? BPLIST_TRUE : BPLIST_FALSE, 0);
+}
+
+int bplist_add_int(bplist_builder *b, int64_t value)
+{
+    return add_value(b, BPLIST_UINT, 0, value, 0);
+}
+
+int bplist_add_uint(bplist_builder *b, uint64_t value)
+{
+    return add_value(b, BPLIST_UINT, value > INT64_MAX, (int64_t)value, 0);
+}
+
+int bplist_add_real(bplist_builder *b, double value)
+{
+    return add_value(b, BPLIST_REAL, 0, 0, value);
+}
+
+int bplist_add_date(bplist_builder *b, double seconds)
+{
+    return add_value(b, BPLIST_DATE, 0, 0, seconds - BPLIST_EPOCH_OFFSET);
+}
+
+int bplist_add_uid(bplist_builder *b, uint64_t value)
+{
+    return add_value(b, BPLIST_UID, 0, (int64_t)value, 0);
+}
+
+int bplist_add_data(bplist_builder *b, const void *data, size_t len)
+{
+    return add_payload(b, BPLIST_DATA, data, len, len);
+}
+
+/*
+ * Decode one UTF-8 sequence at s[*i], rejecting overlong forms,
+ * surrogates and values past U+10FFFF. Returns -1 when invalid.
+ */
+static int32_t utf8_next(const uint8_t *s, size_t n, size_t *i)
+{
+    uint32_t c = s[*i], min;
+    int extra, k;
+
+    if (c < 0x80) {
+        (*i)++;
+        return c;
+    } else if ((c & 0xE0) == 0xC0) {
+        extra = 1;
+        min = 0x80;
+        c &= 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+        extra = 2;
+        min = 0x800;
+        c &= 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+        extra = 3;
+        min = 0x10000;
+        c &= 0x07;
+    } else {
+        return -1;
+    }
+    if (*i + extra >= n) {
+        return -1;
+    }
+    for (k = 1; k <= extra; k++) {
+        if ((s[*i + k] & 0xC0) != 0x80) {
+            return -1;
+        }
+        c = (c << 6) | (s[*i + k] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) {
+        return -1;
+    }
+    *i += extra + 1;
+    return c;
+}
+
+int bplist_add_string(bplist_builder *b, const char *utf8, size_t len)
+{
+    const uint8_t *s = (const uint8_t *)utf8;
+    size_t i = 0;
+    uint64_t units = 0;
+    int ascii = 1;
+    int32_t c;
+
+    while (i < len) {
+        if ((c = utf8_next(s, len, &i)) < 0) {
+            return fail(b, "string is not valid UTF-8");
+        }
+        ascii &= c < 0x80;
+        units += c < 0x10000 ? 1 : 2;
+    }
+    return add_payload(b, ascii ? BPLIST_STRING : BPLIST_UNICODE, utf8, len, units);
+}
+
+static void write_utf16(bplist_output *out, const uint8_t *s, size_t n)
+{
+    size_t i = 0;
+    uint32_t c;
+
+    while (i < n) {
+        /* validated when it was added */
+        c = utf8_next(s, n, &i);
+        if (c < 0x10000) {
+            bplist_out_be(out, c, 2);
+        } else {
+            c -= 0x10000;
+            bplist_out_be(out, 0xD800 + (c >> 10), 2);
+            bplist_out_be(out, 0xDC00 + (c & 0x3FF), 2);
+        }
+    }
+}
+
+static uint64_t entry_size(const bplist_builder *b, const bplist_entry *entry)
+{
+    uint64_t payload = entry->length;
+
+    if (entry->kind == BPLIST_UNICODE) {
+        payload = entry->count * 2;
+    } else if (entry->kind == BPLIST_ARRAY || entry->kind == BPLIST_DICT) {
+        payload = (uint64_t)entry->length * b->ref_size;
+    }
+    return bplist_object_size(entry->kind, entry->wide, entry->value.i, entry->count, payload);
+}
+
+static void write_entry(const bplist_builder *b, bplist_output *out, const bplist_entry *entry)
+{
+    size_t i;
+
+    switch (entry->kind) {
+    case BPLIST_DATA:
+    case BPLIST_STRING:
+        bplist_out_header(out, entry->kind, entry->count);
+        bplist_out_bytes(out, b->arena + entry->at, entry->length);
+        break;
+    case BPLIST_UNICODE:
+        bplist_out_header(out, entry->kind, entry->count);
+        write_utf16(out, b->arena + entry->at, entry->length);
+        break;
+    case BPLIST_ARRAY:
+    case BPLIST_DICT:
+        bplist_out_header(out, entry->kind, entry->count);
+        for (i = 0; i < entry->length; i++) {
+            bplist_out_be(out, b->refs[entry->at + i], b->ref_size);
+        }
+        break;
+    default:
+        bplist_out_scalar(out, entry->kind, entry->wide, entry->value.i, entry->value.r);
+    }
+}
+
+int64_t bplist_size(bplist_builder *b)
+{
+    uint64_t pos = BPLIST_HEADER_SIZE;
+    size_t i;
+
+    if (!b->complete) {
+        fail(b, b->depth ? "a container is still open" : "nothing was added");
+        return -1;
+    }
+    if (!b->sized) {
+        b->ref_size = bplist_ref_size(b->nentries);
+        for (i = 0; i < b->nentries; i++) {
+            b->entries[i].offset = pos;
+            pos += entry_size(b, &b->entries[i]);
+        }
+        b->offset_table = pos;
+        b->offset_size = bplist_offset_size(pos);
+        b->size = pos + (uint64_t)b->offset_size * b->nentries + BPLIST_TRAILER_SIZE;
+        b->sized = 1;
+    }
+    return (int64_t)b->size;
+}
+
+static int write_all(bplist_builder *b, bplist_output *out)
+{
+    size_t i;
+
+    bplist_out_magic(out);
+    for (i = 0; i < b->nentries; i++) {
+        write_entry(b, out, &b->entries[i]);
+    }
+    for (i = 0; i < b->nentries; i++) {
+        bplist_out_be(out, b->entries[i].offset, b->offset_size);
+    }
+    bplist_out_trailer(out, b->offset_size, b->ref_size, b->nentries, b->root, b->offset_table);
+    if (out->flush) {
+        bplist_output_flush(out);
+    }
+    return out->failed ? fail(b, "failed to write output") : BPLIST_OK;
+}
+
+int bplist_write(bplist_builder *b, uint8_t *data, size_t size)
+{
+    bplist_output out;
+
+    if (bplist_size(b) < 0) {
+        return BPLIST_ERROR;
+    }
+    if (size < b->size) {
+        return fail(b, "output buffer is too small");
+    }
+    bplist_output_init(&out, data, size, NULL, NULL);
+    return write_all(b, &out);
+}
+
+int bplist_write_to(bplist_builder *b, bplist_flush flush, void *sink, uint8_t *chunk,
+    size_t chunk_size)
+{
+    bplist_output out;
+
+    if (bplist_size(b) < 0) {
+        return BPLIST_ERROR;
+    }
+    if (chunk_size < 16) {
+        return fail(b, "chunk_size is too small");
+    }
+    bplist_output_init(&out, chunk, chunk_size, flush, sink);
+    return write_all(b, &out);
+}
+
+int bplist_finish(bplist_builder *b, uint8_t **data, size_t *len)
+{
+    uint8_t *buf;
+
+    if (bplist_size(b) < 0) {
+        return BPLIST_ERROR;
+    }
+    if (!(buf = malloc(b->size))) {
+        return fail(b, "out of memory");
+    }
+    if (bplist_write(b, buf, b->size) != BPLIST_OK) {
+        free(buf);
+        return BPLIST_ERROR;
+    }
+    *data = buf;
+    *len = b->size;
+    return BPLIST_OK;
+}
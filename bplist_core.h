@@ -0,0 +1,242 @@
+/*
+ * libbplist: binary plist writing in plain C, without python.
+ *
+ * The output layer (a window over a full sized buffer or a chunk that is
+ * flushed to a callback) and the object encodings are shared with the
+ * python extension. The builder on top lets native code produce a plist
+ * by streaming values into it:
+ *
+ *     bplist_builder *b = bplist_builder_new(BPLIST_UNIQUE);
+ *     bplist_begin_dict(b);
+ *     bplist_add_string(b, "badge", 5);
+ *     bplist_add_int(b, 3);
+ *     bplist_end(b);
+ *     bplist_finish(b, &data, &len);
+ *
+ * Every call returns BPLIST_OK or BPLIST_ERROR, bplist_error() says why.
+ *
+ */
+#ifndef BPLIST_CORE_H
+#define BPLIST_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BPLIST_OK               0
+#define BPLIST_ERROR            1
+
+#define BPLIST_MAGIC            ((uint8_t*)"bplist")
+#define BPLIST_MAGIC_SIZE       6
+
+#define BPLIST_VERSION          ((uint8_t*)"00")
+#define BPLIST_VERSION_SIZE     3
+
+/* Magic and version at the start of every plist */
+#define BPLIST_HEADER_SIZE      (BPLIST_MAGIC_SIZE + BPLIST_VERSION_SIZE)
+#define BPLIST_TRAILER_SIZE     32
+/* Seconds from the unix epoch to the plist epoch, 2001-01-01 */
+#define BPLIST_EPOCH_OFFSET     978307200
+
+enum
+{
+    BPLIST_NULL = 0x00,
+    BPLIST_FALSE = 0x08,
+    BPLIST_TRUE = 0x09,
+    BPLIST_FILL = 0x0F,                 /* will be used for length grabbing */
+    BPLIST_UINT = 0x1,
+    BPLIST_REAL = 0x2,
+    BPLIST_DATE = 0x3,
+    BPLIST_DATA = 0x4,
+    BPLIST_STRING = 0x5,
+    BPLIST_UNICODE = 0x6,
+    BPLIST_UID = 0x8,
+    BPLIST_ARRAY = 0xA,
+    BPLIST_SET = 0xC,
+    BPLIST_DICT = 0xD,
+    BPLIST_MASK = 0xF
+};
+
+/* Receives each filled chunk when streaming, returns BPLIST_OK */
+typedef int (*bplist_flush)(void *sink, const uint8_t *data, size_t len);
+/*
+ * Optional, receives the pending part of the chunk and a payload too
+ * large to copy through it in one go, for sinks that can gather them
+ * into one write. Returns BPLIST_OK.
+ */
+typedef int (*bplist_gather)(void *sink, const uint8_t *head, size_t head_len,
+    const uint8_t *data, size_t len);
+
+/*
+ * Output window. cursor moves from buffer towards limit; when it gets
+ * there the window is passed to flush (if set) and reused. Without a
+ * flush the buffer must hold the whole output, filling it is an error.
+ */
+typedef struct bplist_output {
+    uint8_t *buffer;
+    uint8_t *cursor;
+    uint8_t *limit;
+    bplist_flush flush;
+    bplist_gather gather;
+    void *sink;
+    /* Bytes handed to flush so far */
+    uint64_t flushed;
+    int failed;
+} bplist_output;
+
+void bplist_output_init(bplist_output *out, uint8_t *buffer, size_t size, bplist_flush flush,
+    void *sink);
+void bplist_output_flush(bplist_output *out);
+void bplist_out_bytes(bplist_output *out, const void *bytes, size_t len);
+void bplist_out_header(bplist_output *out, int kind, uint64_t count);
+void bplist_out_int(bplist_output *out, int64_t value);
+void bplist_out_magic(bplist_output *out);
+void bplist_out_scalar(bplist_output *out, int kind, int wide, int64_t i, double r);
+void bplist_out_trailer(bplist_output *out, int offset_size, int ref_size, uint64_t nobjects,
+    uint64_t root, uint64_t offset_table);
+
+static inline uint64_t bplist_output_position(const bplist_output *out)
+{
+    return out->flushed + (out->cursor - out->buffer);
+}
+
+static inline void bplist_out_byte(bplist_output *out, uint8_t b)
+{
+    if (out->cursor == out->limit) {
+        bplist_output_flush(out);
+    }
+    *out->cursor++ = b;
+}
+
+static inline uint64_t bplist_to_be64(uint64_t value)
+{
+#ifdef WORDS_BIGENDIAN
+    return value;
+#else
+    return __builtin_bswap64(value);
+#endif
+}
+
+/* The low nbytes of value, big endian */
+static inline void bplist_out_be(bplist_output *out, uint64_t value, int nbytes)
+{
+    uint64_t be;
+    int i;
+
+    if (out->limit - out->cursor >= 8) {
+        /* move the wanted bytes to the top, swap once, store all 8 */
+        be = bplist_to_be64(value << (64 - 8 * nbytes));
+        memcpy(out->cursor, &be, 8);
+        out->cursor += nbytes;
+        return;
+    }
+    for (i = (nbytes - 1); i >= 0; i--) {
+        bplist_out_byte(out, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+/* Encoded sizes, matching the bplist_out_* writers */
+static inline int bplist_int_size(int64_t value)
+{
+    if (value < 0) return 9;
+    if (value <= 0xff) return 2;
+    if (value <= 0xffff) return 3;
+    if (value <= 0xffffffffLL) return 5;
+    return 9;
+}
+
+static inline int bplist_header_size(uint64_t count)
+{
+    if (count < 15) return 1;
+    if (count < 256) return 3;
+    if (count < 65536) return 4;
+    if (count < 4294967296ULL) return 6;
+    return 10;
+}
+
+/* Width of offsets and of uid values */
+static inline int bplist_offset_size(uint64_t n)
+{
+    if (n < 256) return 1;
+    if (n < 65536) return 2;
+    if (n < 4294967296ULL) return 4;
+    return 8;
+}
+
+/* Width of the refs needed to address n objects */
+static inline int bplist_ref_size(uint64_t n)
+{
+    if (n < 256) return 1;
+    if (n < 65536) return 2;
+    if (n < 4294967296ULL) return 4;
+    return 8;
+}
+
+/*
+ * Encoded size of an object, matching bplist_out_scalar for the scalar
+ * kinds. payload is what follows the header of strings, data and
+ * containers: their bytes, UTF-16 units times two or refs times the ref
+ * width. wide marks an unsigned int above INT64_MAX.
+ */
+static inline uint64_t bplist_object_size(int kind, int wide, int64_t i, uint64_t count,
+    uint64_t payload)
+{
+    switch (kind) {
+    case BPLIST_UINT:
+        return wide ? 17 : bplist_int_size(i);
+    case BPLIST_REAL:
+    case BPLIST_DATE:
+        return 9;
+    case BPLIST_UID:
+        return 1 + bplist_offset_size(i);
+    case BPLIST_DATA:
+    case BPLIST_STRING:
+    case BPLIST_UNICODE:
+    case BPLIST_ARRAY:
+    case BPLIST_DICT:
+        return bplist_header_size(count) + payload;
+    }
+    return 1;
+}
+
+/* Builder */
+
+/* Merge equal scalars into one object */
+#define BPLIST_UNIQUE           1
+
+typedef struct bplist_builder bplist_builder;
+
+bplist_builder *bplist_builder_new(int flags);
+void bplist_builder_free(bplist_builder *b);
+/* Start over, keeping the storage of earlier plists */
+void bplist_builder_reset(bplist_builder *b);
+const char *bplist_error(const bplist_builder *b);
+
+int bplist_begin_array(bplist_builder *b);
+int bplist_begin_dict(bplist_builder *b);
+int bplist_end(bplist_builder *b);
+
+int bplist_add_null(bplist_builder *b);
+int bplist_add_bool(bplist_builder *b, int value);
+int bplist_add_int(bplist_builder *b, int64_t value);
+int bplist_add_uint(bplist_builder *b, uint64_t value);
+int bplist_add_real(bplist_builder *b, double value);
+/* Seconds since the unix epoch */
+int bplist_add_date(bplist_builder *b, double seconds);
+/* UTF-8, written as ASCII when it is, UTF-16 otherwise */
+int bplist_add_string(bplist_builder *b, const char *utf8, size_t len);
+int bplist_add_data(bplist_builder *b, const void *data, size_t len);
+int bplist_add_uid(bplist_builder *b, uint64_t value);
+
+/*
+ * Output, once the root value is complete. bplist_size is exact;
+ * bplist_write fills a buffer of at least that size, bplist_write_to
+ * streams through chunk, and bplist_finish returns a malloc'd copy.
+ */
+int64_t bplist_size(bplist_builder *b);
+int bplist_write(bplist_builder *b, uint8_t *data, size_t size);
+int bplist_write_to(bplist_builder *b, bplist_flush flush, void *sink, uint8_t *chunk,
+    size_t chunk_size);
+int bplist_finish(bplist_builder *b, uint8_t **data, size_t *len);
+
+#endif
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bplist_core.h"
+
+
+/*
+ * make check: builds plists through libbplist and compares them byte for
+ * byte with hand assembled ones.
+ *
+ */
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static const uint8_t header[] = {'b', 'p', 'l', 'i', 's', 't', '0', '0', 0};
+
+/* Trailer of a plist with one byte offsets and refs */
+static void put_trailer(uint8_t *p, uint8_t nobjects, uint8_t offset_table)
+{
+    memset(p, 0, BPLIST_TRAILER_SIZE);
+    p[6] = 1;
+    p[7] = 1;
+    p[15] = nobjects;
+    p[31] = offset_table;
+}
+
+static void check_bytes(bplist_builder *b, const uint8_t *want, size_t want_len)
+{
+    uint8_t *data = NULL;
+    size_t len = 0;
+
+    CHECK(bplist_size(b) == (int64_t)want_len);
+    CHECK(bplist_finish(b, &data, &len) == BPLIST_OK);
+    CHECK(len == want_len && memcmp(data, want, len) == 0);
+    free(data);
+}
+
+/* {"a": 1} */
+static void test_dict(void)
+{
+    bplist_builder *b = bplist_builder_new(BPLIST_UNIQUE);
+    uint8_t want[51];
+    static const uint8_t objects[] = {
+        0xD1, 0x01, 0x02,               /* dict, key ref 1, value ref 2 */
+        0x51, 'a',
+        0x10, 0x01,
+        0x09, 0x0C, 0x0E,               /* offset table */
+    };
+
+    memcpy(want, header, sizeof(header));
+    memcpy(want + sizeof(header), objects, sizeof(objects));
+    put_trailer(want + sizeof(header) + sizeof(objects), 3, 16);
+
+    CHECK(bplist_begin_dict(b) == BPLIST_OK);
+    CHECK(bplist_add_string(b, "a", 1) == BPLIST_OK);
+    CHECK(bplist_add_int(b, 1) == BPLIST_OK);
+    CHECK(bplist_end(b) == BPLIST_OK);
+    check_bytes(b, want, sizeof(want));
+    bplist_builder_free(b);
+}
+
+/* ["é", 2**64 - 1, Uid(300), True, 1.5] */
+static void test_scalars(void)
+{
+    bplist_builder *b = bplist_builder_new(0);
+    uint8_t want[86];
+    static const uint8_t objects[] = {
+        0xA5, 0x01, 0x02, 0x03, 0x04, 0x05,
+        0x61, 0x00, 0xE9,               /* UTF-16 */
+        0x14, 0, 0, 0, 0, 0, 0, 0, 0,   /* 128 bit form */
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0x81, 0x01, 0x2C,
+        0x09,
+        0x23, 0x3F, 0xF8, 0, 0, 0, 0, 0, 0,
+        0x09, 0x0F, 0x12, 0x23, 0x26, 0x27,
+    };
+
+    memcpy(want, header, sizeof(header));
+    memcpy(want + sizeof(header), objects, sizeof(objects));
+    put_trailer(want + sizeof(header) + sizeof(objects), 6, 48);
+
+    CHECK(bplist_begin_array(b) == BPLIST_OK);
+    CHECK(bplist_add_string(b, "\xC3\xA9", 2) == BPLIST_OK);
+    CHECK(bplist_add_uint(b, UINT64_MAX) == BPLIST_OK);
+    CHECK(bplist_add_uid(b, 300) == BPLIST_OK);
+    CHECK(bplist_add_bool(b, 1) == BPLIST_OK);
+    CHECK(bplist_add_real(b, 1.5) == BPLIST_OK);
+    CHECK(bplist_end(b) == BPLIST_OK);
+    check_bytes(b, want, sizeof(want));
+    bplist_builder_free(b);
+}
+
+typedef struct collected {
+    uint8_t data[256];
+    size_t len;
+} collected;
+
+static int collect(void *sink, const uint8_t *data, size_t len)
+{
+    collected *c = sink;
+
+    if (c->len + len > sizeof(c->data)) {
+        return BPLIST_ERROR;
+    }
+    memcpy(c->data + c->len, data, len);
+    c->len += len;
+    return BPLIST_OK;
+}
+
+/* Streaming through a small chunk gives the same bytes */
+static void test_write_to(void)
+{
+    bplist_builder *b = bplist_builder_new(BPLIST_UNIQUE);
+    collected c = {{0}, 0};
+    uint8_t chunk[16], *data = NULL;
+    size_t len = 0;
+
+    CHECK(bplist_begin_array(b) == BPLIST_OK);
+    CHECK(bplist_add_string(b, "a string longer than one chunk", 30) == BPLIST_OK);
+    CHECK(bplist_add_string(b, "a string longer than one chunk", 30) == BPLIST_OK);
+    CHECK(bplist_add_date(b, BPLIST_EPOCH_OFFSET) == BPLIST_OK);
+    CHECK(bplist_end(b) == BPLIST_OK);
+    CHECK(bplist_finish(b, &data, &len) == BPLIST_OK);
+    CHECK(bplist_write_to(b, collect, &c, chunk, sizeof(chunk)) == BPLIST_OK);
+    CHECK(c.len == len && memcmp(c.data, data, len) == 0);
+    /* unique: one string object, three in all */
+    CHECK(data[len - 17] == 3);
+    free(data);
+    bplist_builder_free(b);
+}
+
+static void test_errors(void)
+{
+    bplist_builder *b = bplist_builder_new(0);
+
+    CHECK(bplist_size(b) < 0 && bplist_error(b) != NULL);
+    CHECK(bplist_begin_dict(b) == BPLIST_OK);
+    CHECK(bplist_add_int(b, 1) == BPLIST_ERROR);
+    CHECK(bplist_add_string(b, "\xC3", 1) == BPLIST_ERROR);
+    CHECK(bplist_add_string(b, "k", 1) == BPLIST_OK);
+    CHECK(bplist_end(b) == BPLIST_ERROR);
+    bplist_builder_reset(b);
+    CHECK(bplist_add_null(b) == BPLIST_OK);
+    CHECK(bplist_add_null(b) == BPLIST_ERROR);
+    bplist_builder_free(b);
+}
+
+int main(void)
+{
+    test_dict();
+    test_scalars();
+    test_write_to();
+    test_errors();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("bplist_test: ok\n");
+    return 0;
+}
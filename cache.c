@@ -0,0 +1,368 @@
+#include "binaryplist.h"
+
+
+/*
+ * Subtree cache of an Encoder created with cache=n. Values that cannot
+ * change once built are flattened once by a private scratch encoder:
+ * anything wrapped in binaryplist.Frozen as soon as it is met, exact
+ * tuples of immutable values once the encode before met them too, so
+ * tuples built fresh for every call are not flattened for nothing. The
+ * resulting entries and refs, numbered from 0, are kept keyed on the
+ * identity of the value; every encode that reaches the same object again
+ * copies them in with the ids rebased instead of walking it.
+ *
+ * Each block holds the value and the objects its entries point into, so
+ * neither the address nor the payloads can go away. With unique, a block
+ * reached twice in one encode is copied once; blocks are not otherwise
+ * merged with the rest of the plist. When n blocks are held the least
+ * recently used one makes room. The whole cache is dropped when
+ * register_type changes the registry the blocks were converted with.
+ *
+ */
+
+typedef struct cache_block {
+    /* The cached value, owned */
+    PyObject *key;
+    /* PyList of everything the entries point into */
+    PyObject *keep;
+    binaryplist_object *entries;
+    Py_ssize_t nentries;
+    long *refs;
+    Py_ssize_t nrefs;
+    long root;
+    /* Id it was copied to in encode number epoch, reused when unique */
+    long copied;
+    unsigned long epoch;
+    /* Neighbours in use order, -1 past either end */
+    long newer;
+    long older;
+} cache_block;
+
+struct binaryplist_cache {
+    /* Flattens misses, with the owner's options but no cache */
+    binaryplist_encoder scratch;
+    cache_block *blocks;
+    Py_ssize_t nblocks;
+    Py_ssize_t max_blocks;
+    /* Map of key pointer to its block */
+    ptrmap index;
+    long newest;
+    long oldest;
+    /* Tuples met by this encode and the one before */
+    ptrmap seen;
+    ptrmap last_seen;
+    /* Tuples found to hold something mutable in this encode */
+    ptrmap mutable;
+    unsigned long generation;
+    /* Counts encodes, see cache_start */
+    unsigned long epoch;
+};
+
+/* Nested tuples deeper than this are simply not cached */
+#define CACHE_MAX_DEPTH 64
+
+/* 1 if object can never change, 0 if it might, -1 on error */
+static int is_immutable(struct binaryplist_cache *cache, PyObject *object, int depth)
+{
+    const binaryplist_dispatch *type;
+    Py_ssize_t i;
+    long found;
+    int status;
+
+    if (!(type = types_lookup(object))) {
+        return -1;
+    }
+    switch (type->cls) {
+    case TYPE_NONE:
+    case TYPE_BOOL:
+    case TYPE_INT:
+    case TYPE_FLOAT:
+    case TYPE_STRING:
+    case TYPE_UNICODE:
+    case TYPE_DATE:
+    case TYPE_DATA:
+    case TYPE_UID:
+    case TYPE_FROZEN:
+        return 1;
+    case TYPE_ARRAY:
+        if (!PyTuple_CheckExact(object) || depth >= CACHE_MAX_DEPTH
+            || ptrmap_get(&cache->mutable, object, &found)) {
+            return 0;
+        }
+        for (i = 0; i < PyTuple_GET_SIZE(object); i++) {
+            if ((status = is_immutable(cache, PyTuple_GET_ITEM(object, i), depth + 1)) != 1) {
+                /* only the negative is kept, a freed tuple's address may be reused */
+                if (status == 0 && ptrmap_set(&cache->mutable, object, 0) != 0) {
+                    PyErr_NoMemory();
+                    return -1;
+                }
+                return status;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+struct binaryplist_cache *cache_new(binaryplist_encoder *encoder, Py_ssize_t max_blocks)
+{
+    struct binaryplist_cache *cache;
+    binaryplist_encoder *scratch;
+
+    if (!(cache = calloc(1, sizeof(struct binaryplist_cache)))
+        || !(cache->blocks = calloc(max_blocks, sizeof(cache_block)))
+        || ptrmap_init(&cache->index, 0) != 0
+        || ptrmap_init(&cache->seen, 0) != 0
+        || ptrmap_init(&cache->last_seen, 0) != 0
+        || ptrmap_init(&cache->mutable, 0) != 0) {
+        if (cache) {
+            free(cache->blocks);
+            ptrmap_free(&cache->index);
+            ptrmap_free(&cache->seen);
+            ptrmap_free(&cache->last_seen);
+        }
+        free(cache);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    cache->max_blocks = max_blocks;
+    cache->newest = cache->oldest = -1;
+    cache->generation = types_generation;
+    cache->epoch = 1;
+    scratch = &cache->scratch;
+    scratch->dounique = encoder->dounique;
+    scratch->convert_nulls = encoder->convert_nulls;
+    scratch->object_hook = encoder->object_hook;
+    scratch->max_recursion = encoder->max_recursion;
+    if (ptrmap_init(&scratch->ref_table, 0) != 0
+        || (scratch->dounique && intern_init(&scratch->interned, 0) != 0)) {
+        PyErr_NoMemory();
+        cache_free(cache);
+        return NULL;
+    }
+    if (!(scratch->objects = PyList_New(0))) {
+        cache_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void free_block(cache_block *block)
+{
+    Py_CLEAR(block->key);
+    Py_CLEAR(block->keep);
+    free(block->entries);
+    free(block->refs);
+    block->entries = NULL;
+    block->refs = NULL;
+}
+
+static void unlink_block(struct binaryplist_cache *cache, long index)
+{
+    cache_block *block = &cache->blocks[index];
+
+    if (block->newer >= 0) {
+        cache->blocks[block->newer].older = block->older;
+    } else {
+        cache->newest = block->older;
+    }
+    if (block->older >= 0) {
+        cache->blocks[block->older].newer = block->newer;
+    } else {
+        cache->oldest = block->newer;
+    }
+}
+
+static void link_newest(struct binaryplist_cache *cache, long index)
+{
+    cache_block *block = &cache->blocks[index];
+
+    block->newer = -1;
+    block->older = cache->newest;
+    if (cache->newest >= 0) {
+        cache->blocks[cache->newest].newer = index;
+    } else {
+        cache->oldest = index;
+    }
+    cache->newest = index;
+}
+
+/* Drop the least recently used block, the last one moves into its slot */
+static void evict_oldest(struct binaryplist_cache *cache)
+{
+    long index = cache->oldest, last = --cache->nblocks;
+    cache_block *block = &cache->blocks[index];
+
+    unlink_block(cache, index);
+    ptrmap_del(&cache->index, block->key);
+    free_block(block);
+    if (index == last) {
+        return;
+    }
+    *block = cache->blocks[last];
+    memset(&cache->blocks[last], 0, sizeof(cache_block));
+    if (block->newer >= 0) {
+        cache->blocks[block->newer].older = index;
+    } else {
+        cache->newest = index;
+    }
+    if (block->older >= 0) {
+        cache->blocks[block->older].newer = index;
+    } else {
+        cache->oldest = index;
+    }
+    ptrmap_find(&cache->index, block->key)->value = index;
+}
+
+/* Flatten object into a new block, returns its index or -1 */
+static long build_block(struct binaryplist_cache *cache, PyObject *object)
+{
+    binaryplist_encoder *scratch = &cache->scratch;
+    cache_block *block;
+    PyObject *keep = NULL;
+    long root;
+
+    if (cache->nblocks == cache->max_blocks) {
+        evict_oldest(cache);
+    }
+    encoder_reset(scratch);
+    if (encoder_encode_object(scratch, object, &root) != BINARYPLIST_OK) {
+        encoder_reset(scratch);
+        return -1;
+    }
+    block = &cache->blocks[cache->nblocks];
+    block->epoch = 0;
+    block->nentries = scratch->nobjects;
+    block->nrefs = scratch->refs_len;
+    block->root = root;
+    block->entries = malloc(block->nentries * sizeof(binaryplist_object));
+    block->refs = malloc((block->nrefs ? block->nrefs : 1) * sizeof(long));
+    if (!block->entries || !block->refs || !(keep = PyList_New(0))
+        || ptrmap_set(&cache->index, object, cache->nblocks) != 0) {
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        Py_XDECREF(keep);
+        free(block->entries);
+        free(block->refs);
+        block->entries = NULL;
+        block->refs = NULL;
+        encoder_reset(scratch);
+        return -1;
+    }
+    memcpy(block->entries, scratch->entries, block->nentries * sizeof(binaryplist_object));
+    memcpy(block->refs, scratch->refs, block->nrefs * sizeof(long));
+    /* the block takes over the scratch object list */
+    block->keep = scratch->objects;
+    scratch->objects = keep;
+    Py_INCREF(object);
+    block->key = object;
+    encoder_reset(scratch);
+    link_newest(cache, cache->nblocks);
+    return cache->nblocks++;
+}
+
+/* 1 if the tuple is immutable and the last encode met it too, 0 if not, -1 on error */
+static int tuple_cacheable(struct binaryplist_cache *cache, PyObject *object)
+{
+    long found;
+    int again = ptrmap_get(&cache->last_seen, object, &found);
+
+    if (ptrmap_set(&cache->seen, object, 0) != 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return again ? is_immutable(cache, object, 0) : 0;
+}
+
+/*
+ * Encode object from the cache, flattening it first if it is not there
+ * yet. Returns CACHE_SKIP, with nothing added, for tuples that hold
+ * something mutable or are met for the first time.
+ */
+int cache_encode(binaryplist_encoder *encoder, PyObject *object, long *ref)
+{
+    struct binaryplist_cache *cache = encoder->cache;
+    cache_block *block;
+    long index;
+    int status;
+
+    if (cache->generation != types_generation) {
+        cache_clear(cache);
+        cache->generation = types_generation;
+    }
+    if (ptrmap_get(&cache->index, object, &index)) {
+        if (encoder->stats) {
+            encoder->stats->cache_hits++;
+        }
+        if (index != cache->newest) {
+            unlink_block(cache, index);
+            link_newest(cache, index);
+        }
+    } else {
+        if (PyTuple_CheckExact(object) && (status = tuple_cacheable(cache, object)) != 1) {
+            return status < 0 ? BINARYPLIST_ERROR : CACHE_SKIP;
+        }
+        if ((index = build_block(cache, object)) < 0) {
+            return BINARYPLIST_ERROR;
+        }
+    }
+    block = &cache->blocks[index];
+    if (encoder->dounique && block->epoch == cache->epoch) {
+        *ref = block->copied;
+        return BINARYPLIST_OK;
+    }
+    if ((*ref = encoder_add_block(encoder, block->entries, block->nentries, block->refs,
+        block->nrefs, block->root)) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    /* the cache may be dropped before this encode is written */
+    if (PyList_Append(encoder->objects, block->keep) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    block->copied = *ref;
+    block->epoch = cache->epoch;
+    return BINARYPLIST_OK;
+}
+
+/* Call before each encode, ids copied in by the last one are gone */
+void cache_start(struct binaryplist_cache *cache)
+{
+    ptrmap swap = cache->last_seen;
+
+    cache->epoch++;
+    cache->last_seen = cache->seen;
+    cache->seen = swap;
+    ptrmap_clear(&cache->seen);
+    ptrmap_clear(&cache->mutable);
+}
+
+void cache_clear(struct binaryplist_cache *cache)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < cache->nblocks; i++) {
+        free_block(&cache->blocks[i]);
+    }
+    cache->nblocks = 0;
+    cache->newest = cache->oldest = -1;
+    ptrmap_clear(&cache->index);
+    ptrmap_clear(&cache->seen);
+    ptrmap_clear(&cache->last_seen);
+    ptrmap_clear(&cache->mutable);
+}
+
+void cache_free(struct binaryplist_cache *cache)
+{
+    if (!cache) {
+        return;
+    }
+    cache_clear(cache);
+    free(cache->blocks);
+    ptrmap_free(&cache->index);
+    ptrmap_free(&cache->seen);
+    ptrmap_free(&cache->last_seen);
+    ptrmap_free(&cache->mutable);
+    encoder_free(&cache->scratch);
+    free(cache);
+}
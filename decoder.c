@@ -0,0 +1,486 @@
+#include "binaryplist.h"
+#include <datetime.h>
+
+
+/*
+ * Routines for reading the binary plist.
+ *
+ */
+
+#define TRAILER_SIZE 32
+
+static uint64_t read_multi_be(const uint8_t *p, int nbytes)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < nbytes; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static double raw_to_double(uint64_t bits)
+{
+    double x;
+    memcpy(&x, &bits, sizeof x);
+    return x;
+}
+
+static float raw_to_float(uint32_t bits)
+{
+    float x;
+    memcpy(&x, &bits, sizeof x);
+    return x;
+}
+
+static int decode_error(const char *msg)
+{
+    PyErr_SetString(PLIST_Error, msg);
+    return BINARYPLIST_ERROR;
+}
+
+int decoder_read_trailer(binaryplist_decoder *decoder)
+{
+    const uint8_t *trailer;
+    uint64_t table_end;
+
+    if (decoder->len < BPLIST_MAGIC_SIZE + 2 + TRAILER_SIZE
+        || memcmp(decoder->data, BPLIST_MAGIC, BPLIST_MAGIC_SIZE) != 0) {
+        return decode_error("not a binary plist");
+    }
+    /* 6 bytes of padding precede the trailer fields */
+    trailer = decoder->data + decoder->len - TRAILER_SIZE + 6;
+    decoder->offset_sz = trailer[0];
+    decoder->ref_id_sz = trailer[1];
+    decoder->nobjects = read_multi_be(trailer + 2, 8);
+    decoder->root = read_multi_be(trailer + 10, 8);
+    decoder->offset_table = read_multi_be(trailer + 18, 8);
+
+    if (decoder->offset_sz < 1 || decoder->offset_sz > 8
+        || decoder->ref_id_sz < 1 || decoder->ref_id_sz > 8) {
+        return decode_error("invalid offset or reference size in trailer");
+    }
+    if (decoder->nobjects == 0 || decoder->root >= decoder->nobjects) {
+        return decode_error("invalid root object in trailer");
+    }
+    table_end = (uint64_t)(decoder->len - TRAILER_SIZE);
+    if (decoder->offset_table < BPLIST_MAGIC_SIZE + 2
+        || decoder->offset_table > table_end
+        || decoder->nobjects > (table_end - decoder->offset_table) / decoder->offset_sz) {
+        return decode_error("offset table is out of bounds");
+    }
+    return BINARYPLIST_OK;
+}
+
+/*
+ * Read the length of a variable sized object. Small lengths are stored
+ * in the low nibble of the marker, larger ones follow as an int object.
+ */
+int decoder_read_length(binaryplist_decoder *decoder, uint64_t *pos, uint64_t *length)
+{
+    uint8_t marker = decoder->data[*pos];
+    int nbytes;
+
+    (*pos)++;
+    if ((marker & 0x0F) != 0x0F) {
+        *length = marker & 0x0F;
+        return BINARYPLIST_OK;
+    }
+    if (*pos >= decoder->offset_table || (decoder->data[*pos] >> 4) != BPLIST_UINT) {
+        return decode_error("invalid length header");
+    }
+    nbytes = 1 << (decoder->data[*pos] & 0x0F);
+    (*pos)++;
+    if (nbytes > 8 || *pos + nbytes > decoder->offset_table) {
+        return decode_error("invalid length header");
+    }
+    *length = read_multi_be(decoder->data + *pos, nbytes);
+    *pos += nbytes;
+    return BINARYPLIST_OK;
+}
+
+static uint64_t get_offset(binaryplist_decoder *decoder, uint64_t ref)
+{
+    return read_multi_be(decoder->data + decoder->offset_table + ref * decoder->offset_sz,
+        decoder->offset_sz);
+}
+
+int decoder_position(binaryplist_decoder *decoder, uint64_t ref, uint64_t *pos)
+{
+    if (ref >= decoder->nobjects) {
+        return decode_error("object reference is out of range");
+    }
+    *pos = get_offset(decoder, ref);
+    if (*pos < BPLIST_MAGIC_SIZE + 2 || *pos >= decoder->offset_table) {
+        return decode_error("object offset is out of bounds");
+    }
+    return BINARYPLIST_OK;
+}
+
+int decoder_object_kind(binaryplist_decoder *decoder, uint64_t ref)
+{
+    uint64_t pos;
+
+    if (decoder_position(decoder, ref, &pos) != BINARYPLIST_OK) {
+        return -1;
+    }
+    return decoder->data[pos] >> 4;
+}
+
+/*
+ * Locate the reference list of a container without decoding any of its
+ * children. Dicts hold count key refs followed by count value refs.
+ */
+int decoder_read_container(binaryplist_decoder *decoder, uint64_t ref, uint8_t *kind,
+    uint64_t *pos, uint64_t *count)
+{
+    uint64_t nrefs;
+
+    if (decoder_position(decoder, ref, pos) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    *kind = decoder->data[*pos] >> 4;
+    if (*kind != BPLIST_ARRAY && *kind != BPLIST_SET && *kind != BPLIST_DICT) {
+        return decode_error("object is not a container");
+    }
+    if (decoder_read_length(decoder, pos, count) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    nrefs = (decoder->offset_table - *pos) / decoder->ref_id_sz;
+    if (*count > nrefs || (*kind == BPLIST_DICT && *count > nrefs / 2)) {
+        return decode_error("container references are out of bounds");
+    }
+    return BINARYPLIST_OK;
+}
+
+uint64_t decoder_read_ref(binaryplist_decoder *decoder, uint64_t pos, uint64_t index)
+{
+    return read_multi_be(decoder->data + pos + index * decoder->ref_id_sz, decoder->ref_id_sz);
+}
+
+int decoder_alloc(binaryplist_decoder *decoder)
+{
+    decoder->objects = calloc(decoder->nobjects, sizeof(PyObject *));
+    decoder->inprogress = calloc(decoder->nobjects, sizeof(uint8_t));
+    if (!decoder->objects || !decoder->inprogress) {
+        PyErr_NoMemory();
+        return BINARYPLIST_ERROR;
+    }
+    return BINARYPLIST_OK;
+}
+
+void decoder_free(binaryplist_decoder *decoder)
+{
+    uint64_t i;
+
+    if (decoder->objects) {
+        for (i = 0; i < decoder->nobjects; i++) {
+            Py_XDECREF(decoder->objects[i]);
+        }
+    }
+    free(decoder->objects);
+    free(decoder->inprogress);
+    free(decoder->stack);
+    decoder->objects = NULL;
+    decoder->inprogress = NULL;
+    decoder->stack = NULL;
+    decoder->stack_cap = 0;
+}
+
+/*
+ * Split a plist date into UTC calendar fields. Returns BINARYPLIST_ERROR
+ * without raising when the year falls outside 1..9999.
+ */
+int decoder_split_date(double seconds, binaryplist_civil *civil)
+{
+    /* civil_from_days, see http://howardhinnant.github.io/date_algorithms.html */
+    double whole = floor(seconds);
+    int64_t secs = (int64_t)whole + APPLE_EPOCH_OFFSET;
+    int usec = (int)((seconds - whole) * 1000000.0 + 0.5);
+    int64_t days, sod, era, doe, yoe, doy, mp, y, m, d;
+
+    if (usec >= 1000000) {
+        usec -= 1000000;
+        secs++;
+    }
+    days = secs / 86400;
+    sod = secs % 86400;
+    if (sod < 0) {
+        sod += 86400;
+        days--;
+    }
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    y = yoe + era * 400;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    if (m <= 2) {
+        y++;
+    }
+    if (y < 1 || y > 9999) {
+        return BINARYPLIST_ERROR;
+    }
+    civil->year = (int)y;
+    civil->month = (int)m;
+    civil->day = (int)d;
+    civil->hour = (int)(sod / 3600);
+    civil->minute = (int)(sod % 3600 / 60);
+    civil->second = (int)(sod % 60);
+    civil->usec = usec;
+    return BINARYPLIST_OK;
+}
+
+static PyObject *decode_date(double seconds)
+{
+    binaryplist_civil c;
+
+    if (decoder_split_date(seconds, &c) != BINARYPLIST_OK) {
+        PyErr_SetString(PLIST_Error, "date is out of range");
+        return NULL;
+    }
+    return PyDateTime_FromDateAndTime(c.year, c.month, c.day, c.hour, c.minute, c.second,
+        c.usec);
+}
+
+/* Decode a value that is not a container */
+static PyObject *decode_uncached(binaryplist_decoder *decoder, uint64_t pos)
+{
+    uint8_t marker = decoder->data[pos];
+    uint8_t kind = marker >> 4;
+    uint64_t length, uid, end = decoder->offset_table;
+    int nbytes;
+    PyObject *tmp, *object;
+
+    switch (kind) {
+    case 0x0:
+        if (marker == BPLIST_NULL) {
+            Py_RETURN_NONE;
+        } else if (marker == BPLIST_FALSE) {
+            Py_RETURN_FALSE;
+        } else if (marker == BPLIST_TRUE) {
+            Py_RETURN_TRUE;
+        }
+        break;
+    case BPLIST_UINT:
+        nbytes = 1 << (marker & 0x0F);
+        if (nbytes > 16 || pos + 1 + nbytes > end) {
+            break;
+        }
+        if (nbytes == 16) {
+            /* 128 bit ints only carry unsigned 64 bit values in the low half */
+            return PyLong_FromUnsignedLongLong(read_multi_be(decoder->data + pos + 9, 8));
+        }
+        /* 8 byte ints are signed, shorter ones are always positive */
+        return PyInt_FromSsize_t((Py_ssize_t)read_multi_be(decoder->data + pos + 1, nbytes));
+    case BPLIST_REAL:
+        nbytes = 1 << (marker & 0x0F);
+        if (pos + 1 + nbytes > end) {
+            break;
+        }
+        if (nbytes == 8) {
+            return PyFloat_FromDouble(raw_to_double(read_multi_be(decoder->data + pos + 1, 8)));
+        } else if (nbytes == 4) {
+            return PyFloat_FromDouble(raw_to_float(read_multi_be(decoder->data + pos + 1, 4)));
+        }
+        break;
+    case BPLIST_DATE:
+        if (marker != 0x33 || pos + 9 > end) {
+            break;
+        }
+        return decode_date(raw_to_double(read_multi_be(decoder->data + pos + 1, 8)));
+    case BPLIST_DATA:
+    case BPLIST_STRING:
+    case BPLIST_UNICODE:
+        if (decoder_read_length(decoder, &pos, &length) != BINARYPLIST_OK) {
+            return NULL;
+        }
+        if (kind == BPLIST_UNICODE) {
+            if (length > (end - pos) / 2) {
+                break;
+            }
+            nbytes = 1; /* big endian */
+            return PyUnicode_DecodeUTF16((const char *)decoder->data + pos, length * 2,
+                NULL, &nbytes);
+        }
+        if (length > end - pos) {
+            break;
+        }
+        tmp = PyString_FromStringAndSize((const char *)decoder->data + pos, length);
+        if (!tmp || kind == BPLIST_STRING) {
+            return tmp;
+        }
+        object = PyObject_CallFunctionObjArgs(binaryplist_data_type, tmp, NULL);
+        Py_DECREF(tmp);
+        return object;
+    case BPLIST_UID:
+        nbytes = (marker & 0x0F) + 1;
+        if (nbytes > 8 || pos + 1 + nbytes > end) {
+            break;
+        }
+        uid = read_multi_be(decoder->data + pos + 1, nbytes);
+        if (uid > LONG_MAX) {
+            /* Uid is an int subclass */
+            PyErr_SetString(PLIST_Error, "uid is out of range");
+            return NULL;
+        }
+        tmp = PyInt_FromLong((long)uid);
+        if (!tmp) {
+            return NULL;
+        }
+        object = PyObject_CallFunctionObjArgs(binaryplist_uid_type, tmp, NULL);
+        Py_DECREF(tmp);
+        return object;
+    }
+    PyErr_SetString(PLIST_Error, "invalid or truncated object");
+    return NULL;
+}
+
+/*
+ * Resolve a reference into value when it is cached or not a container,
+ * otherwise push a frame for it and leave value NULL.
+ */
+static int open_object(binaryplist_decoder *decoder, uint64_t ref, PyObject **value)
+{
+    binaryplist_decode_frame *frame;
+    PyObject *container;
+    uint64_t pos, count;
+    uint8_t kind;
+    int cap;
+
+    *value = NULL;
+    if (ref < decoder->nobjects && decoder->objects[ref]) {
+        *value = decoder->objects[ref];
+        return BINARYPLIST_OK;
+    }
+    if (decoder_position(decoder, ref, &pos) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    if (decoder->inprogress[ref]) {
+        return decode_error("a container with references to itself is not decodable");
+    }
+    if (decoder->depth + 1 >= decoder->max_recursion) {
+        return decode_error("object depth exceeded max_recursion");
+    }
+    kind = decoder->data[pos] >> 4;
+    if (kind != BPLIST_ARRAY && kind != BPLIST_SET && kind != BPLIST_DICT) {
+        *value = decoder->objects[ref] = decode_uncached(decoder, pos);
+        return *value ? BINARYPLIST_OK : BINARYPLIST_ERROR;
+    }
+    if (decoder_read_container(decoder, ref, &kind, &pos, &count) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    if (decoder->depth == decoder->stack_cap) {
+        cap = decoder->stack_cap ? decoder->stack_cap * 2 : 64;
+        if (!(frame = realloc(decoder->stack, cap * sizeof(binaryplist_decode_frame)))) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
+        }
+        decoder->stack = frame;
+        decoder->stack_cap = cap;
+    }
+    if (kind == BPLIST_ARRAY) {
+        container = PyList_New(count);
+    } else if (kind == BPLIST_SET) {
+        container = PySet_New(NULL);
+    } else {
+        container = PyDict_New();
+    }
+    if (!container) {
+        return BINARYPLIST_ERROR;
+    }
+    frame = &decoder->stack[decoder->depth++];
+    frame->ref = ref;
+    frame->pos = pos;
+    frame->count = count;
+    frame->next = 0;
+    frame->container = container;
+    frame->key = NULL;
+    frame->kind = kind;
+    decoder->inprogress[ref] = 1;
+    return BINARYPLIST_OK;
+}
+
+/* Add the value of the entry last opened by the top frame */
+static int add_entry(binaryplist_decode_frame *frame, PyObject *value)
+{
+    uint64_t i = frame->next - 1;
+
+    if (frame->kind == BPLIST_ARRAY) {
+        Py_INCREF(value);
+        PyList_SET_ITEM(frame->container, i, value);
+        return BINARYPLIST_OK;
+    } else if (frame->kind == BPLIST_SET) {
+        return PySet_Add(frame->container, value) < 0 ? BINARYPLIST_ERROR : BINARYPLIST_OK;
+    }
+    /* dict entries alternate key, value */
+    if (!(i & 1)) {
+        frame->key = value;
+        return BINARYPLIST_OK;
+    }
+    return PyDict_SetItem(frame->container, frame->key, value) < 0 ? BINARYPLIST_ERROR
+        : BINARYPLIST_OK;
+}
+
+/*
+ * Returns a borrowed reference. Each reference id is decoded once and
+ * shared by every container that points at it. Containers are walked
+ * with an explicit stack, so nesting is bounded by max_recursion rather
+ * than the C stack.
+ */
+PyObject *decoder_decode_object(binaryplist_decoder *decoder, uint64_t ref)
+{
+    binaryplist_decode_frame *frame;
+    PyObject *value;
+    uint64_t j;
+    int base = decoder->depth;
+
+    if (open_object(decoder, ref, &value) != BINARYPLIST_OK) {
+        return NULL;
+    }
+    while (decoder->depth > base) {
+        frame = &decoder->stack[decoder->depth - 1];
+        if (value) {
+            if (add_entry(frame, value) != BINARYPLIST_OK) {
+                goto error;
+            }
+            value = NULL;
+            continue;
+        }
+        if (frame->next == (frame->kind == BPLIST_DICT ? frame->count * 2 : frame->count)) {
+            value = decoder->objects[frame->ref] = frame->container;
+            decoder->inprogress[frame->ref] = 0;
+            decoder->depth--;
+            continue;
+        }
+        j = frame->next++;
+        if (frame->kind == BPLIST_DICT) {
+            j = j & 1 ? frame->count + j / 2 : j / 2;
+        }
+        if (open_object(decoder, decoder_read_ref(decoder, frame->pos, j), &value)
+            != BINARYPLIST_OK) {
+            goto error;
+        }
+    }
+    return value;
+
+error:
+    while (decoder->depth > base) {
+        frame = &decoder->stack[--decoder->depth];
+        decoder->inprogress[frame->ref] = 0;
+        Py_DECREF(frame->container);
+    }
+    return NULL;
+}
+
+void decoder_init()
+{
+    /*
+     * Compiler voodoo ( static ), must be called from within this file.
+     */
+    PyDateTime_IMPORT;
+}
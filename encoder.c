@@ -1,477 +1,1920 @@
 #include "binaryplist.h"
+#include <datetime.h>
+#include <pthread.h>
 
 
 /*
  * Routines for writing the binary plist.
  *
+ * encoder_size works out the exact encoded length of every object, the
+ * offset and reference widths and the total output size. encoder_write
+ * then fills encoder->out, the output window of bplist_core.h, which also
+ * has the encodings of ints, lengths and the trailer. When the whole
+ * output fits (encode) nothing is ever flushed; when streaming the buffer
+ * is a fixed size chunk handed to encoder->flush whenever it fills up.
+ *
+ */
+
+
+/* Encoded bytes each extra write thread should have to itself */
+#define PARALLEL_MIN_SIZE (1024*1024)
+
+/* Intern tag bit for ints above LONG_MAX, which share bits with negatives */
+#define INTERN_UNSIGNED 0x40
+
+#define TRACE(encoder, event, kind, id, arg) do { \
+    if ((encoder)->trace) \
+        trace_event((encoder)->trace, event, kind, id, arg, (encoder)->depth); \
+    } while (0)
+
+/* Counts and traces each chunk on its way to the caller's flush */
+static int flush_chunk(void *sink, const uint8_t *data, size_t len)
+{
+    binaryplist_encoder *encoder = sink;
+
+    if (encoder->stats) {
+        encoder->stats->flushes++;
+    }
+    TRACE(encoder, TRACE_FLUSH, 0, 0, len);
+    return encoder->flush(encoder->sink, data, len);
+}
+
+static int gather_chunk(void *sink, const uint8_t *head, size_t head_len,
+    const uint8_t *data, size_t len)
+{
+    binaryplist_encoder *encoder = sink;
+
+    if (encoder->stats) {
+        encoder->stats->flushes++;
+    }
+    TRACE(encoder, TRACE_FLUSH, 0, 0, head_len + len);
+    return encoder->gather(encoder->sink, head, head_len, data, len);
+}
+
+static uint64_t read_multi_be(const uint8_t *p, int nbytes)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < nbytes; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void write_id(binaryplist_encoder *encoder, long val)
+{
+    bplist_out_be(&encoder->out, val, encoder->ref_id_sz);
+}
+
+/*
+ * Pick the plist form of a unicode object in one scan. Pure ASCII is
+ * written as 0x5 with one byte per char, anything else as 0x6 big endian
+ * UTF-16 where astral chars take a surrogate pair.
+ */
+static void measure_unicode(binaryplist_encoder *encoder, binaryplist_object *entry)
+{
+    Py_UCS4 bits;
+    Py_ssize_t astral;
+
+    unicode_scan(entry->bytes, entry->length, &bits, &astral);
+    if (bits < 0x80) {
+        entry->kind = BPLIST_STRING;
+        entry->count = entry->length;
+    } else {
+        entry->kind = BPLIST_UNICODE;
+        entry->count = entry->length + astral;
+    }
+}
+
+/*
+ * Transcode the chars of a unicode entry from i on. A sliced write stops
+ * once more than flushed bytes have gone out; returns where it stopped.
+ */
+static Py_ssize_t write_chars(binaryplist_encoder *encoder, binaryplist_object *entry,
+    Py_ssize_t i, int sliced, uint64_t flushed)
+{
+    const Py_UNICODE *u = entry->bytes;
+    Py_ssize_t n = entry->length, take;
+    int width = (entry->kind == BPLIST_STRING) ? 1 : 4;
+    uint8_t one[4], *end;
+
+    while (i < n && !(sliced && encoder->out.flushed != flushed)) {
+        /* transcode as many chars as are sure to fit, worst case width each */
+        take = (encoder->out.limit - encoder->out.cursor) / width;
+        if (take == 0) {
+            /* one char through a scratch, a window may end right after it */
+            end = (entry->kind == BPLIST_STRING) ? unicode_to_ascii(u + i, 1, one)
+                : unicode_to_utf16be(u + i, 1, one);
+            bplist_out_bytes(&encoder->out, one, end - one);
+            i++;
+            continue;
+        }
+        if (take > n - i) {
+            take = n - i;
+        }
+        if (entry->kind == BPLIST_STRING) {
+            encoder->out.cursor = unicode_to_ascii(u + i, take, encoder->out.cursor);
+        } else {
+            encoder->out.cursor = unicode_to_utf16be(u + i, take, encoder->out.cursor);
+        }
+        i += take;
+    }
+    return i;
+}
+
+static void write_unicode(binaryplist_encoder *encoder, binaryplist_object *entry)
+{
+    bplist_out_header(&encoder->out, entry->kind, entry->count);
+    write_chars(encoder, entry, 0, 0, 0);
+}
+
+static void write_container(binaryplist_encoder *encoder, int kind, binaryplist_object *entry)
+{
+    Py_ssize_t i;
+    long *refs = encoder->refs + entry->refs_at;
+
+    bplist_out_header(&encoder->out, kind, entry->count);
+    for (i = 0; i < entry->nrefs; i++) {
+        write_id(encoder, refs[i] + encoder->id_base);
+    }
+}
+
+static inline uint64_t double_to_raw(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof bits);
+    return bits;
+}
+
+static PyObject *array_type = NULL;
+
+static int is_array(PyObject *object)
+{
+    return array_type && PyObject_TypeCheck(object, (PyTypeObject *)array_type);
+}
+
+/* days_from_civil, see http://howardhinnant.github.io/date_algorithms.html */
+static int64_t days_from_civil(int64_t y, int64_t m, int64_t d)
+{
+    int64_t era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * Seconds since the apple epoch. Naive values are taken as UTC, the same
+ * way the decoder hands them back; aware ones are shifted by utcoffset().
+ */
+static int date_to_seconds(PyObject *object, double *seconds)
+{
+    int64_t secs = days_from_civil(PyDateTime_GET_YEAR(object),
+        PyDateTime_GET_MONTH(object), PyDateTime_GET_DAY(object)) * 86400;
+    int usec = 0;
+    PyObject *offset;
+
+    if (PyDateTime_Check(object)) {
+        secs += PyDateTime_DATE_GET_HOUR(object) * 3600
+            + PyDateTime_DATE_GET_MINUTE(object) * 60
+            + PyDateTime_DATE_GET_SECOND(object);
+        usec = PyDateTime_DATE_GET_MICROSECOND(object);
+        if (((PyDateTime_DateTime *)object)->hastzinfo) {
+            if (!(offset = PyObject_CallMethod(object, "utcoffset", NULL))) {
+                return BINARYPLIST_ERROR;
+            }
+            if (PyDelta_Check(offset)) {
+                secs -= ((PyDateTime_Delta *)offset)->days * 86400
+                    + ((PyDateTime_Delta *)offset)->seconds;
+                usec -= ((PyDateTime_Delta *)offset)->microseconds;
+            }
+            Py_DECREF(offset);
+        }
+    }
+    *seconds = (double)(secs - APPLE_EPOCH_OFFSET) + usec / 1000000.0;
+    return BINARYPLIST_OK;
+}
+
+/*
+ * Ints are signed 64 bit, except that values past LONG_MAX up to 2^64-1
+ * use the unsigned 128 bit form like CoreFoundation does.
+ */
+static int capture_int(PyObject *object, binaryplist_object *entry)
+{
+    int overflow = 0;
+    unsigned PY_LONG_LONG u;
+
+    if (PyInt_Check(object)) {
+        entry->value.i = PyInt_AS_LONG(object);
+        return BINARYPLIST_OK;
+    }
+    entry->value.i = PyLong_AsLongAndOverflow(object, &overflow);
+    if (overflow > 0) {
+        u = PyLong_AsUnsignedLongLong(object);
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+            overflow = -1;
+        } else {
+            entry->wide = 1;
+            entry->value.i = (long)u;
+        }
+    }
+    if (overflow < 0) {
+        PyErr_SetString(PLIST_Error, "integer is out of range");
+        return BINARYPLIST_ERROR;
+    }
+    return PyErr_Occurred() ? BINARYPLIST_ERROR : BINARYPLIST_OK;
+}
+
+/*
+ * Capture everything the writer needs from a python object into its
+ * entry. After this the size and write passes never touch the object,
+ * so they can run without the GIL.
+ */
+static int capture_object(binaryplist_encoder *encoder, binaryplist_object *entry,
+    const binaryplist_dispatch *type)
+{
+    PyObject *object = entry->object;
+
+    switch (type->cls) {
+    case TYPE_DATA:
+        entry->kind = BPLIST_DATA;
+        /* Data, or a byte buffer held or copied by encode_byte_buffer */
+        if (PyMemoryView_Check(object)) {
+            entry->bytes = PyMemoryView_GET_BUFFER(object)->buf;
+            entry->length = PyMemoryView_GET_BUFFER(object)->len;
+        } else {
+            entry->bytes = PyString_AS_STRING(object);
+            entry->length = PyString_GET_SIZE(object);
+        }
+        entry->count = entry->length;
+        break;
+    case TYPE_UID:
+        entry->kind = BPLIST_UID;
+        entry->value.i = PyLong_AsLong(object);
+        break;
+    case TYPE_BOOL:
+        entry->value.i = (object == Py_True) ? BPLIST_TRUE : BPLIST_FALSE;
+        break;
+    case TYPE_NONE:
+        if (encoder->convert_nulls == Py_True) {
+            entry->kind = BPLIST_STRING;
+        } else {
+            entry->value.i = BPLIST_NULL;
+        }
+        break;
+    case TYPE_STRING:
+        entry->kind = BPLIST_STRING;
+        entry->bytes = PyString_AS_STRING(object);
+        entry->length = entry->count = PyString_GET_SIZE(object);
+        break;
+    case TYPE_UNICODE:
+        entry->wide = 1;
+        entry->bytes = PyUnicode_AS_UNICODE(object);
+        entry->length = PyUnicode_GET_SIZE(object);
+        measure_unicode(encoder, entry);
+        break;
+    case TYPE_INT:
+        entry->kind = BPLIST_UINT;
+        if (capture_int(object, entry) != BINARYPLIST_OK) {
+            return BINARYPLIST_ERROR;
+        }
+        break;
+    case TYPE_DATE:
+        entry->kind = BPLIST_DATE;
+        if (date_to_seconds(object, &entry->value.r) != BINARYPLIST_OK) {
+            return BINARYPLIST_ERROR;
+        }
+        break;
+    case TYPE_FLOAT:
+        entry->kind = BPLIST_REAL;
+        entry->value.r = PyFloat_AS_DOUBLE(object);
+        break;
+    case TYPE_ARRAY:
+    case TYPE_BUFFER:
+        /* numeric buffer elements are added by encode_numeric_buffer */
+        entry->kind = BPLIST_ARRAY;
+        break;
+    case TYPE_DICT:
+        entry->kind = BPLIST_DICT;
+        break;
+    case TYPE_NATIVE:
+        entry->kind = BPLIST_NATIVE;
+        entry->bytes = type->native;
+        if ((entry->length = type->native->size(object, type->native->context)) < 0) {
+            return BINARYPLIST_ERROR;
+        }
+        break;
+    default:
+        PyErr_SetString(PLIST_Error, "object contains an unsupported type");
+        return BINARYPLIST_ERROR;
+    }
+    if (PyErr_Occurred()) {
+        return BINARYPLIST_ERROR;
+    }
+    return BINARYPLIST_OK;
+}
+
+/*
+ * Encoded length of a single object. Must agree byte for byte with
+ * write_object below.
+ */
+static Py_ssize_t object_size(binaryplist_encoder *encoder, binaryplist_object *entry)
+{
+    uint64_t payload = entry->count;
+
+    switch (entry->kind) {
+    case BPLIST_UNICODE:
+        payload = entry->count * 2;
+        break;
+    case BPLIST_ARRAY:
+    case BPLIST_DICT:
+        entry->count = (entry->kind == BPLIST_DICT) ? entry->nrefs / 2 : entry->nrefs;
+        payload = entry->nrefs * encoder->ref_id_sz;
+        break;
+    case BPLIST_NATIVE:
+        return entry->length;
+    }
+    return bplist_object_size(entry->kind, entry->wide, entry->value.i, entry->count, payload);
+}
+
+/* Native converters write straight into the output when it has room */
+static void write_native(binaryplist_encoder *encoder, binaryplist_object *entry)
+{
+    const binaryplist_converter *native = entry->bytes;
+    uint8_t scratch[64], *out = scratch;
+
+    if (encoder->out.limit - encoder->out.cursor >= entry->length) {
+        native->write(entry->object, encoder->out.cursor, native->context);
+        encoder->out.cursor += entry->length;
+        return;
+    }
+    if (entry->length > (Py_ssize_t)sizeof(scratch) && !(out = malloc(entry->length))) {
+        encoder->out.failed = 1;
+        encoder->error = "out of memory";
+        return;
+    }
+    native->write(entry->object, out, native->context);
+    bplist_out_bytes(&encoder->out, out, entry->length);
+    if (out != scratch) {
+        free(out);
+    }
+}
+
+static void write_object(binaryplist_encoder *encoder, binaryplist_object *entry)
+{
+    switch (entry->kind) {
+    case BPLIST_DATA:
+    case BPLIST_STRING:
+    case BPLIST_UNICODE:
+        if (entry->wide) {
+            write_unicode(encoder, entry);
+        } else {
+            bplist_out_header(&encoder->out, entry->kind, entry->count);
+            bplist_out_bytes(&encoder->out, entry->bytes, entry->count);
+        }
+        break;
+    case BPLIST_ARRAY:
+    case BPLIST_DICT:
+        write_container(encoder, entry->kind, entry);
+        break;
+    case BPLIST_NATIVE:
+        write_native(encoder, entry);
+        break;
+    default:
+        bplist_out_scalar(&encoder->out, entry->kind, entry->wide, entry->value.i,
+            entry->value.r);
+    }
+}
+
+static int stat_class(const binaryplist_object *entry)
+{
+    switch (entry->kind) {
+    case 0:
+        return (entry->value.i == BPLIST_NULL) ? STAT_NULL : STAT_BOOL;
+    case BPLIST_UINT: return STAT_INT;
+    case BPLIST_REAL: return STAT_REAL;
+    case BPLIST_DATE: return STAT_DATE;
+    case BPLIST_DATA: return STAT_DATA;
+    case BPLIST_STRING: return STAT_ASCII;
+    case BPLIST_UNICODE: return STAT_UNICODE;
+    case BPLIST_UID: return STAT_UID;
+    case BPLIST_DICT: return STAT_DICT;
+    case BPLIST_NATIVE: return STAT_NATIVE;
+    }
+    return STAT_ARRAY;
+}
+
+/*
+ * Compute the exact output size. Sets each entry's offset, the offset
+ * table position and both widths and returns the total. Does not touch
+ * any python object.
+ */
+Py_ssize_t encoder_size(binaryplist_encoder *encoder)
+{
+    Py_ssize_t i;
+    int cls;
+    Py_ssize_t pos = encoder->offset_base ? encoder->offset_base : BPLIST_HEADER_SIZE, len;
+    Py_ssize_t total = encoder->id_base + encoder->nobjects;
+    binaryplist_stats *stats = encoder->stats;
+    uint64_t start = stats ? trace_now() : 0;
+
+    TRACE(encoder, TRACE_BEGIN, 0, 0, TRACE_SIZE);
+    if (!encoder->id_base) {
+        /* appends keep the width the existing objects were written with */
+        encoder->ref_id_sz = bplist_ref_size(encoder->nobjects);
+    }
+    for (i = 0; i < encoder->nobjects; i++) {
+        encoder->entries[i].offset = pos;
+        len = object_size(encoder, &encoder->entries[i]);
+        pos += len;
+        if (stats) {
+            cls = stat_class(&encoder->entries[i]);
+            stats->objects[cls]++;
+            stats->bytes[cls] += len;
+        }
+    }
+    encoder->off_pos = pos;
+    encoder->off_sz = bplist_offset_size(pos);
+    encoder->size = pos + (Py_ssize_t)encoder->off_sz * total + BPLIST_TRAILER_SIZE
+        - encoder->offset_base;
+    if (stats) {
+        stats->size_ns += trace_now() - start;
+        stats->nobjects = encoder->nobjects;
+        stats->size = encoder->size;
+        stats->ref_size = encoder->ref_id_sz;
+        stats->offset_size = encoder->off_sz;
+    }
+    TRACE(encoder, TRACE_END, 0, encoder->nobjects, TRACE_SIZE);
+    return encoder->size;
+}
+
+/*
+ * Parallel write of a full sized output. Every object's offset is known
+ * after encoder_size, so the object list is cut into ranges of about
+ * equal encoded size and each range, with its slice of the offset table,
+ * is written by its own thread into the bytes it owns. A part is a copy
+ * of the encoder with its own window and no stats or trace; the objects
+ * it reads are shared and never changed.
+ */
+typedef struct write_part {
+    binaryplist_encoder encoder;
+    Py_ssize_t first;
+    Py_ssize_t last;
+    pthread_t thread;
+    int started;
+    int failed;
+} write_part;
+
+/* First object at or after pos, offsets grow with the id */
+static Py_ssize_t object_at(binaryplist_encoder *encoder, Py_ssize_t pos)
+{
+    Py_ssize_t lo = 0, hi = encoder->nobjects, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (encoder->entries[mid].offset < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void *write_part_worker(void *arg)
+{
+    write_part *part = arg;
+    binaryplist_encoder *encoder = &part->encoder;
+    uint8_t *buffer = encoder->out.buffer;
+    Py_ssize_t i, end;
+
+    end = (part->last < encoder->nobjects) ? encoder->entries[part->last].offset
+        : encoder->off_pos;
+    bplist_output_init(&encoder->out, buffer + encoder->entries[part->first].offset,
+        end - encoder->entries[part->first].offset, NULL, NULL);
+    for (i = part->first; i < part->last; i++) {
+        write_object(encoder, &encoder->entries[i]);
+    }
+    part->failed = encoder->out.failed || encoder->out.cursor != encoder->out.limit;
+    bplist_output_init(&encoder->out, buffer + encoder->off_pos + part->first * encoder->off_sz,
+        (part->last - part->first) * encoder->off_sz, NULL, NULL);
+    for (i = part->first; i < part->last; i++) {
+        bplist_out_be(&encoder->out, encoder->entries[i].offset, encoder->off_sz);
+    }
+    part->failed |= encoder->out.failed;
+    return NULL;
+}
+
+/* Number of parts worth splitting the objects into, 1 to write serially */
+static int write_parts(binaryplist_encoder *encoder)
+{
+    Py_ssize_t span = encoder->off_pos - BPLIST_HEADER_SIZE;
+    Py_ssize_t parts = span / PARALLEL_MIN_SIZE;
+
+    if (encoder->threads < 2 || encoder->flush || encoder->debug || encoder->offset_base
+        || encoder->out.limit - encoder->out.buffer < encoder->size) {
+        return 1;
+    }
+    if (parts > encoder->threads) {
+        parts = encoder->threads;
+    }
+    if (parts > encoder->nobjects) {
+        parts = encoder->nobjects;
+    }
+    return parts < 1 ? 1 : (int)parts;
+}
+
+static int write_parallel(binaryplist_encoder *encoder, int nparts)
+{
+    Py_ssize_t span = encoder->off_pos - BPLIST_HEADER_SIZE, first = 0;
+    write_part *parts;
+    int i, status = BINARYPLIST_OK;
+
+    if (!(parts = calloc(nparts, sizeof(write_part)))) {
+        encoder->error = "out of memory";
+        return BINARYPLIST_ERROR;
+    }
+    for (i = 0; i < nparts; i++) {
+        memcpy(&parts[i].encoder, encoder, sizeof(binaryplist_encoder));
+        parts[i].encoder.stats = NULL;
+        parts[i].encoder.trace = NULL;
+        parts[i].first = first;
+        parts[i].last = (i == nparts - 1) ? encoder->nobjects
+            : object_at(encoder, BPLIST_HEADER_SIZE + span / nparts * (i + 1));
+        first = parts[i].last;
+    }
+    /* the calling thread takes the first part */
+    for (i = 1; i < nparts; i++) {
+        parts[i].started = !pthread_create(&parts[i].thread, NULL, write_part_worker, &parts[i]);
+    }
+    write_part_worker(&parts[0]);
+    for (i = 1; i < nparts; i++) {
+        if (parts[i].started) {
+            pthread_join(parts[i].thread, NULL);
+        } else {
+            write_part_worker(&parts[i]);
+        }
+    }
+    for (i = 0; i < nparts; i++) {
+        if (parts[i].failed || parts[i].encoder.error) {
+            encoder->error = parts[i].encoder.error ? parts[i].encoder.error
+                : "encoded size does not match computed size";
+            status = BINARYPLIST_ERROR;
+        }
+    }
+    free(parts);
+    return status;
+}
+
+/*
+ * Write the whole plist. Call encoder_size first and point encoder->out at
+ * either the full sized output or a chunk, with encoder->flush set.
+ *
+ * Only the flush callback and debug output may use the python API, so
+ * with neither the GIL can be released around this call. Failures set
+ * encoder->error; use encoder_set_error to raise it.
+ */
+int encoder_write(binaryplist_encoder *encoder)
+{
+    Py_ssize_t i;
+    int nparts;
+    binaryplist_object *entry;
+    binaryplist_stats *stats = encoder->stats;
+    uint64_t start = stats ? trace_now() : 0;
+
+    if (stats) {
+        stats->buffer_allocs++;
+        if (encoder->out.limit - encoder->out.buffer > stats->peak_buffer) {
+            stats->peak_buffer = encoder->out.limit - encoder->out.buffer;
+        }
+    }
+    TRACE(encoder, TRACE_BEGIN, 0, 0, TRACE_WRITE);
+    encoder->out.flush = encoder->flush ? flush_chunk : NULL;
+    encoder->out.gather = encoder->flush && encoder->gather ? gather_chunk : NULL;
+    encoder->out.sink = encoder;
+
+    /* write the magic header data */
+    if (!encoder->offset_base) {
+        bplist_out_magic(&encoder->out);
+    }
+
+    if ((nparts = write_parts(encoder)) > 1) {
+        /* objects and offsets in parallel, then carry on after the table */
+        if (write_parallel(encoder, nparts) != BINARYPLIST_OK) {
+            return BINARYPLIST_ERROR;
+        }
+        encoder->out.cursor = encoder->out.buffer + encoder->off_pos
+            + encoder->off_sz * encoder->nobjects;
+        goto trailer;
+    }
+
+    /* write the object list */
+    for (i = 0; i < encoder->nobjects; i++) {
+        entry = &encoder->entries[i];
+        write_object(encoder, entry);
+        if (encoder->debug) {
+            fprintf(stderr, "write_object(ref:%ld, len:%ld): ", (long)i + encoder->id_base,
+                (long)(bplist_output_position(&encoder->out) + encoder->offset_base
+                    - entry->offset));
+            if (entry->object) {
+                PyObject_Print(entry->object, stderr, 0);
+            } else if (entry->kind == BPLIST_REAL) {
+                fprintf(stderr, "%g", entry->value.r);
+            } else {
+                fprintf(stderr, "%ld", entry->value.i);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    /* write the offsets, carrying over those of an existing plist */
+    if (encoder->old_offsets && encoder->old_off_sz == encoder->off_sz) {
+        bplist_out_bytes(&encoder->out, encoder->old_offsets, encoder->id_base * encoder->off_sz);
+    } else if (encoder->old_offsets) {
+        for (i = 0; i < encoder->id_base; i++) {
+            bplist_out_be(&encoder->out,
+                read_multi_be(encoder->old_offsets + i * encoder->old_off_sz, encoder->old_off_sz),
+                encoder->off_sz);
+        }
+    }
+    for (i = 0; i < encoder->nobjects; i++) {
+        bplist_out_be(&encoder->out, encoder->entries[i].offset, encoder->off_sz);
+    }
+    if (encoder->debug) {
+        fprintf(stderr, "ref_id_sz: %d off_sz: %d offset table: %ld length: %ld\n", 
+            encoder->ref_id_sz, encoder->off_sz,
+            (long)encoder->off_pos, (long)(encoder->off_sz * encoder->nobjects));
+    }
+
+trailer:
+    if (stats) {
+        stats->write_threads = nparts;
+    }
+    /* trailer, the root is always the first object traversed */
+    bplist_out_trailer(&encoder->out, encoder->off_sz, encoder->ref_id_sz,
+        encoder->id_base + encoder->nobjects, encoder->id_base, encoder->off_pos);
+
+    if (encoder->flush) {
+        bplist_output_flush(&encoder->out);
+    }
+    if (stats) {
+        stats->write_ns += trace_now() - start;
+    }
+    TRACE(encoder, TRACE_END, 0, encoder->nobjects, TRACE_WRITE);
+    if (encoder->out.failed) {
+        encoder->error = "failed to write output";
+        return BINARYPLIST_ERROR;
+    }
+    if (bplist_output_position(&encoder->out) != (uint64_t)encoder->size) {
+        encoder->error = "encoded size does not match computed size";
+        return BINARYPLIST_ERROR;
+    }
+    return BINARYPLIST_OK;
+}
+
+/*
+ * Objects written in slices by encoder_write_step, so one that is larger
+ * than the chunk is never held in full by the sink. Returns the number
+ * of units to write after the header (payload bytes, chars or refs), or
+ * 0 for an object written whole.
+ */
+static Py_ssize_t sliced_units(binaryplist_encoder *encoder, binaryplist_object *entry)
+{
+    Py_ssize_t window = encoder->out.limit - encoder->out.buffer;
+
+    switch (entry->kind) {
+    case BPLIST_DATA:
+    case BPLIST_STRING:
+    case BPLIST_UNICODE:
+        if (!entry->wide) {
+            return entry->count > window ? entry->count : 0;
+        }
+        /* UTF-16 needs up to 4 bytes a char, ascii one */
+        return entry->length > window / (entry->kind == BPLIST_STRING ? 1 : 4)
+            ? entry->length : 0;
+    case BPLIST_ARRAY:
+    case BPLIST_DICT:
+        return entry->nrefs > window / encoder->ref_id_sz ? entry->nrefs : 0;
+    }
+    return 0;
+}
+
+/*
+ * Write units of a sliced object from step->done on, until more than
+ * flushed bytes have gone out
+ */
+static void write_slice(binaryplist_encoder *encoder, binaryplist_object *entry,
+    binaryplist_step *step, Py_ssize_t units, uint64_t flushed)
+{
+    bplist_output *out = &encoder->out;
+    long *refs;
+    Py_ssize_t n;
+
+    if (entry->kind == BPLIST_ARRAY || entry->kind == BPLIST_DICT) {
+        refs = encoder->refs + entry->refs_at;
+        while (step->done < units && out->flushed == flushed) {
+            write_id(encoder, refs[step->done++] + encoder->id_base);
+        }
+    } else if (entry->wide) {
+        step->done = write_chars(encoder, entry, step->done, 1, flushed);
+    } else {
+        while (step->done < units && out->flushed == flushed) {
+            if (!(n = out->limit - out->cursor)) {
+                bplist_output_flush(out);
+                break;
+            }
+            n = n < units - step->done ? n : units - step->done;
+            bplist_out_bytes(out, (const uint8_t *)entry->bytes + step->done, n);
+            step->done += n;
+        }
+    }
+}
+
+/*
+ * Resumable encoder_write for a streaming sink, used by iterencode. Each
+ * call writes until the chunk has been flushed at least once, or to the
+ * end, and records in step where to carry on. Strings, data and
+ * containers larger than the chunk are written a slice at a time, other
+ * objects whole. Not for appends to an existing plist, and never splits
+ * the write across threads.
+ */
+int encoder_write_step(binaryplist_encoder *encoder, binaryplist_step *step)
+{
+    bplist_output *out = &encoder->out;
+    uint64_t flushed = out->flushed;
+    binaryplist_object *entry;
+    Py_ssize_t units;
+
+    switch (step->phase) {
+    case STEP_HEADER:
+        out->flush = flush_chunk;
+        out->sink = encoder;
+        bplist_out_magic(out);
+        step->phase = STEP_OBJECTS;
+        /* fall through */
+    case STEP_OBJECTS:
+        for (; step->index < encoder->nobjects && out->flushed == flushed; step->index++) {
+            entry = &encoder->entries[step->index];
+            if (!(units = sliced_units(encoder, entry))) {
+                write_object(encoder, entry);
+                continue;
+            }
+            if (!step->started) {
+                bplist_out_header(out, entry->kind, entry->count);
+                step->started = 1;
+            }
+            write_slice(encoder, entry, step, units, flushed);
+            if (step->done < units) {
+                return out->failed ? BINARYPLIST_ERROR : BINARYPLIST_OK;
+            }
+            step->started = 0;
+            step->done = 0;
+        }
+        if (step->index < encoder->nobjects) {
+            break;
+        }
+        step->index = 0;
+        step->phase = STEP_OFFSETS;
+        /* fall through */
+    case STEP_OFFSETS:
+        for (; step->index < encoder->nobjects && out->flushed == flushed; step->index++) {
+            bplist_out_be(out, encoder->entries[step->index].offset, encoder->off_sz);
+        }
+        if (step->index < encoder->nobjects) {
+            break;
+        }
+        step->phase = STEP_TRAILER;
+        /* fall through */
+    case STEP_TRAILER:
+        bplist_out_trailer(out, encoder->off_sz, encoder->ref_id_sz, encoder->nobjects, 0,
+            encoder->off_pos);
+        bplist_output_flush(out);
+        step->phase = STEP_DONE;
+        if (!out->failed && bplist_output_position(out) != (uint64_t)encoder->size) {
+            encoder->error = "encoded size does not match computed size";
+            return BINARYPLIST_ERROR;
+        }
+    }
+    if (out->failed) {
+        encoder->error = "failed to write output";
+        return BINARYPLIST_ERROR;
+    }
+    return BINARYPLIST_OK;
+}
+
+/* Raise the error left by encoder_write unless a callback already did. */
+void encoder_set_error(binaryplist_encoder *encoder)
+{
+    if (!PyErr_Occurred()) {
+        PyErr_SetString(PLIST_Error, encoder->error ? encoder->error : "failed to write output");
+    }
+}
+
+
+static const char *stat_names[STAT_KINDS] = {
+    "null", "bool", "int", "real", "date", "data", "ascii", "unicode", "uid",
+    "array", "dict", "native"
+};
+
+static int set_stat(PyObject *dict, const char *key, PyObject *value)
+{
+    int status = value ? PyDict_SetItemString(dict, key, value) : -1;
+
+    Py_XDECREF(value);
+    return status;
+}
+
+/* Stats of the last encode as a dict, or None when stats are off. */
+PyObject *encoder_stats(binaryplist_encoder *encoder)
+{
+    binaryplist_stats *stats = encoder->stats;
+    PyObject *dict, *objects = NULL, *bytes = NULL;
+    int i, status = 0;
+
+    if (!stats) {
+        Py_RETURN_NONE;
+    }
+    if (!(dict = PyDict_New()) || !(objects = PyDict_New()) || !(bytes = PyDict_New())) {
+        goto fail;
+    }
+    for (i = 0; i < STAT_KINDS; i++) {
+        if (stats->objects[i]) {
+            status |= set_stat(objects, stat_names[i], PyInt_FromSsize_t(stats->objects[i]));
+            status |= set_stat(bytes, stat_names[i], PyInt_FromSsize_t(stats->bytes[i]));
+        }
+    }
+    status |= set_stat(dict, "traverse_seconds", PyFloat_FromDouble(stats->traverse_ns / 1e9));
+    status |= set_stat(dict, "size_seconds", PyFloat_FromDouble(stats->size_ns / 1e9));
+    status |= set_stat(dict, "write_seconds", PyFloat_FromDouble(stats->write_ns / 1e9));
+    status |= set_stat(dict, "nobjects", PyInt_FromSsize_t(stats->nobjects));
+    status |= set_stat(dict, "size", PyInt_FromSsize_t(stats->size));
+    status |= set_stat(dict, "dedup_hits", PyInt_FromSsize_t(stats->dedup_hits));
+    status |= set_stat(dict, "cache_hits", PyInt_FromSsize_t(stats->cache_hits));
+    status |= set_stat(dict, "ref_size", PyInt_FromLong(stats->ref_size));
+    status |= set_stat(dict, "offset_size", PyInt_FromLong(stats->offset_size));
+    status |= set_stat(dict, "buffer_allocs", PyInt_FromSsize_t(stats->buffer_allocs));
+    status |= set_stat(dict, "peak_buffer", PyInt_FromSsize_t(stats->peak_buffer));
+    status |= set_stat(dict, "flushes", PyInt_FromSsize_t(stats->flushes));
+    status |= set_stat(dict, "write_threads", PyInt_FromLong(stats->write_threads));
+    status |= PyDict_SetItemString(dict, "objects", objects);
+    status |= PyDict_SetItemString(dict, "bytes", bytes);
+    if (status) {
+        goto fail;
+    }
+    Py_DECREF(objects);
+    Py_DECREF(bytes);
+    return dict;
+
+fail:
+    Py_XDECREF(dict);
+    Py_XDECREF(objects);
+    Py_XDECREF(bytes);
+    return NULL;
+}
+
+
+/*
+ * Routines for setting up encoder state.
+ *
  */
 
-static void write_byte(binaryplist_encoder *encoder, uint8_t b)
+/*
+ * Reserve n child reference slots for the container with the given id.
+ * Slots are addressed by index since the refs array may move as it grows.
+ */
+static int grow_refs(binaryplist_encoder *encoder, Py_ssize_t n)
 {
-    utstring_bincpy(encoder->output, &b, sizeof(uint8_t));
+    Py_ssize_t cap = encoder->refs_cap;
+    long *refs;
+
+    if (encoder->refs_len + n > cap) {
+        cap = (cap < 64) ? 64 : cap * 2;
+        if (cap < encoder->refs_len + n) {
+            cap = encoder->refs_len + n;
+        }
+        if (!(refs = realloc(encoder->refs, cap * sizeof(long)))) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
+        }
+        encoder->refs = refs;
+        encoder->refs_cap = cap;
+    }
+    return BINARYPLIST_OK;
+}
+
+static int reserve_refs(binaryplist_encoder *encoder, long id, Py_ssize_t n)
+{
+    if (grow_refs(encoder, n) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    encoder->entries[id].refs_at = encoder->refs_len;
+    encoder->entries[id].nrefs = n;
+    encoder->refs_len += n;
+    return BINARYPLIST_OK;
+}
+
+/* Make room for n more entries. */
+static int reserve_entries(binaryplist_encoder *encoder, Py_ssize_t n)
+{
+    Py_ssize_t cap = encoder->entries_cap;
+    binaryplist_object *entries;
+
+    if (encoder->nobjects + n > cap) {
+        cap = (cap < 64) ? 64 : cap * 2;
+        if (cap < encoder->nobjects + n) {
+            cap = encoder->nobjects + n;
+        }
+        if (!(entries = realloc(encoder->entries, cap * sizeof(binaryplist_object)))) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
+        }
+        encoder->entries = entries;
+        encoder->entries_cap = cap;
+    }
+    return BINARYPLIST_OK;
+}
+
+/*
+ * Make the captured entry at nobjects part of the plist. Only containers
+ * go in the ref table, it is there for cycle checks.
+ */
+static long commit_object(binaryplist_encoder *encoder, PyObject *object)
+{
+    long id = encoder->nobjects;
+    uint8_t kind = encoder->entries[id].kind;
+
+    if ((kind == BPLIST_ARRAY || kind == BPLIST_DICT)
+        && ptrmap_set(&encoder->ref_table, object, id) != 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (PyList_Append(encoder->objects, object) < 0) {
+        return -1;
+    }
+    encoder->nobjects++;
+    return id;
 }
 
-static void write_bytes(binaryplist_encoder *encoder, void *bytes, size_t len)
+/*
+ * Append object to the flattened object list and return its reference id,
+ * or -1 on failure.
+ */
+static long add_object(binaryplist_encoder *encoder, PyObject *object,
+    const binaryplist_dispatch *type)
 {
-    utstring_bincpy(encoder->output, bytes, len);
+    long id = encoder->nobjects;
+
+    if (reserve_entries(encoder, 1) != BINARYPLIST_OK) {
+        return -1;
+    }
+    memset(&encoder->entries[id], 0, sizeof(binaryplist_object));
+    encoder->entries[id].object = object;
+    if (capture_object(encoder, &encoder->entries[id], type) != BINARYPLIST_OK) {
+        return -1;
+    }
+    return commit_object(encoder, object);
+}
+
+/*
+ * Add a number that has no python object of its own (or whose object
+ * need not be kept), deduplicated through the native intern table.
+ * Entries must already be reserved. Returns the reference id or -1.
+ */
+static long add_number(binaryplist_encoder *encoder, uint8_t kind, int wide, long i, double r)
+{
+    long id = encoder->nobjects;
+    uint64_t bits = (kind == BPLIST_REAL) ? double_to_raw(r) : (uint64_t)i;
+    binaryplist_object *entry;
+
+    if (encoder->dounique) {
+        id = intern_lookup(&encoder->interned, wide ? kind | INTERN_UNSIGNED : kind, bits, id);
+        if (id < 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (id != encoder->nobjects) {
+            if (encoder->stats) {
+                encoder->stats->dedup_hits++;
+            }
+            TRACE(encoder, TRACE_UNIQUE, kind, id, 0);
+            return id;
+        }
+    }
+    TRACE(encoder, TRACE_OBJECT, kind, id, 0);
+    entry = &encoder->entries[encoder->nobjects++];
+    memset(entry, 0, sizeof(binaryplist_object));
+    entry->kind = kind;
+    entry->wide = wide;
+    if (kind == BPLIST_REAL) {
+        entry->value.r = r;
+    } else {
+        entry->value.i = i;
+    }
+    return id;
 }
 
-static void write_multi_be(binaryplist_encoder *encoder, long value, int nbytes)
+static uint64_t container_hash(const binaryplist_object *entry, const long *refs)
 {
-    int i;
+    uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t)entry->nrefs << 4);
+    Py_ssize_t i;
 
-    for (i = (nbytes - 1); i >= 0; i--) {
-        write_byte(encoder, (uint8_t)(value >> (8 * i)));
+    for (i = 0; i < entry->nrefs; i++) {
+        h = (h ^ (uint64_t)refs[i]) * 0x100000001B3ULL;
+        h ^= h >> 32;
     }
+    return h;
 }
 
-static void write_long(binaryplist_encoder *encoder, long value)
+/*
+ * unique="deep": once every child of a container has its final id, look
+ * for an earlier container of the same kind with the same child ids and
+ * point at that one instead. Children already merged bottom up, so equal
+ * subtrees always end in equal ref lists. A container that matches can
+ * only reference existing ids, so it is the last entry and its refs the
+ * last refs, and both are simply dropped. Returns the id to use.
+ */
+static long dedup_container(binaryplist_encoder *encoder, long id)
 {
-    write_multi_be(encoder, value, 8);
+    binaryplist_object *entry = &encoder->entries[id];
+    const long *refs = encoder->refs + entry->refs_at;
+    binaryplist_object *other;
+    long first;
+
+    if (encoder->dounique != UNIQUE_DEEP || id != encoder->nobjects - 1
+        || entry->refs_at + entry->nrefs != encoder->refs_len) {
+        return id;
+    }
+    first = intern_lookup(&encoder->interned, entry->kind, container_hash(entry, refs), id);
+    if (first < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (first == id) {
+        return id;
+    }
+    other = &encoder->entries[first];
+    if (other->kind != entry->kind || other->nrefs != entry->nrefs
+        || memcmp(encoder->refs + other->refs_at, refs, entry->nrefs * sizeof(long))) {
+        /* hash collision, keep both */
+        return id;
+    }
+    if (entry->object && ptrmap_set(&encoder->ref_table, entry->object, first) != 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (encoder->stats) {
+        encoder->stats->dedup_hits++;
+    }
+    TRACE(encoder, TRACE_UNIQUE, entry->kind, first, id);
+    encoder->refs_len = entry->refs_at;
+    encoder->nobjects--;
+    return first;
 }
 
-static void write_int_header(binaryplist_encoder *encoder, int kind, int value)
+/*
+ * Intern key of a captured scalar: its type nibble plus the raw value,
+ * or for strings and data a hash of the payload with its width folded
+ * into the tag. Returns the id of the first equal entry (id itself when
+ * there is none), or -1 on allocation failure. Hash collisions are
+ * caught by comparing payloads and simply not merged.
+ */
+static long intern_entry(binaryplist_encoder *encoder, binaryplist_object *entry, long id)
 {
-    if (value < 15) {
-        write_byte(encoder, (kind << 4) + value);
-    } else if (value < 256) {
-        write_byte(encoder, (kind << 4) + 15);
-        write_byte(encoder, 0x10);
-        write_multi_be(encoder, value, 1);
-    } else if (value < 65536) {
-        write_byte(encoder, (kind << 4) + 15);
-        write_byte(encoder, 0x11);
-        write_multi_be(encoder, value, 2);
+    uint8_t tag = entry->kind;
+    uint64_t bits;
+    size_t unit = entry->wide ? sizeof(Py_UNICODE) : 1;
+    binaryplist_object *other;
+    long first;
+
+    if (entry->bytes) {
+        tag |= entry->wide ? 0x20 : 0x10;
+        bits = intern_hash_bytes(entry->bytes, entry->length * unit);
+    } else if (entry->kind == BPLIST_REAL || entry->kind == BPLIST_DATE) {
+        bits = double_to_raw(entry->value.r);
     } else {
-        write_byte(encoder, (kind << 4) + 15);
-        write_byte(encoder, 0x12);
-        write_multi_be(encoder, value, 4);
+        tag |= entry->wide ? INTERN_UNSIGNED : 0;
+        bits = (uint64_t)entry->value.i;
+    }
+    if ((first = intern_lookup(&encoder->interned, tag, bits, id)) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (first != id && entry->bytes) {
+        other = &encoder->entries[first];
+        if (other->kind != entry->kind || other->wide != entry->wide
+            || other->length != entry->length
+            || memcmp(other->bytes, entry->bytes, entry->length * unit)) {
+            return id;
+        }
     }
+    return first;
 }
 
-static void write_id(binaryplist_encoder *encoder, long val)
+/*
+ * Add a scalar, pointing at an earlier equal one when unique is set.
+ * Equal means equal as written: same plist type and same value, so 1,
+ * 1.0 and True, or a str and a Data with the same bytes, stay apart.
+ */
+static int add_scalar(binaryplist_encoder *encoder, PyObject *object,
+    const binaryplist_dispatch *type, long *ref)
 {
-    write_multi_be(encoder, val, encoder->ref_id_sz);
-}
+    long id = encoder->nobjects, first;
+    binaryplist_object *entry;
 
-static void write_int(binaryplist_encoder *encoder, long val)
-{
-    if (val < 0) {
-        write_byte(encoder, 0x13);
-        write_multi_be(encoder, val, 8);
-    } else if (val <= 0xff) {
-        write_byte(encoder, 0x10);
-        write_multi_be(encoder, val, 1);
-    } else if (val <= 0xffff) {
-        write_byte(encoder, 0x11);
-        write_multi_be(encoder, val, 2);
-    } else if (val <= 0xffffffffL) {
-        write_byte(encoder, 0x12);
-        write_multi_be(encoder, val, 4);
-    } else {
-        write_byte(encoder, 0x13);
-        write_multi_be(encoder, val, 8);
+    if (!encoder->dounique || type->cls == TYPE_NATIVE) {
+        /* native bytes are opaque until written, they are never merged */
+        if ((*ref = add_object(encoder, object, type)) < 0) {
+            return BINARYPLIST_ERROR;
+        }
+        TRACE(encoder, TRACE_OBJECT, encoder->entries[id].kind, id, 0);
+        return BINARYPLIST_OK;
+    }
+    if (reserve_entries(encoder, 1) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    /* captured in the next free slot, only kept if it is new */
+    entry = &encoder->entries[id];
+    memset(entry, 0, sizeof(binaryplist_object));
+    entry->object = object;
+    if (capture_object(encoder, entry, type) != BINARYPLIST_OK
+        || (first = intern_entry(encoder, entry, id)) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    if (first != id) {
+        *ref = first;
+        if (encoder->stats) {
+            encoder->stats->dedup_hits++;
+        }
+        TRACE(encoder, TRACE_UNIQUE, entry->kind, first, 0);
+        if (encoder->debug) {
+            fprintf(stderr, "encode_object(UNIQ ref:%ld): ", first);
+            PyObject_Print(object, stderr, 0); 
+            fprintf(stderr, "\n");
+        }
+        return BINARYPLIST_OK;
+    }
+    if ((*ref = commit_object(encoder, object)) < 0) {
+        return BINARYPLIST_ERROR;
     }
+    TRACE(encoder, TRACE_OBJECT, entry->kind, id, 0);
+    return BINARYPLIST_OK;
 }
 
-static long get_reference_id(binaryplist_encoder *encoder, PyObject *obj)
+/*
+ * Add a container with no python object behind it, for callers that fill
+ * in its child ids themselves. Returns its id or -1.
+ */
+long encoder_add_container(binaryplist_encoder *encoder, int kind, Py_ssize_t nrefs)
 {
-    long ref;
-    PyObject *ol = PyLong_FromVoidPtr((void *)obj);
-    ref =  PyLong_AsLong(PyDict_GetItem(encoder->ref_table, ol));
-    Py_DECREF(ol);
-    return ref;
+    long id = encoder->nobjects;
+
+    if (reserve_entries(encoder, 1) != BINARYPLIST_OK) {
+        return -1;
+    }
+    memset(&encoder->entries[id], 0, sizeof(binaryplist_object));
+    encoder->entries[id].kind = kind;
+    encoder->nobjects++;
+    if (reserve_refs(encoder, id, nrefs) != BINARYPLIST_OK) {
+        return -1;
+    }
+    return id;
 }
 
-static void write_dict(binaryplist_encoder *encoder, PyObject *obj)
+/*
+ * Copy in a finished subtree flattened by another encoder, see cache.c.
+ * Its entries and refs are numbered from 0; they are rebased onto the
+ * end of this encoder's arrays. Returns the new id of root or -1.
+ */
+long encoder_add_block(binaryplist_encoder *encoder, const binaryplist_object *entries,
+    Py_ssize_t n, const long *refs, Py_ssize_t nrefs, long root)
 {
-    Py_ssize_t i = 0;
-    PyObject *key, *value;
-    Py_ssize_t size = PyDict_Size(obj);
-    PyDictObject *mp = (PyDictObject*) obj;
+    long base = encoder->nobjects;
+    Py_ssize_t at = encoder->refs_len, i;
 
-    write_int_header(encoder, 0xD, size);
-    while (PyDict_Next((PyObject *)mp, &i, &key, &value)) {
-        write_id(encoder, get_reference_id(encoder, key));
+    if (reserve_entries(encoder, n) != BINARYPLIST_OK
+        || grow_refs(encoder, nrefs) != BINARYPLIST_OK) {
+        return -1;
     }
-    i = 0;
-    while (PyDict_Next((PyObject *)mp, &i, &key, &value)) {
-        write_id(encoder, get_reference_id(encoder, value));
+    memcpy(encoder->entries + base, entries, n * sizeof(binaryplist_object));
+    for (i = 0; i < n; i++) {
+        encoder->entries[base + i].refs_at += at;
     }
+    for (i = 0; i < nrefs; i++) {
+        encoder->refs[at + i] = refs[i] + base;
+    }
+    encoder->nobjects += n;
+    encoder->refs_len += nrefs;
+    TRACE(encoder, TRACE_CACHE, encoder->entries[base + root].kind, base + root, n);
+    return base + root;
 }
 
-static void write_list(binaryplist_encoder *encoder, PyObject *obj)
+/*
+ * Lists and tuples made only of exact ints and floats skip the generic
+ * per element path: no ref table, no python dedup, no object list.
+ */
+static int is_numeric_sequence(PyObject **items, Py_ssize_t n)
 {
-    Py_ssize_t i = 0;
-    PyListObject *v = (PyListObject*) obj;
+    Py_ssize_t i;
 
-    write_int_header(encoder, 0xA, v->ob_size);
-    for (i = 0; i < v->ob_size; i++) {
-        write_id(encoder, get_reference_id(encoder, v->ob_item[i]));
+    if (n < 2) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (!PyFloat_CheckExact(items[i]) && !PyInt_CheckExact(items[i])) {
+            return 0;
+        }
     }
+    return 1;
 }
 
-static void write_tuple(binaryplist_encoder *encoder, PyObject *obj)
+static int encode_numeric_sequence(binaryplist_encoder *encoder, PyObject **items,
+    Py_ssize_t n, long id)
 {
-    Py_ssize_t i = 0;
-    PyTupleObject *v = (PyTupleObject*) obj;
+    Py_ssize_t i, at;
+    long ref;
 
-    write_int_header(encoder, 0xA, v->ob_size);
-    for (i = 0; i < v->ob_size; ++i) {
-        write_id(encoder, get_reference_id(encoder, v->ob_item[i]));
+    if (reserve_refs(encoder, id, n) != BINARYPLIST_OK
+        || reserve_entries(encoder, n) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    at = encoder->entries[id].refs_at;
+    for (i = 0; i < n; i++) {
+        if (PyFloat_CheckExact(items[i])) {
+            ref = add_number(encoder, BPLIST_REAL, 0, 0, PyFloat_AS_DOUBLE(items[i]));
+        } else {
+            ref = add_number(encoder, BPLIST_UINT, 0, PyInt_AS_LONG(items[i]), 0);
+        }
+        if (ref < 0) {
+            return BINARYPLIST_ERROR;
+        }
+        encoder->refs[at + i] = ref;
     }
+    return BINARYPLIST_OK;
 }
 
-static int offset_size(long n) {
-    if (n < 256) return 1;
-    if (n < 65536) return 2;
-    if (n < 4294967296ULL) return 4;
-    return 8;
-}
+#define NOT_NUMERIC 2
 
-static int ref_id_size(int n) {
-    if (n < 256) return 1;
-    if (n < 65536) return 2;
-    return 4;
-}
+/*
+ * Numeric buffers (array.array, ctypes arrays, numpy vectors, ...) are
+ * written as arrays of ints, reals or bools. Element type is resolved
+ * once from the format. Byte formats are left alone.
+ */
+static int numeric_class(const char *format, Py_ssize_t itemsize)
+{
+    char code;
 
-static inline uint64_t double_to_raw(double x) {
-    uint64_t bits;
-    memcpy(&bits, &x, sizeof bits);
-    return bits;
+    if (!format) {
+        return 0;
+    }
+    if (*format == '@' || *format == '=' || *format == '^'
+#ifdef WORDS_BIGENDIAN
+        || *format == '>' || *format == '!'
+#else
+        || *format == '<'
+#endif
+        ) {
+        format++;
+    }
+    code = format[0];
+    if (!code || format[1]) {
+        return 0;
+    }
+    switch (code) {
+    case 'b': case 'h': case 'i': case 'l': case 'q':
+        return (itemsize == 1 || itemsize == 2 || itemsize == 4 || itemsize == 8) ? 'i' : 0;
+    case 'H': case 'I': case 'L': case 'Q':
+        return (itemsize == 2 || itemsize == 4 || itemsize == 8) ? 'u' : 0;
+    case 'f':
+        return (itemsize == 4) ? 'f' : 0;
+    case 'd':
+        return (itemsize == 8) ? 'd' : 0;
+    case '?':
+        return (itemsize == 1) ? '?' : 0;
+    }
+    return 0;
 }
 
-int encoder_write(binaryplist_encoder *encoder)
+static long add_element(binaryplist_encoder *encoder, int cls, const char *p, Py_ssize_t size)
 {
-    int i, off_sz;
-    PyListObject *objects = (PyListObject*) encoder->objects;
-    PyObject *object, *tmp;
-    Py_ssize_t len;
-    long off_pos, lval, *offsets;
-    uint8_t padding[] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
-    const char *errors = NULL;
-    char *buf;
-    int status = BINARYPLIST_OK;
+    int8_t i8; int16_t i16; int32_t i32; int64_t i64;
+    uint16_t u16; uint32_t u32; uint64_t u64;
+    float f;
+    double d;
 
-    encoder->ref_id_sz = ref_id_size(encoder->nobjects);
-    /* write the magic header data */
-    utstring_bincpy(encoder->output, BPLIST_MAGIC, BPLIST_MAGIC_SIZE);
-    utstring_bincpy(encoder->output, BPLIST_VERSION, BPLIST_VERSION_SIZE);
+    switch (cls) {
+    case 'i':
+        if (size == 1) { memcpy(&i8, p, 1); i64 = i8; }
+        else if (size == 2) { memcpy(&i16, p, 2); i64 = i16; }
+        else if (size == 4) { memcpy(&i32, p, 4); i64 = i32; }
+        else { memcpy(&i64, p, 8); }
+        return add_number(encoder, BPLIST_UINT, 0, (long)i64, 0);
+    case 'u':
+        if (size == 2) { memcpy(&u16, p, 2); u64 = u16; }
+        else if (size == 4) { memcpy(&u32, p, 4); u64 = u32; }
+        else { memcpy(&u64, p, 8); }
+        return add_number(encoder, BPLIST_UINT, u64 > LONG_MAX, (long)u64, 0);
+    case 'f':
+        memcpy(&f, p, 4);
+        return add_number(encoder, BPLIST_REAL, 0, 0, f);
+    case 'd':
+        memcpy(&d, p, 8);
+        return add_number(encoder, BPLIST_REAL, 0, 0, d);
+    }
+    return add_number(encoder, 0, 0, *p ? BPLIST_TRUE : BPLIST_FALSE, 0);
+}
 
-    /* write the object list */
-    offsets = malloc(sizeof(long) * objects->ob_size);
-    for (i = 0; i < objects->ob_size; i++) {
-        object = objects->ob_item[i];
-        offsets[i] = utstring_len(encoder->output);
-       if (binaryplist_data_type && PyObject_IsInstance(object, binaryplist_data_type) == 1) {
-            PyString_AsStringAndSize(object, &buf, &len);
-            write_int_header(encoder, 0x4, len);
-            write_bytes(encoder, buf, len);
-       } else if (binaryplist_uid_type && PyObject_IsInstance(object, binaryplist_uid_type) == 1) {
-            lval = PyLong_AsLong(object);
-            write_byte(encoder, 0x80 + offset_size(lval) - 1);
-            write_multi_be(encoder, lval, offset_size(lval));
-        } else if (object == Py_True) {
-            write_byte(encoder, 0x09);
-        } else if (object == Py_False) {
-            write_byte(encoder, 0x08);
-        } else if (object == Py_None) {
-            if (encoder->convert_nulls == Py_True) {
-                write_int_header(encoder, 0x5, 0);
-            } else {
-                write_byte(encoder, 0x00);
-            }
-        } else if (PyString_Check(object)) {
-            PyString_AsStringAndSize(object, &buf, &len);
-            write_int_header(encoder, 0x5, len);
-            write_bytes(encoder, buf, len);
-        } else if (PyUnicode_Check(object)) {
-            /*
-             * treat 0 len unicode as ascii. apple parser is weak like kitten.
-             *
-             */
-            if (PyUnicode_GET_SIZE(object) == 0) {
-                write_int_header(encoder, 0x5, 0);
-            } else {
-                if (encoder->as_ascii == Py_True && (tmp = PyUnicode_AsASCIIString(object))) {
-                    PyString_AsStringAndSize(tmp, &buf, &len);
-                    write_int_header(encoder, 0x5, len);
-                    write_bytes(encoder, buf, len);
-                } else {
-                    PyErr_Clear();
-                    tmp = PyUnicode_EncodeUTF16(PyUnicode_AS_UNICODE(object),
-                                                PyUnicode_GET_SIZE(object),
-                                                errors, 1 /* big endian */);
-                    PyString_AsStringAndSize(tmp, &buf, &len);
-                    /* nonsense, len here is characters not bytes */
-                    write_int_header(encoder, 0x6, len/2);
-                    write_bytes(encoder, buf, len);
-                }
-                Py_DECREF(tmp);
-            }
-        } else if (PyInt_Check(object) || PyLong_Check(object)) {
-            write_int(encoder, PyLong_AsLong(object));
-        } else if (PyDate_Check(object) || PyDateTime_Check(object)) {
-            struct tm t = {
-                PyDateTime_DATE_GET_SECOND(object),
-                PyDateTime_DATE_GET_MINUTE(object),
-                PyDateTime_DATE_GET_HOUR(object),
-                PyDateTime_GET_DAY(object),
-                PyDateTime_GET_MONTH(object)-1,
-                PyDateTime_GET_YEAR(object)-1900,
-                0,0,0
-            };
-            write_byte(encoder, 0x33);
-            write_long(encoder, double_to_raw(mktime(&t) - APPLE_EPOCH_OFFSET));
-        } else if (PyFloat_Check(object)) {
-            write_byte(encoder, 0x23);
-            write_long(encoder, double_to_raw(PyFloat_AS_DOUBLE(object)));
-        } else if (PyList_Check(object)) {
-            write_list(encoder, object);
-        } else if (PyTuple_Check(object)) {
-            write_tuple(encoder, object);
-        } else if (PyDict_Check(object)) {
-            write_dict(encoder, object);
-        } else {
-            status = BINARYPLIST_ERROR;
-            break;
+static int encode_numeric_buffer(binaryplist_encoder *encoder, PyObject *object, long *ref)
+{
+    Py_buffer view;
+    const void *buf;
+    Py_ssize_t i, n, len, at, stride, itemsize = 0;
+    PyObject *typecode;
+    char format[2] = {0, 0};
+    int cls, status = BINARYPLIST_ERROR, release = 0;
+    long id, eref;
+
+    if (is_array(object)) {
+        /* array.array only has the old buffer interface */
+        if (!(typecode = PyObject_GetAttrString(object, "typecode"))) {
+            return BINARYPLIST_ERROR;
         }
-        if (encoder->debug) {
-            fprintf(stderr, "write_object(ref:%ld, len:%ld): ", get_reference_id(encoder, object),
-                utstring_len(encoder->output) - offsets[i]);
-            PyObject_Print(object, stderr, 0); 
-            fprintf(stderr, "\n");
+        format[0] = PyString_Check(typecode) ? PyString_AS_STRING(typecode)[0] : 0;
+        Py_DECREF(typecode);
+        if (!(typecode = PyObject_GetAttrString(object, "itemsize"))) {
+            return BINARYPLIST_ERROR;
+        }
+        itemsize = PyInt_AsSsize_t(typecode);
+        Py_DECREF(typecode);
+        if (!(cls = numeric_class(format, itemsize))) {
+            return NOT_NUMERIC;
+        }
+        if (PyObject_AsReadBuffer(object, &buf, &len) < 0) {
+            return BINARYPLIST_ERROR;
         }
+        n = len / itemsize;
+        stride = itemsize;
+    } else if (PyObject_CheckBuffer(object)) {
+        if (PyObject_GetBuffer(object, &view, PyBUF_RECORDS_RO) < 0) {
+            PyErr_Clear();
+            return NOT_NUMERIC;
+        }
+        release = 1;
+        if (view.ndim != 1 || !(cls = numeric_class(view.format, view.itemsize))) {
+            PyBuffer_Release(&view);
+            return NOT_NUMERIC;
+        }
+        buf = view.buf;
+        n = view.shape[0];
+        stride = view.strides ? view.strides[0] : view.itemsize;
+        itemsize = view.itemsize;
+    } else {
+        return NOT_NUMERIC;
     }
 
-    /* write the offsets */
-    off_pos = utstring_len(encoder->output);
-    off_sz = offset_size(off_pos);
-    for (i = 0; i < objects->ob_size; i++) {
-        write_multi_be(encoder, offsets[i], off_sz);
+    if ((id = add_object(encoder, object, &types_builtin[TYPE_BUFFER])) < 0
+        || reserve_refs(encoder, id, n) != BINARYPLIST_OK
+        || reserve_entries(encoder, n) != BINARYPLIST_OK) {
+        goto done;
     }
-    if (encoder->debug) {
-        fprintf(stderr, "ref_id_sz: %d off_sz: %d offset table: %ld length: %d\n", 
-            encoder->ref_id_sz, off_sz,
-            off_pos, off_sz*encoder->nobjects);
-    }
-    free(offsets);
-
-    /* trailer */
-    write_bytes(encoder, padding, 6);
-    /* size of individual offset */
-    write_byte(encoder, off_sz);
-    /* size of individual ref */
-    write_byte(encoder, encoder->ref_id_sz);
-    /* number of objects */
-    write_long(encoder, objects->ob_size);
-    /* reference id of root object*/
-    write_long(encoder, get_reference_id(encoder, encoder->root));
-    /* byte position of offsets table */
-    write_long(encoder, off_pos);
+    *ref = id;
+    at = encoder->entries[id].refs_at;
+    for (i = 0; i < n; i++) {
+        if ((eref = add_element(encoder, cls, (const char *)buf + i * stride, itemsize)) < 0) {
+            goto done;
+        }
+        encoder->refs[at + i] = eref;
+    }
+    status = BINARYPLIST_OK;
 
+done:
+    if (release) {
+        PyBuffer_Release(&view);
+    }
     return status;
 }
 
+/* Formats of buffers written as data: bytes, unsigned or char */
+static int is_byte_format(const char *format)
+{
+    if (!format) {
+        return 1;
+    }
+    if (*format && strchr("@=<>!", *format)) {
+        format++;
+    }
+    return (format[0] == 'B' || format[0] == 'c') && !format[1];
+}
 
 /*
- * Routines for setting up encoder state.
- *
+ * Byte buffers (bytearray, memoryview, mmap, array.array('B'), ...) are
+ * written as data. New style buffers are held through a memoryview,
+ * which keeps them from being resized until the object list is dropped
+ * after the write, and are written straight from their memory. Old style
+ * ones (array.array, mmap, buffer) cannot be locked: python code run by
+ * hooks, file callbacks or other threads could resize or close them, so
+ * their bytes are copied when they are reached.
  */
-
-static int encode_dict(binaryplist_encoder *encoder, PyObject *dict)
+static int encode_byte_buffer(binaryplist_encoder *encoder, PyObject *object, long *ref)
 {
-    int status = BINARYPLIST_OK;
-    Py_ssize_t i = 0;
-    PyObject *key, *value;
-    PyDictObject *mp = (PyDictObject*) dict;
+    PyObject *held, *typecode;
+    Py_buffer *view;
+    const void *buf;
+    Py_ssize_t len;
+    int status, bytes;
 
-    i = Py_ReprEnter((PyObject *)mp);
-    if (i != 0) {
-        if (i > 0) {
-            PyErr_SetString(PLIST_Error, 
-                "a dict with references to itself is not encodable");
+    if (is_array(object)) {
+        if (!(typecode = PyObject_GetAttrString(object, "typecode"))) {
+            return BINARYPLIST_ERROR;
         }
-        return BINARYPLIST_ERROR;
-    }
-
-    i = 0;
-    while (PyDict_Next((PyObject *)mp, &i, &key, &value)) {
-        if (encoder_encode_object(encoder, key) != BINARYPLIST_OK
-            || encoder_encode_object(encoder, value) != BINARYPLIST_OK) {
-            status = BINARYPLIST_ERROR;
-            break;
+        bytes = PyString_Check(typecode) && PyString_GET_SIZE(typecode) == 1
+            && is_byte_format(PyString_AS_STRING(typecode));
+        Py_DECREF(typecode);
+        if (!bytes) {
+            return NOT_NUMERIC;
+        }
+        if (PyObject_AsReadBuffer(object, &buf, &len) < 0
+            || !(held = PyString_FromStringAndSize(buf, len))) {
+            return BINARYPLIST_ERROR;
+        }
+    } else if (PyObject_CheckBuffer(object)) {
+        if (!(held = PyMemoryView_FromObject(object))) {
+            PyErr_Clear();
+            return NOT_NUMERIC;
         }
+        view = PyMemoryView_GET_BUFFER(held);
+        if (view->itemsize != 1 || !is_byte_format(view->format)
+            || !PyBuffer_IsContiguous(view, 'C')) {
+            Py_DECREF(held);
+            return NOT_NUMERIC;
+        }
+    } else if (PyObject_CheckReadBuffer(object)) {
+        if (PyObject_AsReadBuffer(object, &buf, &len) < 0
+            || !(held = PyString_FromStringAndSize(buf, len))) {
+            return BINARYPLIST_ERROR;
+        }
+    } else {
+        return NOT_NUMERIC;
     }
-    Py_ReprLeave((PyObject *)mp);
+    status = add_scalar(encoder, held, &types_builtin[TYPE_DATA], ref);
+    Py_DECREF(held);
     return status;
 }
 
-static int encode_list(binaryplist_encoder *encoder, PyObject *list)
+/*
+ * Traversal. Containers are walked with an explicit stack instead of C
+ * recursion, so depth is only bounded by max_recursion and memory. Ids
+ * are handed out in the same depth first pre-order as before: a
+ * container gets its id when it is first seen, then its children in
+ * order (dict keys and values interleaved).
+ *
+ */
+
+static int push_frame(binaryplist_encoder *encoder, PyObject *container, long id)
 {
-    int i;
-    int status = BINARYPLIST_OK;
-    PyListObject *v = (PyListObject*) list;
+    binaryplist_frame *frame;
+    Py_ssize_t cap, size;
 
-    i = Py_ReprEnter((PyObject*)v);
-    if (i != 0) {
-        if (i > 0) {
-            PyErr_SetString(PLIST_Error, 
-                "a dict with references to itself is not encodable");
-        }
+    if (encoder->depth + 1 >= encoder->max_recursion) {
+        PyErr_SetString(PLIST_Error, "object depth exceeded max_recursion");
         return BINARYPLIST_ERROR;
     }
-
-    for (i = 0; i < v->ob_size; ++i) {
-        if (encoder_encode_object(encoder, v->ob_item[i]) != BINARYPLIST_OK) {
-            status = BINARYPLIST_ERROR;
-            break;
+    if (encoder->depth >= encoder->stack_cap) {
+        cap = encoder->stack_cap ? encoder->stack_cap * 2 : 64;
+        frame = realloc(encoder->stack, cap * sizeof(binaryplist_frame));
+        if (!frame) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
         }
+        encoder->stack = frame;
+        encoder->stack_cap = cap;
     }
-    Py_ReprLeave((PyObject *)v);
-    return status;
-}
-
-static int encode_tuple(binaryplist_encoder *encoder, PyObject *tuple)
-{
-    int i;
-    PyTupleObject *v = (PyTupleObject*) tuple;
-
-    for (i = 0; i < v->ob_size; ++i) {
-        if (encoder_encode_object(encoder, v->ob_item[i]) != BINARYPLIST_OK) {
+    size = Py_SIZE(container);
+    if (PyDict_Check(container)) {
+        size = PyDict_Size(container);
+        if (reserve_refs(encoder, id, size * 2) != BINARYPLIST_OK) {
             return BINARYPLIST_ERROR;
         }
+    } else if (reserve_refs(encoder, id, size) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
     }
+    frame = &encoder->stack[encoder->depth++];
+    frame->container = container;
+    frame->value = NULL;
+    frame->id = id;
+    frame->slot = -1;
+    frame->pos = frame->k = 0;
+    frame->size = size;
+    frame->at = encoder->entries[id].refs_at;
+    encoder->entries[id].open = 1;
+    TRACE(encoder, TRACE_PUSH, encoder->entries[id].kind, id, size);
     return BINARYPLIST_OK;
 }
 
-static PyObject *get_unique(binaryplist_encoder *encoder, PyObject *object)
+static void pop_frame(binaryplist_encoder *encoder)
 {
-    PyObject *tmp = NULL;
+    binaryplist_frame *frame = &encoder->stack[--encoder->depth];
 
-    if (encoder->dounique && UNIQABLE(object)) {
-        if (object == Py_None) {
-            (encoder->uNone) ? (tmp = encoder->uNone) : (tmp = NULL);
-        } else if (object == Py_True) {
-            (encoder->uTrue) ? (tmp = encoder->uTrue) : (tmp = NULL);
-        } else if (object == Py_False) {
-            (encoder->uFalse) ? (tmp = encoder->uFalse) : (tmp = NULL);
-        } else {
-            tmp = PyDict_GetItem(encoder->uniques, object);
-        }
+    TRACE(encoder, TRACE_POP, encoder->entries[frame->id].kind, frame->id, 0);
+    encoder->entries[frame->id].open = 0;
+    Py_CLEAR(frame->value);
+}
+
+/* Pop a finished container, merging it with an earlier equal one. */
+static int finish_frame(binaryplist_encoder *encoder, long *ref)
+{
+    binaryplist_frame *frame = &encoder->stack[encoder->depth - 1];
+    Py_ssize_t slot = frame->slot;
+    long id;
+
+    pop_frame(encoder);
+    if ((id = dedup_container(encoder, frame->id)) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    if (slot >= 0) {
+        encoder->refs[slot] = id;
+    } else {
+        *ref = id;
     }
-    return tmp;
+    return BINARYPLIST_OK;
 }
 
-static void set_ref(binaryplist_encoder *encoder, void *object, long id)
+/*
+ * Next child of the frame as a new reference, with the refs slot its id
+ * goes to. Returns 1 for a child, 0 when the container is done, -1 on
+ * error.
+ */
+static int next_child(binaryplist_frame *frame, PyObject **child, Py_ssize_t *slot)
 {
-    PyObject *ol, *oid;
+    PyObject *container = frame->container, *key, *value;
 
-    ol = PyLong_FromVoidPtr(object);
-    oid = PyLong_FromLong(id);
-    PyDict_SetItem(encoder->ref_table, ol, oid);
-    Py_DECREF(ol);
-    Py_DECREF(oid);
+    if (PyDict_Check(container)) {
+        if (frame->value) {
+            *child = frame->value;
+            *slot = frame->at + frame->size + frame->k++;
+            frame->value = NULL;
+            return 1;
+        }
+        if (!PyDict_Next(container, &frame->pos, &key, &value)) {
+            if (frame->k != frame->size) {
+                PyErr_SetString(PLIST_Error, "dict changed size during encoding");
+                return -1;
+            }
+            return 0;
+        }
+        if (frame->k >= frame->size) {
+            PyErr_SetString(PLIST_Error, "dict changed size during encoding");
+            return -1;
+        }
+        Py_INCREF(key);
+        Py_INCREF(value);
+        *child = key;
+        *slot = frame->at + frame->k;
+        frame->value = value;
+        return 1;
+    }
+    if (frame->pos >= frame->size) {
+        return 0;
+    }
+    if (frame->pos >= Py_SIZE(container)) {
+        PyErr_SetString(PLIST_Error, "list changed size during encoding");
+        return -1;
+    }
+    *child = PyList_Check(container) ? PyList_GET_ITEM(container, frame->pos)
+        : PyTuple_GET_ITEM(container, frame->pos);
+    Py_INCREF(*child);
+    *slot = frame->at + frame->pos++;
+    return 1;
 }
 
-int encoder_encode_object(binaryplist_encoder *encoder, PyObject *object)
+/*
+ * Give one object its reference id. Scalars are finished here; a
+ * container gets its id and is pushed so the caller walks its children.
+ */
+static int encode_value(binaryplist_encoder *encoder, PyObject *object, long *ref)
 {
-    PyObject *ou, *tmp = NULL;
-    int ret;
+    PyObject *tmp = NULL, *hooked = NULL, *convert;
+    PyObject **items;
+    const binaryplist_dispatch *dispatch;
+    binaryplist_dispatch type;
+    int ret, hooks = 0;
+    long id;
 
     if (!object) {
         PyErr_SetString(PLIST_Error, "object contains an unsupported type");
         return BINARYPLIST_ERROR;
     }
 
-    /* Add supported data types below */
-    if (!PyDict_Check(object) && !PyList_Check(object) && !PyTuple_Check(object)
-        && object != Py_True && object != Py_False && object != Py_None
-        && !PyString_Check(object) && !PyUnicode_Check(object)
-        && !PyFloat_Check(object) && !PyInt_Check(object)
-        && !PyDateTime_Check(object) && !PyDate_Check(object)
-        && !PyLong_Check(object) ){
-
-        if (encoder->object_hook != Py_None) {
-            /*
-             * total hack. add the crap object to the table to reference what will
-             * hopefully be the right object returned by the hook.
-             *
-             */
-            tmp = PyObject_CallFunctionObjArgs(encoder->object_hook, object, NULL);
-            if (!tmp) {
+    /* Add supported data types in types.c */
+    for (;;) {
+        if (!(dispatch = types_lookup(object))) {
+            Py_XDECREF(hooked);
+            return BINARYPLIST_ERROR;
+        }
+        /* converters may register types, which moves the records */
+        type = *dispatch;
+        if (type.cls == TYPE_BUFFER) {
+            if ((ret = encode_numeric_buffer(encoder, object, ref)) != NOT_NUMERIC) {
+                if (ret == BINARYPLIST_OK && (*ref = dedup_container(encoder, *ref)) < 0) {
+                    ret = BINARYPLIST_ERROR;
+                }
+                Py_XDECREF(hooked);
+                return ret;
+            }
+            if ((ret = encode_byte_buffer(encoder, object, ref)) != NOT_NUMERIC) {
+                Py_XDECREF(hooked);
+                return ret;
+            }
+            convert = encoder->object_hook;
+        } else if (type.cls == TYPE_FROZEN) {
+            if (encoder->cache
+                && (ret = cache_encode(encoder, object, ref)) != CACHE_SKIP) {
+                Py_XDECREF(hooked);
+                return ret;
+            }
+            /* only a marker, encode what it wraps */
+            tmp = PyObject_GetAttrString(object, "value");
+            Py_XDECREF(hooked);
+            if (!(hooked = object = tmp)) {
                 return BINARYPLIST_ERROR;
             }
-            ou = get_unique(encoder, tmp);
-            set_ref(encoder, (void *)object, (ou ? get_reference_id(encoder, ou) : encoder->nobjects));
-            ret = encoder_encode_object(encoder, tmp);
-            Py_DECREF(tmp);
-            return ret;
+            continue;
+        } else if (type.cls == TYPE_CONVERTER) {
+            convert = type.converter;
+        } else if (type.cls == TYPE_UNKNOWN) {
+            convert = encoder->object_hook;
         } else {
+            break;
+        }
+        if (!convert || convert == Py_None) {
             PyErr_SetString(PLIST_Error, "object contains an unsupported type");
+            Py_XDECREF(hooked);
+            return BINARYPLIST_ERROR;
+        }
+        if (++hooks >= encoder->max_recursion) {
+            PyErr_SetString(PLIST_Error, (convert == encoder->object_hook)
+                ? "object_hook exceeded max_recursion" : "converter exceeded max_recursion");
+            Py_XDECREF(hooked);
+            return BINARYPLIST_ERROR;
+        }
+        /*
+         * encode whatever the hook hands back in place of the object.
+         * the result is kept alive by the object list if it is used.
+         *
+         */
+        Py_INCREF(convert);
+        tmp = PyObject_CallFunctionObjArgs(convert, object, NULL);
+        Py_DECREF(convert);
+        Py_XDECREF(hooked);
+        if (!(hooked = object = tmp)) {
             return BINARYPLIST_ERROR;
         }
     }
+    ret = BINARYPLIST_OK;
 
-    if (!encoder->root) {
-        encoder->root = object;
+    if (encoder->dounique
+        && (PyInt_CheckExact(object) || PyFloat_CheckExact(object))) {
+        /* plain numbers dedup natively and need no ref table entry */
+        if (reserve_entries(encoder, 1) != BINARYPLIST_OK) {
+            ret = BINARYPLIST_ERROR;
+        } else if (PyFloat_CheckExact(object)) {
+            *ref = add_number(encoder, BPLIST_REAL, 0, 0, PyFloat_AS_DOUBLE(object));
+        } else {
+            *ref = add_number(encoder, BPLIST_UINT, 0, PyInt_AS_LONG(object), 0);
+        }
+        if (ret == BINARYPLIST_OK && *ref < 0) {
+            ret = BINARYPLIST_ERROR;
+        }
+        goto done;
     }
-        
 
-    if (encoder->dounique && UNIQABLE(object)) {
-        if (object == Py_None) {
-            (encoder->uNone) ? (tmp = encoder->uNone) : (encoder->uNone = object);
-        } else if (object == Py_True) {
-            (encoder->uTrue) ? (tmp = encoder->uTrue) : (encoder->uTrue = object);
-        } else if (object == Py_False) {
-            (encoder->uFalse) ? (tmp = encoder->uFalse) : (encoder->uFalse = object);
-        } else {
-            tmp = PyDict_GetItem(encoder->uniques, object);
-            if (!tmp) {
-                PyDict_SetItem(encoder->uniques, object, object);
+    if (encoder->debug) {
+        fprintf(stderr, "encode_object(ref:%ld depth:%d): ", (long)encoder->nobjects,
+            encoder->depth);
+        PyObject_Print(object, stderr, 0); 
+        fprintf(stderr, "\n");
+    }
+    if (type.cls != TYPE_DICT && type.cls != TYPE_ARRAY) {
+        ret = add_scalar(encoder, object, &type, ref);
+        goto done;
+    }
+
+    if (encoder->cache && PyTuple_CheckExact(object)
+        && (ret = cache_encode(encoder, object, ref)) != CACHE_SKIP) {
+        goto done;
+    }
+    ret = BINARYPLIST_OK;
+    if (ptrmap_get(&encoder->ref_table, object, &id) && encoder->entries[id].open) {
+        PyErr_SetString(PLIST_Error,
+            "a container with references to itself is not encodable");
+        ret = BINARYPLIST_ERROR;
+        goto done;
+    }
+    if ((id = add_object(encoder, object, &type)) < 0) {
+        ret = BINARYPLIST_ERROR;
+        goto done;
+    }
+    *ref = id;
+    TRACE(encoder, TRACE_OBJECT, encoder->entries[id].kind, id, 0);
+
+    if (type.cls == TYPE_ARRAY) {
+        items = PyList_Check(object) ? ((PyListObject *)object)->ob_item
+            : ((PyTupleObject *)object)->ob_item;
+        if (is_numeric_sequence(items, Py_SIZE(object))) {
+            ret = encode_numeric_sequence(encoder, items, Py_SIZE(object), id);
+            if (ret == BINARYPLIST_OK && (*ref = dedup_container(encoder, id)) < 0) {
+                ret = BINARYPLIST_ERROR;
             }
+        } else {
+            ret = push_frame(encoder, object, id);
         }
-        if (tmp) {
-            /*
-             * add object to the reference table pointing to its first
-             * occurrence. do NOT append to object list since we already
-             * exist.
-             *
-             */
-            set_ref(encoder, (void *)object, get_reference_id(encoder, tmp));
-            if (encoder->debug) {
-                fprintf(stderr, "encode_object(UNIQ ref:%ld): ", get_reference_id(encoder, tmp));
-                PyObject_Print(object, stderr, 0); 
-                fprintf(stderr, "\n");
+    } else {
+        ret = push_frame(encoder, object, id);
+    }
+
+done:
+    Py_XDECREF(hooked);
+    return ret;
+}
+
+int encoder_encode_object(binaryplist_encoder *encoder, PyObject *object, long *ref)
+{
+    int base = encoder->depth, depth, status;
+    PyObject *child;
+    Py_ssize_t slot;
+    long id;
+    uint64_t start = encoder->stats ? trace_now() : 0;
+
+    TRACE(encoder, TRACE_BEGIN, 0, encoder->nobjects, TRACE_TRAVERSE);
+    if (encode_value(encoder, object, ref) != BINARYPLIST_OK) {
+        goto fail;
+    }
+    while (encoder->depth > base) {
+        status = next_child(&encoder->stack[encoder->depth - 1], &child, &slot);
+        if (status == 0) {
+            if (finish_frame(encoder, ref) != BINARYPLIST_OK) {
+                goto fail;
             }
-            return BINARYPLIST_OK;
+            continue;
+        }
+        if (status < 0) {
+            goto fail;
+        }
+        depth = encoder->depth;
+        status = encode_value(encoder, child, &id);
+        Py_DECREF(child);
+        if (status != BINARYPLIST_OK) {
+            goto fail;
+        }
+        encoder->refs[slot] = id;
+        if (encoder->depth > depth) {
+            /* pushed, patched again if it merges when finished */
+            encoder->stack[encoder->depth - 1].slot = slot;
         }
     }
+    status = BINARYPLIST_OK;
+    goto done;
 
-    if (++encoder->depth >= encoder->max_recursion) {
-        PyErr_SetString(PLIST_Error, "object depth exceeded max_recursion");
+fail:
+    while (encoder->depth > base) {
+        pop_frame(encoder);
+    }
+    status = BINARYPLIST_ERROR;
+
+done:
+    if (encoder->stats) {
+        encoder->stats->traverse_ns += trace_now() - start;
+    }
+    TRACE(encoder, TRACE_END, 0, encoder->nobjects, TRACE_TRAVERSE);
+    return status;
+}
+
+/*
+ * Routines for encoder lifetime. An encoder can be reset and reused;
+ * everything it allocated stays at its high-water mark until shrunk.
+ *
+ */
+
+/* unique is a truth value or the string "deep", NULL means True */
+static int unique_level(PyObject *ounique)
+{
+    PyObject *deep;
+    int match;
+
+    if (!ounique) {
+        return UNIQUE_SCALARS;
+    }
+    if (!PyString_Check(ounique) && !PyUnicode_Check(ounique)) {
+        match = PyObject_IsTrue(ounique);
+        return match < 0 ? -1 : (match ? UNIQUE_SCALARS : 0);
+    }
+    if (!(deep = PyString_FromString("deep"))) {
+        return -1;
+    }
+    match = PyObject_RichCompareBool(ounique, deep, Py_EQ);
+    Py_DECREF(deep);
+    if (match == 0) {
+        PyErr_SetString(PLIST_Error, "unique must be True, False or \"deep\"");
+    }
+    return match > 0 ? UNIQUE_DEEP : -1;
+}
+
+int encoder_setup(binaryplist_encoder *encoder, PyObject *ounique, PyObject *odebug,
+    PyObject *orecursion)
+{
+    int level;
+
+    if (encoder->object_hook && !PyCallable_Check(encoder->object_hook)) {
+        PyErr_SetString(PLIST_Error, "object_hook is not callable");
         return BINARYPLIST_ERROR;
     }
-    if (encoder->debug) {
-        fprintf(stderr, "encode_object(ref:%d depth:%d): ", encoder->nobjects, encoder->depth);
-        PyObject_Print(object, stderr, 0); 
-        fprintf(stderr, "\n");
+    if ((level = unique_level(ounique)) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    if (ptrmap_init(&encoder->ref_table, 0) != 0) {
+        PyErr_NoMemory();
+        return BINARYPLIST_ERROR;
+    }
+    if (!(encoder->objects = PyList_New(0))) {
+        return BINARYPLIST_ERROR;
+    }
+    encoder->dounique = level;
+    if (encoder->dounique) {
+        if (intern_init(&encoder->interned, 0) != 0) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
+        }
+    }
+    if (odebug && PyObject_IsTrue(odebug)) {
+        encoder->debug = 1;
+    }
+    if (orecursion && PyInt_Check(orecursion)) {
+        encoder->max_recursion = PyInt_AsLong(orecursion);
+    } else {
+        encoder->max_recursion = 1024*16;
     }
-    set_ref(encoder, (void *)object, encoder->nobjects++);
-    PyList_Append(encoder->objects, object);
+    return BINARYPLIST_OK;
+}
 
-    if (PyDict_Check(object)) {
-        return encode_dict(encoder, object);
-    } else if (PyList_Check(object)) {
-        return encode_list(encoder, object);
-    } else if (PyTuple_Check(object)) {
-        return encode_tuple(encoder, object);
+/* Forget the last object graph but keep every table and array allocated. */
+void encoder_reset(binaryplist_encoder *encoder)
+{
+    encoder->nobjects = 0;
+    encoder->depth = 0;
+    encoder->refs_len = 0;
+    ptrmap_clear(&encoder->ref_table);
+    if (encoder->objects) {
+        PyList_SetSlice(encoder->objects, 0, PyList_GET_SIZE(encoder->objects), NULL);
     }
+    if (encoder->dounique) {
+        intern_clear(&encoder->interned);
+    }
+    bplist_output_init(&encoder->out, NULL, 0, NULL, NULL);
+    encoder->error = NULL;
+}
 
-    encoder->depth--;
+/* Give back the memory held at the high-water mark. */
+int encoder_shrink(binaryplist_encoder *encoder)
+{
+    encoder_reset(encoder);
+    free(encoder->entries);
+    free(encoder->refs);
+    free(encoder->stack);
+    encoder->entries = NULL;
+    encoder->refs = NULL;
+    encoder->stack = NULL;
+    encoder->entries_cap = encoder->refs_cap = encoder->stack_cap = 0;
+    ptrmap_free(&encoder->ref_table);
+    if (ptrmap_init(&encoder->ref_table, 0) != 0) {
+        PyErr_NoMemory();
+        return BINARYPLIST_ERROR;
+    }
+    if (encoder->dounique) {
+        intern_free(&encoder->interned);
+        if (intern_init(&encoder->interned, 0) != 0) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
+        }
+    }
     return BINARYPLIST_OK;
 }
 
+void encoder_free(binaryplist_encoder *encoder)
+{
+    ptrmap_free(&encoder->ref_table);
+    free(encoder->entries);
+    free(encoder->refs);
+    free(encoder->stack);
+    Py_CLEAR(encoder->objects);
+    intern_free(&encoder->interned);
+    encoder->entries = NULL;
+    encoder->refs = NULL;
+    encoder->stack = NULL;
+}
+
 void encoder_init()
 {
     PyObject *tmp, *class, *module_name, *module, *module_dict;
@@ -497,9 +1940,20 @@ void encoder_init()
             binaryplist_data_type = PyObject_Type(tmp);
             Py_DECREF(tmp);
         }
+        class = PyDict_GetItemString(module_dict, "Frozen");
+        if (PyCallable_Check(class)) {
+            tmp = PyObject_CallObject(class, NULL);
+            binaryplist_frozen_type = PyObject_Type(tmp);
+            Py_DECREF(tmp);
+        }
         Py_XDECREF(module_name);
         Py_XDECREF(module);
     }
+    if (!array_type && (module = PyImport_ImportModule("array"))) {
+        array_type = PyObject_GetAttrString(module, "ArrayType");
+        Py_DECREF(module);
+    }
+    PyErr_Clear();
     if (!PLIST_Error) {
         PLIST_Error = PyErr_NewException("binaryplist.Error", NULL, NULL);
     }   
@@ -0,0 +1,241 @@
+#include "binaryplist.h"
+
+
+/*
+ * Reusable encoder. Options are parsed once and the ref table, intern
+ * tables and flattened object arrays are kept between calls, so a
+ * steady stream of encodes stops allocating once it hits its
+ * high-water mark. shrink() hands the memory back. With cache=n, up to n
+ * immutable subtrees are kept flattened between calls, see cache.c.
+ *
+ */
+
+typedef struct {
+    PyObject_HEAD
+    binaryplist_encoder encoder;
+    binaryplist_stats stats;
+    binaryplist_trace trace;
+    int ready;
+    int busy;
+} binaryplist_encoderobject;
+
+static void encoderobject_dealloc(binaryplist_encoderobject *self)
+{
+    cache_free(self->encoder.cache);
+    encoder_free(&self->encoder);
+    trace_free(&self->trace);
+    Py_XDECREF(self->encoder.object_hook);
+    Py_XDECREF(self->encoder.convert_nulls);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int encoderobject_tp_init(binaryplist_encoderobject *self, PyObject *args,
+    PyObject *kwargs)
+{
+    static char *kwlist[] = {"unique", "debug", "convert_nulls",
+                             "max_recursion", "object_hook", "as_ascii", "stats",
+                             "trace", "cache", NULL};
+    PyObject *ounique = NULL;
+    PyObject *odebug = NULL;
+    PyObject *orecursion = NULL;
+    PyObject *oascii = NULL;
+    int dostats = 0;
+    unsigned int trace_size = 0;
+    Py_ssize_t cache_size = 0;
+
+    if (self->ready) {
+        PyErr_SetString(PLIST_Error, "encoder is already initialized");
+        return -1;
+    }
+    self->encoder.convert_nulls = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOOOOiIn", kwlist, &ounique,
+        &odebug, &(self->encoder.convert_nulls), &orecursion, &(self->encoder.object_hook),
+        &oascii, &dostats, &trace_size, &cache_size)) {
+        self->encoder.convert_nulls = NULL;
+        self->encoder.object_hook = NULL;
+        return -1;
+    }
+    Py_INCREF(self->encoder.convert_nulls);
+    Py_XINCREF(self->encoder.object_hook);
+    if (encoder_setup(&self->encoder, ounique, odebug, orecursion) != BINARYPLIST_OK) {
+        return -1;
+    }
+    if (dostats) {
+        self->encoder.stats = &self->stats;
+    }
+    if (trace_size) {
+        if (trace_init(&self->trace, trace_size) != 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->encoder.trace = &self->trace;
+    }
+    if (cache_size < 0) {
+        PyErr_SetString(PLIST_Error, "cache must not be negative");
+        return -1;
+    }
+    if (cache_size && !(self->encoder.cache = cache_new(&self->encoder, cache_size))) {
+        return -1;
+    }
+    self->ready = 1;
+    return 0;
+}
+
+static PyObject *encoderobject_encode(binaryplist_encoderobject *self, PyObject *args)
+{
+    PyObject *oinput, *newobj = NULL;
+    binaryplist_encoder *encoder = &self->encoder;
+    long root;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "O", &oinput)) {
+        return NULL;
+    }
+    if (!self->ready || self->busy) {
+        PyErr_SetString(PLIST_Error, self->ready ? "encoder is already encoding"
+            : "encoder is not initialized");
+        return NULL;
+    }
+    self->busy = 1;
+    encoder_reset(encoder);
+    memset(&self->stats, 0, sizeof(binaryplist_stats));
+    if (encoder->trace) {
+        trace_reset(encoder->trace);
+    }
+    if (encoder->cache) {
+        cache_start(encoder->cache);
+    }
+
+    if (encoder_encode_object(encoder, oinput, &root) == BINARYPLIST_OK
+        && encoder_size(encoder) >= 0
+        && (newobj = PyString_FromStringAndSize(NULL, encoder->size))) {
+        bplist_output_init(&encoder->out, (uint8_t *)PyString_AS_STRING(newobj),
+            encoder->size, NULL, NULL);
+        if (encoder->debug) {
+            status = encoder_write(encoder);
+        } else {
+            Py_BEGIN_ALLOW_THREADS
+            status = encoder_write(encoder);
+            Py_END_ALLOW_THREADS
+        }
+        if (status != BINARYPLIST_OK) {
+            encoder_set_error(encoder);
+            Py_CLEAR(newobj);
+        }
+    }
+
+    /* drop references to the caller's objects, keep the storage */
+    encoder_reset(encoder);
+    self->busy = 0;
+    return newobj;
+}
+
+static PyObject *encoderobject_shrink(binaryplist_encoderobject *self)
+{
+    if (self->busy) {
+        PyErr_SetString(PLIST_Error, "encoder is already encoding");
+        return NULL;
+    }
+    if (self->encoder.cache) {
+        cache_clear(self->encoder.cache);
+    }
+    if (self->ready && encoder_shrink(&self->encoder) != BINARYPLIST_OK) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *encoderobject_get_stats(binaryplist_encoderobject *self, void *closure)
+{
+    return encoder_stats(&self->encoder);
+}
+
+/* Raw trace records of the last encode, oldest first. */
+static PyObject *encoderobject_trace(binaryplist_encoderobject *self)
+{
+    binaryplist_trace *trace = &self->trace;
+    uint32_t n = trace_count(trace), first = trace_first(trace), head;
+    size_t rsz = sizeof(binaryplist_trace_record);
+    PyObject *out;
+    char *p;
+
+    if (!(out = PyString_FromStringAndSize(NULL, n * rsz))) {
+        return NULL;
+    }
+    p = PyString_AS_STRING(out);
+    if (n) {
+        head = trace->size - first < n ? trace->size - first : n;
+        memcpy(p, trace->records + first, head * rsz);
+        memcpy(p + head * rsz, trace->records, (n - head) * rsz);
+    }
+    return out;
+}
+
+static PyGetSetDef encoderobject_getset[] =
+{
+    {"stats", (getter)encoderobject_get_stats, NULL,
+     "Stats of the last encode as a dict, None unless created with stats=True.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMethodDef encoderobject_methods[] =
+{
+    {"encode", (PyCFunction)encoderobject_encode, METH_VARARGS,
+     "Generate the binary plist representation of an object."},
+    {"shrink", (PyCFunction)encoderobject_shrink, METH_NOARGS,
+     "Release memory kept from earlier encodes, the subtree cache included."},
+    {"trace", (PyCFunction)encoderobject_trace, METH_NOARGS,
+     "Raw trace records of the last encode, oldest first."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject binaryplist_encoderobject_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libbinaryplist.Encoder",                   /* tp_name */
+    sizeof(binaryplist_encoderobject),          /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)encoderobject_dealloc,          /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Binary plist encoder that reuses its storage between calls.", /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    encoderobject_methods,                      /* tp_methods */
+    0,                                          /* tp_members */
+    encoderobject_getset,                       /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)encoderobject_tp_init,            /* tp_init */
+    0,                                          /* tp_alloc */
+    PyType_GenericNew,                          /* tp_new */
+};
+
+int encoderobject_init(PyObject *module)
+{
+    if (PyType_Ready(&binaryplist_encoderobject_type) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    Py_INCREF(&binaryplist_encoderobject_type);
+    PyModule_AddObject(module, "Encoder", (PyObject *)&binaryplist_encoderobject_type);
+    return BINARYPLIST_OK;
+}
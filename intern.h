@@ -0,0 +1,140 @@
+/*
+ * Open addressing intern table for plist values. Keys are a type tag
+ * plus a 64 bit raw value or payload hash, so values python considers
+ * equal but plist does not (1, 1.0, True) never merge. Hashed keys must
+ * be confirmed by the caller.
+ *
+ */
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_MIN_SIZE 64
+
+typedef struct {
+    uint64_t bits;
+    long id;
+    uint8_t kind;
+    uint8_t used;
+} intern_slot;
+
+typedef struct {
+    intern_slot *slots;
+    size_t mask;
+    size_t count;
+} intern_table;
+
+static inline size_t intern_hash(uint8_t kind, uint64_t bits)
+{
+    uint64_t h = (bits ^ ((uint64_t)kind << 56)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 29));
+}
+
+/* Payload hash for strings and data, eight bytes at a time. */
+static inline uint64_t intern_hash_bytes(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len, w;
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+        p += 8;
+        len -= 8;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 29);
+}
+
+static inline int intern_init(intern_table *table, size_t size)
+{
+    size_t n = INTERN_MIN_SIZE;
+
+    while (n < size * 2) {
+        n <<= 1;
+    }
+    table->slots = (intern_slot *)calloc(n, sizeof(intern_slot));
+    table->mask = n - 1;
+    table->count = 0;
+    return table->slots ? 0 : -1;
+}
+
+static inline void intern_free(intern_table *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->mask = 0;
+    table->count = 0;
+}
+
+static inline void intern_clear(intern_table *table)
+{
+    if (table->count) {
+        memset(table->slots, 0, (table->mask + 1) * sizeof(intern_slot));
+        table->count = 0;
+    }
+}
+
+static inline intern_slot *intern_find(const intern_table *table, uint8_t kind, uint64_t bits)
+{
+    size_t i = intern_hash(kind, bits) & table->mask;
+    intern_slot *slot;
+
+    for (;;) {
+        slot = &table->slots[i];
+        if (!slot->used || (slot->bits == bits && slot->kind == kind)) {
+            return slot;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+static inline int intern_grow(intern_table *table)
+{
+    intern_table grown;
+    size_t i;
+
+    if (intern_init(&grown, table->mask + 1) != 0) {
+        return -1;
+    }
+    for (i = 0; i <= table->mask; i++) {
+        if (table->slots[i].used) {
+            *intern_find(&grown, table->slots[i].kind, table->slots[i].bits) = table->slots[i];
+        }
+    }
+    grown.count = table->count;
+    free(table->slots);
+    *table = grown;
+    return 0;
+}
+
+/*
+ * Look a value up, claiming it for new_id when it is not present yet.
+ * Returns the id of the first occurrence (new_id when claimed), or -1
+ * on allocation failure.
+ */
+static inline long intern_lookup(intern_table *table, uint8_t kind, uint64_t bits, long new_id)
+{
+    intern_slot *slot;
+
+    if ((table->count + 1) * 2 > table->mask + 1 && intern_grow(table) != 0) {
+        return -1;
+    }
+    slot = intern_find(table, kind, bits);
+    if (!slot->used) {
+        slot->used = 1;
+        slot->kind = kind;
+        slot->bits = bits;
+        slot->id = new_id;
+        table->count++;
+    }
+    return slot->id;
+}
+
+#endif
@@ -0,0 +1,186 @@
+#include "binaryplist.h"
+
+
+/*
+ * iterencode(obj, chunk_size=65536, ...): the plist as an iterator of
+ * byte strings, so a response can start going out before the whole
+ * output exists. The object is traversed and sized when the iterator is
+ * created, the ref and offset widths depend on the total, and errors are
+ * raised there. Each next() then writes on through one chunk_size window
+ * with encoder_write_step until a chunk is ready; the output is never
+ * held in full, large strings, data and containers are written a slice
+ * at a time. Chunks are chunk_size bytes except the last.
+ *
+ */
+
+typedef struct {
+    PyObject_HEAD
+    binaryplist_encoder encoder;
+    binaryplist_step step;
+    uint8_t *chunk;
+    /* Chunks flushed by the last step, handed out from next onwards */
+    PyObject *pending;
+    Py_ssize_t next;
+    int ready;
+} binaryplist_iterencoder;
+
+/* The encoder's flush, queues each full chunk */
+static int queue_chunk(void *sink, const uint8_t *data, size_t len)
+{
+    binaryplist_iterencoder *self = sink;
+    PyObject *chunk = PyString_FromStringAndSize((const char *)data, len);
+    int status = chunk ? PyList_Append(self->pending, chunk) : -1;
+
+    Py_XDECREF(chunk);
+    return status == 0 ? BINARYPLIST_OK : BINARYPLIST_ERROR;
+}
+
+static void iterencoder_dealloc(binaryplist_iterencoder *self)
+{
+    encoder_free(&self->encoder);
+    Py_XDECREF(self->encoder.object_hook);
+    Py_XDECREF(self->encoder.convert_nulls);
+    Py_XDECREF(self->pending);
+    free(self->chunk);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int iterencoder_tp_init(binaryplist_iterencoder *self, PyObject *args,
+    PyObject *kwargs)
+{
+    static char *kwlist[] = {"obj", "chunk_size", "unique", "convert_nulls",
+                             "max_recursion", "object_hook", "as_ascii", NULL};
+    binaryplist_encoder *encoder = &self->encoder;
+    PyObject *oinput = NULL;
+    PyObject *ounique = NULL;
+    PyObject *orecursion = NULL;
+    PyObject *oascii = NULL;
+    Py_ssize_t chunk_size = DEFAULT_CHUNK_SIZE;
+    long root;
+
+    if (self->ready || self->pending) {
+        PyErr_SetString(PLIST_Error, "iterencode is already initialized");
+        return -1;
+    }
+    encoder->convert_nulls = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|nOOOOO", kwlist, &oinput, &chunk_size,
+        &ounique, &(encoder->convert_nulls), &orecursion, &(encoder->object_hook), &oascii)) {
+        encoder->convert_nulls = NULL;
+        encoder->object_hook = NULL;
+        return -1;
+    }
+    Py_INCREF(encoder->convert_nulls);
+    Py_XINCREF(encoder->object_hook);
+    if (chunk_size < 16) {
+        PyErr_SetString(PLIST_Error, "chunk_size is too small");
+        return -1;
+    }
+    if (!(self->pending = PyList_New(0))) {
+        return -1;
+    }
+    if (!(self->chunk = malloc(chunk_size))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (encoder_setup(encoder, ounique, NULL, orecursion) != BINARYPLIST_OK
+        || encoder_encode_object(encoder, oinput, &root) != BINARYPLIST_OK
+        || encoder_size(encoder) < 0) {
+        return -1;
+    }
+    bplist_output_init(&encoder->out, self->chunk, chunk_size, NULL, NULL);
+    encoder->flush = queue_chunk;
+    encoder->sink = self;
+    self->ready = 1;
+    return 0;
+}
+
+static PyObject *iterencoder_next(binaryplist_iterencoder *self)
+{
+    PyObject *chunk;
+
+    if (!self->ready) {
+        PyErr_SetString(PLIST_Error, "iterencode is not initialized");
+        return NULL;
+    }
+    while (self->next == PyList_GET_SIZE(self->pending)) {
+        if (self->next && PyList_SetSlice(self->pending, 0, self->next, NULL) < 0) {
+            return NULL;
+        }
+        self->next = 0;
+        if (self->step.phase == STEP_DONE) {
+            /* StopIteration */
+            return NULL;
+        }
+        if (encoder_write_step(&self->encoder, &self->step) != BINARYPLIST_OK) {
+            self->step.phase = STEP_DONE;
+            encoder_set_error(&self->encoder);
+            return NULL;
+        }
+    }
+    chunk = PyList_GET_ITEM(self->pending, self->next++);
+    Py_INCREF(chunk);
+    return chunk;
+}
+
+static PyObject *iterencoder_get_queued(binaryplist_iterencoder *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->pending ? PyList_GET_SIZE(self->pending) - self->next : 0);
+}
+
+static PyGetSetDef iterencoder_getset[] =
+{
+    {"queued", (getter)iterencoder_get_queued, NULL,
+     "Chunks already written and not yet returned by next().", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject binaryplist_iterencoder_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libbinaryplist.iterencode",                /* tp_name */
+    sizeof(binaryplist_iterencoder),            /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)iterencoder_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Binary plist of an object as an iterator of chunk_size strings.", /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)iterencoder_next,             /* tp_iternext */
+    0,                                          /* tp_methods */
+    0,                                          /* tp_members */
+    iterencoder_getset,                         /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)iterencoder_tp_init,              /* tp_init */
+    0,                                          /* tp_alloc */
+    PyType_GenericNew,                          /* tp_new */
+};
+
+int iterencode_init(PyObject *module)
+{
+    if (PyType_Ready(&binaryplist_iterencoder_type) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    Py_INCREF(&binaryplist_iterencoder_type);
+    PyModule_AddObject(module, "iterencode", (PyObject *)&binaryplist_iterencoder_type);
+    return BINARYPLIST_OK;
+}
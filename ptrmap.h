@@ -0,0 +1,147 @@
+/*
+ * Open addressing hash map keyed on pointers with the value stored
+ * inline. Lookups never allocate; the table doubles at 50% load.
+ *
+ */
+#ifndef PTRMAP_H
+#define PTRMAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PTRMAP_MIN_SIZE 64
+
+typedef struct {
+    const void *key;
+    long value;
+} ptrmap_slot;
+
+typedef struct {
+    ptrmap_slot *slots;
+    size_t mask;
+    size_t count;
+} ptrmap;
+
+static inline size_t ptrmap_hash(const void *key)
+{
+    /* objects are at least 8 byte aligned, drop the dead bits first */
+    uint64_t h = (uint64_t)(uintptr_t)key >> 3;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+static inline int ptrmap_init(ptrmap *map, size_t size)
+{
+    size_t n = PTRMAP_MIN_SIZE;
+
+    while (n < size * 2) {
+        n <<= 1;
+    }
+    map->slots = (ptrmap_slot *)calloc(n, sizeof(ptrmap_slot));
+    map->mask = n - 1;
+    map->count = 0;
+    return map->slots ? 0 : -1;
+}
+
+static inline void ptrmap_free(ptrmap *map)
+{
+    free(map->slots);
+    map->slots = NULL;
+    map->mask = 0;
+    map->count = 0;
+}
+
+static inline void ptrmap_clear(ptrmap *map)
+{
+    if (map->count) {
+        memset(map->slots, 0, (map->mask + 1) * sizeof(ptrmap_slot));
+        map->count = 0;
+    }
+}
+
+static inline ptrmap_slot *ptrmap_find(const ptrmap *map, const void *key)
+{
+    size_t i = ptrmap_hash(key) & map->mask;
+
+    while (map->slots[i].key && map->slots[i].key != key) {
+        i = (i + 1) & map->mask;
+    }
+    return &map->slots[i];
+}
+
+/* Returns 1 and fills value if key is present, 0 otherwise. */
+static inline int ptrmap_get(const ptrmap *map, const void *key, long *value)
+{
+    ptrmap_slot *slot = ptrmap_find(map, key);
+
+    if (!slot->key) {
+        return 0;
+    }
+    *value = slot->value;
+    return 1;
+}
+
+static inline int ptrmap_grow(ptrmap *map)
+{
+    ptrmap grown;
+    size_t i;
+
+    if (ptrmap_init(&grown, map->mask + 1) != 0) {
+        return -1;
+    }
+    for (i = 0; i <= map->mask; i++) {
+        if (map->slots[i].key) {
+            *ptrmap_find(&grown, map->slots[i].key) = map->slots[i];
+        }
+    }
+    grown.count = map->count;
+    free(map->slots);
+    *map = grown;
+    return 0;
+}
+
+/* Insert or overwrite. Returns -1 on allocation failure. */
+static inline int ptrmap_set(ptrmap *map, const void *key, long value)
+{
+    ptrmap_slot *slot;
+
+    if ((map->count + 1) * 2 > map->mask + 1 && ptrmap_grow(map) != 0) {
+        return -1;
+    }
+    slot = ptrmap_find(map, key);
+    if (!slot->key) {
+        slot->key = key;
+        map->count++;
+    }
+    slot->value = value;
+    return 0;
+}
+
+/* Remove key if present, the rest of its probe run moves back into the hole */
+static inline void ptrmap_del(ptrmap *map, const void *key)
+{
+    ptrmap_slot *slot = ptrmap_find(map, key);
+    size_t hole, i, home;
+
+    if (!slot->key) {
+        return;
+    }
+    hole = i = (size_t)(slot - map->slots);
+    for (;;) {
+        i = (i + 1) & map->mask;
+        if (!map->slots[i].key) {
+            break;
+        }
+        /* a key may fill the hole unless its home is between the two */
+        home = ptrmap_hash(map->slots[i].key) & map->mask;
+        if (hole < i ? (home <= hole || home > i) : (home <= hole && home > i)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].key = NULL;
+    map->count--;
+}
+
+#endif
@@ -1,7 +1,7 @@
 from distutils.core import setup, Extension
  
 module1 = Extension('libbinaryplist',
-                    sources = ['binaryplist.c', 'encoder.c'],
+                    sources = ['binaryplist.c', 'encoder.c', 'decoder.c', 'view.c', 'unicode.c', 'encoderobject.c', 'update.c', 'types.c', 'transcode.c', 'bplist_core.c', 'cache.c', 'validate.c', 'iterencode.c'],
                     include_dirs = ['.'])
  
 setup (name = 'binaryplist',
@@ -2,6 +2,7 @@ import binaryplist as plist
 import datetime
 import time
 import bson
+import struct
 
 class CustomObj:
     def __init__(self):
@@ -42,3 +43,482 @@ bplist = plist.encode(o, debug=True, unique=True, convert_nulls=True, object_hoo
 f = open('/tmp/ass.plist', 'w+')
 f.write(bplist)
 f.close()
+
+decoded = plist.decode(bplist)
+assert decoded["uid"] == 13 and isinstance(decoded["uid"], plist.Uid)
+assert decoded["data"] == o["data"] and isinstance(decoded["data"], plist.Data)
+assert decoded["uni"] == o["uni"] and decoded["tuple"] == ['a', 'b', ['a', 'b']]
+
+# lazy views decode the same values as decode, with or without a file
+view = plist.load_view(bplist)
+assert view["uni"] == o["uni"] and view["list"][1:] == [1, 2] and len(view) == len(o)
+assert "uid" in view and isinstance(view["uid"], plist.Uid)
+assert list(view["tuple"][2]) == ['a', 'b']
+view = plist.open('/tmp/ass.plist')
+assert sorted(view.keys()) == sorted(o.keys()) and view["hashtest"][2] == 1453079729203098304
+
+# sizes are computed exactly: values on every length and width boundary
+# round trip and the trailer accounts for every byte
+edges = [0, 14, 15, 255, 256, 65535, 65536]
+sized = {"ints": [-1, 0, 255, 256, 65535, 65536, 2**32 - 1, 2**32, 2**63 - 1, 2**64 - 1],
+         "strings": ['x' * n for n in edges], "unicode": [u'\xe9' * n for n in edges],
+         "lists": [range(n) for n in edges[:5]]}
+data = plist.encode(sized)
+offset_sz, ref_sz, nobjects, root, table = struct.unpack('>6xBBQQQ', data[-32:])
+assert len(data) == table + offset_sz * nobjects + 32
+assert plist.decode(data) == sized
+
+# encode_to streams the same bytes to a file object or descriptor
+import StringIO
+import tempfile
+
+out = StringIO.StringIO()
+assert plist.encode_to(sized, out, chunk_size=16) == len(data) and out.getvalue() == data
+with tempfile.TemporaryFile() as f:
+    assert plist.encode_to(sized, f.fileno(), chunk_size=100) == len(data)
+    f.seek(0)
+    assert f.read() == data
+for chunk_size, target in ((15, out), (64, object())):
+    try:
+        plist.encode_to(sized, target, chunk_size=chunk_size)
+        assert False, "encode_to accepted chunk_size %d to %r" % (chunk_size, target)
+    except plist.Error:
+        pass
+
+# encode_many matches encode per object on any number of threads
+batch = [sized, o["list"], u'\xe9', {"nested": [sized, sized]}]
+encoded = [plist.encode(x, unique=True) for x in batch]
+for threads in (1, 3, 8):
+    assert plist.encode_many(batch, threads=threads, unique=True) == encoded
+assert plist.encode_many([]) == []
+try:
+    plist.encode_many([sized, CustomObj()], threads=2)
+    assert False, "encode_many encoded an unsupported type"
+except plist.Error:
+    pass
+
+# numeric lists and buffers take the bulk path and encode like plain lists
+import array
+import ctypes
+
+for typecode, values in (('d', [1.5, -2.0, 1e300]), ('f', [0.5, 2.0]), ('b', [1, -2]),
+                         ('l', [1, -2, 2**40]), ('H', [0, 65535])):
+    assert plist.encode(array.array(typecode, values)) == plist.encode(values)
+    assert plist.decode(plist.encode(array.array(typecode, values))) == values
+assert plist.encode((ctypes.c_int * 3)(1, -2, 3)) == plist.encode([1, -2, 3])
+mixed = [1, 2.5, True, False, 'a', 2**64 - 1, -1, None]
+assert plist.decode(plist.encode(mixed, convert_nulls=True)) == mixed[:-1] + ['']
+
+# an Encoder reused across calls, errors and shrink matches encode
+encoder = plist.Encoder(unique=True, convert_nulls=True, object_hook=hook)
+for x in (o, sized, o, mixed, u'\xe9'):
+    assert encoder.encode(x) == plist.encode(x, unique=True, convert_nulls=True, object_hook=hook)
+loop = []
+loop.append(loop)
+try:
+    encoder.encode({"loop": loop})
+    assert False, "Encoder encoded a cycle"
+except plist.Error:
+    pass
+assert encoder.encode(o) == plist.encode(o, unique=True, convert_nulls=True, object_hook=hook)
+encoder.shrink()
+assert encoder.encode(sized) == plist.encode(sized, unique=True)
+reentrant = plist.Encoder(object_hook=lambda x: reentrant.encode([]))
+try:
+    reentrant.encode([CustomObj()])
+    assert False, "Encoder encoded from inside its own hook"
+except plist.Error:
+    pass
+
+# stats and tracing describe the encode without changing its output
+stats = {}
+assert plist.encode(sized, stats=stats) == data
+assert stats["size"] == len(data) and stats["nobjects"] == nobjects
+assert stats["ref_size"] == ref_sz and stats["offset_size"] == offset_sz
+assert sum(stats["objects"].values()) == nobjects and sum(stats["bytes"].values()) == table - 9
+encoder = plist.Encoder(stats=True, trace=1024)
+assert encoder.encode(sized) == data and encoder.stats["size"] == len(data)
+events = [(event, arg) for ns, event, kind, id, arg, depth in plist.read_trace(encoder.trace())]
+assert ('begin', 'traverse') in events and ('end', 'write') in events
+assert plist.Encoder().stats is None
+
+# unique="deep" merges equal containers but never ones that differ in type
+nested = {"k": [1, 2, {"x": "y"}]}
+merged = [nested, dict(nested), [1, 2, {"x": "y"}], (1, 2, {"x": "y"})]
+counts = []
+for unique in (False, True, "deep"):
+    deep_plist = plist.encode(merged, unique=unique)
+    assert plist.decode(deep_plist) == [nested, nested, nested["k"], nested["k"]]
+    counts.append(struct.unpack('>Q', deep_plist[-24:-16])[0])
+assert counts[0] > counts[1] > counts[2]
+assert plist.encode(merged, unique=u"deep") == plist.encode(merged, unique="deep")
+for unique in ("Deep", u"scalars", ""):
+    try:
+        plist.encode(merged, unique=unique)
+        assert False, "encode accepted unique=%r" % unique
+    except plist.Error:
+        pass
+typed = plist.decode(plist.encode([{"a": 1}, {"a": 1.0}, {"a": True}, [1], [True]], unique="deep"))
+assert [type(x.values()[0]) for x in typed[:3]] == [int, float, bool]
+assert type(typed[3][0]) is int and type(typed[4][0]) is bool
+
+# interned scalars merge only when type and bits agree
+import math
+
+scalars = [1, 1.0, True, 1L, 0, 0.0, -0.0, False, 'a', plist.Data('a'), plist.Uid(1)]
+interned = plist.encode(scalars * 2, unique=True)
+decoded = plist.decode(interned)
+assert decoded == scalars * 2 and math.copysign(1, decoded[6]) == -1
+assert [type(x) for x in decoded[:11]] == [int, float, bool, int, int, float, float, bool, str,
+                                           plist.Data, plist.Uid]
+plain = plist.encode(scalars * 2, unique=False)
+assert struct.unpack('>Q', interned[-24:-16]) < struct.unpack('>Q', plain[-24:-16])
+
+# update appends to a dict plist, rewrites it when refs outgrow their width
+import os
+
+fd, path = tempfile.mkstemp(suffix='.plist')
+os.close(fd)
+with open(path, 'wb') as f:
+    f.write(plist.encode({"a": 1, "b": [1, 2]}))
+size = os.path.getsize(path)
+assert plist.update(path, {"c": u'\xe9'}, delete=["a"]) == os.path.getsize(path) - size
+assert plist.update(path, {"b": "replaced"}) > 0
+with open(path, 'rb') as f:
+    assert plist.decode(f.read()) == {"b": "replaced", "c": u'\xe9'}
+size = os.path.getsize(path)
+assert plist.compact(path) == os.path.getsize(path) < size
+with open(path, 'rb') as f:
+    assert plist.decode(f.read()) == {"b": "replaced", "c": u'\xe9'}
+# 300 more objects do not fit one byte refs, so update falls back to a rewrite
+with open(path, 'rb') as f:
+    assert plist.encode_update(f.read(), {"d": range(1000, 1300)}) is None
+assert plist.update(path, {"d": range(1000, 1300)}) == os.path.getsize(path)
+with open(path, 'rb') as f:
+    assert plist.decode(f.read()) == {"b": "replaced", "c": u'\xe9', "d": range(1000, 1300)}
+with open(path, 'wb') as f:
+    f.write(plist.encode([1]))
+try:
+    plist.update(path, {"a": 1})
+    assert False, "update changed a plist whose root is not a dict"
+except plist.Error:
+    pass
+os.remove(path)
+
+# past 65536 objects refs and offsets widen to 4 bytes and still round trip
+wide = range(70000)
+wide_plist = plist.encode(wide)
+offset_sz, ref_sz, count = struct.unpack('>6xBBQ', wide_plist[-32:-16])
+assert (offset_sz, ref_sz, count) == (4, 4, 70001) and plist.decode(wide_plist) == wide
+assert plist.decode(plist.encode([2**63 - 1, -2**63, 2**64 - 1])) == [2**63 - 1, -2**63, 2**64 - 1]
+
+# registered converters win over object_hook, for subclasses too, until removed
+class Point(object):
+    def __init__(self, x, y):
+        self.x, self.y = x, y
+
+class Point3(Point):
+    pass
+
+plist.register_type(Point, lambda p: [p.x, p.y])
+points = [Point(1, 2), Point3(3, 4), Point(1, 2)]
+assert plist.decode(plist.encode(points, object_hook=lambda p: "hooked")) == [[1, 2], [3, 4], [1, 2]]
+assert plist.encode(points, unique=True) == plist.encode([[1, 2], [3, 4], [1, 2]], unique=True)
+plist.register_type(Point, None)
+assert plist.decode(plist.encode(points, object_hook=lambda p: "hooked")) == ["hooked"] * 3
+for cls, converter, error in ((dict, len, plist.Error), (Point, 3, TypeError)):
+    try:
+        plist.register_type(cls, converter)
+        assert False, "register_type accepted %r" % cls
+    except error:
+        pass
+
+# transcode writes the text forms of decode's values in any chunk size
+import json
+import plistlib
+
+text = {"a": [1, 2.5, True, False], "s": u'\xe9<&>', "n": {"deep": [[]]},
+        "t": datetime.datetime(2020, 1, 2, 3, 4, 5)}
+text_plist = plist.encode(dict(text, d=plist.Data('\x00\x01'), u=plist.Uid(3)))
+xml = plist.transcode(text_plist)
+assert plistlib.readPlistFromString(xml) == dict(text, d=plistlib.Data('\x00\x01'), u={"CF$UID": 3})
+as_json = json.loads(plist.transcode(text_plist, 'json'))
+assert as_json == dict(text, t="2020-01-02T03:04:05Z", d="AAE=", u={"CF$UID": 3})
+for format in ('xml', 'json'):
+    assert plist.transcode(text_plist, format, chunk_size=16) == plist.transcode(text_plist, format)
+fd, path = tempfile.mkstemp(suffix='.plist')
+os.write(fd, text_plist)
+os.close(fd)
+out = StringIO.StringIO()
+assert plist.convert(path, out, 'json') == len(out.getvalue())
+assert json.loads(out.getvalue()) == as_json
+os.remove(path)
+for format, chunk_size in (('yaml', 64), ('xml', 15)):
+    try:
+        plist.transcode(text_plist, format, chunk_size=chunk_size)
+        assert False, "transcode accepted %s in chunks of %d" % (format, chunk_size)
+    except plist.Error:
+        pass
+
+# cached Frozen values are copied in from the second call, constant tuples
+# only from the third as the first call may be their only one
+frozen = plist.Frozen({"limits": [1, 2, 3], "names": ('a', u'\xe9')})
+constant = (1, 2.5, (3, 'x'))
+encoder = plist.Encoder(cache=4, stats=True, unique=True)
+for i in range(3):
+    cached = encoder.encode({"config": frozen, "t": constant, "i": i})
+    assert plist.decode(cached) == plist.decode(plist.encode({"config": frozen.value, "t": constant, "i": i}))
+    assert encoder.stats["cache_hits"] == i
+encoder.shrink()
+encoder.encode({"config": frozen})
+assert encoder.stats["cache_hits"] == 0
+assert plist.encode(frozen) == plist.encode(frozen.value)
+try:
+    plist.Encoder(cache=-1)
+    assert False, "Encoder accepted a negative cache"
+except plist.Error:
+    pass
+
+# a full cache drops the least recently used block, not everything
+warm = [plist.Frozen([n, str(n)]) for n in range(4)]
+encoder = plist.Encoder(cache=2, stats=True)
+for n, hits in ((0, 0), (1, 0), (0, 1), (2, 0), (0, 1), (1, 0), (2, 0), (1, 1)):
+    assert plist.decode(encoder.encode(warm[n])) == warm[n].value
+    assert encoder.stats["cache_hits"] == hits, (n, hits)
+import random
+
+# and keeps serving the right blocks through a lot of churn
+warm = [plist.Frozen({"n": n, "s": str(n) * 3}) for n in range(64)]
+encoder = plist.Encoder(cache=8)
+for n in [random.randrange(len(warm)) for i in range(2000)]:
+    assert plist.decode(encoder.encode([warm[n], warm[n - 1]])) == [warm[n].value, warm[n - 1].value]
+
+# tuples holding something mutable are never cached
+changing = (1, (2, [3]))
+encoder = plist.Encoder(cache=4, stats=True)
+for i in range(4):
+    changing[1][1].append(i)
+    assert plist.decode(encoder.encode([changing, changing])) == [[1, [2, changing[1][1]]]] * 2
+    assert encoder.stats["cache_hits"] == 0
+
+# a large write split across threads is byte for byte the single thread one
+large = [[i, u'\xe9%d' % i * 20, 'x' * (i % 300), i * 0.5] for i in range(40000)]
+stats = {}
+threaded = plist.encode(large, threads=4, stats=stats)
+assert stats["write_threads"] > 1 and threaded == plist.encode(large)
+assert plist.decode(threaded) == large
+
+# dates are seconds from 2001-01-01 UTC: naive values are UTC, aware ones
+# subtract utcoffset(), microseconds are kept and plain dates are midnight
+class FixedOffset(datetime.tzinfo):
+    def __init__(self, hours):
+        self.offset = datetime.timedelta(hours=hours)
+    def utcoffset(self, dt):
+        return self.offset
+    def dst(self, dt):
+        return datetime.timedelta(0)
+
+dates = [
+    (datetime.datetime(2001, 1, 1), 0.0, datetime.datetime(2001, 1, 1)),
+    (datetime.datetime(2001, 1, 1, 0, 0, 0, 500000), 0.5,
+     datetime.datetime(2001, 1, 1, 0, 0, 0, 500000)),
+    (datetime.datetime(2001, 1, 1, 2, tzinfo=FixedOffset(2)), 0.0, datetime.datetime(2001, 1, 1)),
+    (datetime.datetime(2000, 12, 31, 19, 0, 0, 250000, tzinfo=FixedOffset(-5)), 0.25,
+     datetime.datetime(2001, 1, 1, 0, 0, 0, 250000)),
+    (datetime.datetime(1970, 1, 1), -978307200.0, datetime.datetime(1970, 1, 1)),
+    (datetime.datetime(1969, 12, 31, 23, 59, 59, 999999), -978307200.000001,
+     datetime.datetime(1969, 12, 31, 23, 59, 59, 999999)),
+    (datetime.datetime(1900, 3, 1, 12), -3182155200.0, datetime.datetime(1900, 3, 1, 12)),
+    (datetime.date(2001, 1, 2), 86400.0, datetime.datetime(2001, 1, 2)),
+    (datetime.date(1999, 12, 31), -367 * 86400.0, datetime.datetime(1999, 12, 31)),
+]
+for value, seconds, back in dates:
+    dated = plist.encode(value)
+    assert dated[9] == '\x33' and struct.unpack('>d', dated[10:18])[0] == seconds, value
+    assert plist.decode(dated) == back, value
+
+# hand built single object plists for the malformed input paths
+
+def raw_plist(obj):
+    table = 8 + len(obj)
+    return 'bplist00' + obj + chr(8) + '\0' * 6 + struct.pack('>BBQQQ', 1, 1, 1, 0, table)
+
+assert plist.decode(raw_plist('\x87' + struct.pack('>Q', 2**63 - 1))) == 2**63 - 1
+try:
+    plist.decode(raw_plist('\x87' + struct.pack('>Q', 2**63)))
+    assert False, "uid past LONG_MAX decoded"
+except plist.Error:
+    pass
+assert plist.validate(raw_plist('\x87' + struct.pack('>Q', 2**63 - 1))) is None
+try:
+    plist.validate(raw_plist('\x87' + struct.pack('>Q', 2**63)))
+    assert False, "uid past LONG_MAX validated"
+except plist.Error:
+    pass
+
+# what validate accepts decodes, however deep, on a small thread stack
+import threading
+
+deep = []
+for i in range(16000):
+    deep = [deep]
+bplist = plist.encode(deep, max_recursion=20000)
+assert plist.validate(bplist) is None
+decoded = []
+threading.stack_size(256 * 1024)
+view = plist.libbinaryplist.View(bplist)
+for decode in (plist.decode, lambda data: view.value(view.root)):
+    t = threading.Thread(target=lambda: decoded.append(decode(bplist)))
+    t.start()
+    t.join()
+threading.stack_size(0)
+for d in decoded:
+    for i in range(16000):
+        d = d[0]
+    assert d == []
+try:
+    plist.decode(bplist, max_recursion=100)
+    assert False, "max_recursion ignored"
+except plist.Error:
+    pass
+
+
+# validate rejects loops, expansion bombs and truncation, and anything
+# it accepts decodes
+import random
+
+for loop in (raw_plist('\xa1\x00'), raw_plist('\xd1\x00\x00')):
+    for check in (plist.validate, plist.decode):
+        try:
+            check(loop)
+            assert False, "%s accepted a self reference" % check.__name__
+        except plist.Error:
+            pass
+bomb = ['leaf']
+for i in range(16):
+    bomb = [bomb, bomb]
+bomb = plist.encode(bomb, unique="deep")
+assert plist.validate(bomb) is None
+try:
+    plist.validate(bomb, max_expansion=1000)
+    assert False, "validate ignored max_expansion"
+except plist.Error:
+    pass
+assert plist.validate(raw_plist('\xa0'), max_expansion=0) is None
+try:
+    plist.validate(bomb, max_expansion=0)
+    assert False, "max_expansion=0 turned the expansion check off"
+except plist.Error:
+    pass
+valid = plist.encode({"a": [1, 2, u'\xe9', {"b": "c"}], "d": 2.5, "e": plist.Uid(7)})
+for n in range(len(valid)):
+    try:
+        plist.validate(valid[:n])
+        assert False, "validate accepted a plist truncated to %d bytes" % n
+    except plist.Error:
+        pass
+random.seed(7)
+for i in range(2000):
+    mutant = bytearray(valid)
+    for j in range(random.randint(1, 3)):
+        mutant[random.randrange(len(mutant))] = random.randrange(256)
+    try:
+        plist.validate(str(mutant))
+    except plist.Error:
+        continue
+    plist.decode(str(mutant))
+
+# byte buffers are written as data, streamed or not
+payload = ''.join(chr(i % 256) for i in range(70000))
+as_data = plist.encode([plist.Data(payload), plist.Data('ab')])
+for wrap in (bytearray, memoryview, buffer, lambda s: array.array('B', s)):
+    assert plist.encode([wrap(payload), wrap('ab')]) == as_data
+decoded = plist.decode(plist.encode({"blob": bytearray(payload)}))["blob"]
+assert decoded == payload and isinstance(decoded, plist.Data)
+for chunk_size in (16, 1000, 1 << 20):
+    with tempfile.TemporaryFile() as f:
+        written = plist.encode_to([bytearray(payload), bytearray('ab')], f.fileno(),
+                                  chunk_size=chunk_size)
+        assert written == len(as_data)
+        f.seek(0)
+        assert f.read() == as_data
+
+# iterencode yields encode's bytes in chunk_size pieces
+streamed = {"blob": bytearray(payload), "text": u'\xe9' * 40000, "list": range(3000)}
+whole = plist.encode(streamed)
+for chunk_size in (16, 4096, 1 << 20):
+    chunks = list(plist.iterencode(streamed, chunk_size=chunk_size))
+    assert ''.join(chunks) == whole
+    assert all(len(c) == chunk_size for c in chunks[:-1]) and 0 < len(chunks[-1]) <= chunk_size
+try:
+    plist.iterencode(streamed, chunk_size=15)
+    assert False, "iterencode accepted a chunk_size below 16"
+except plist.Error:
+    pass
+cycle = []
+cycle.append(cycle)
+try:
+    plist.iterencode([cycle])
+    assert False, "iterencode accepted a cycle"
+except plist.Error:
+    pass
+
+# buffers that cannot be locked are copied when reached, so a hook that
+# grows or closes them later does not change what is written
+import mmap
+
+grown = array.array('B', 'abc')
+mapped = mmap.mmap(-1, 4)
+mapped.write('wxyz')
+
+class Mutator(object):
+    pass
+
+def mutate(value):
+    grown.extend(array.array('B', 'x' * 100000))
+    mapped.close()
+    return "mutated"
+
+mutated = plist.decode(plist.encode([grown, mapped, Mutator()], object_hook=mutate))
+assert mutated == ['abc', 'wxyz', "mutated"] and isinstance(mutated[0], plist.Data)
+held = bytearray('abc')
+try:
+    plist.encode([held, Mutator()], object_hook=lambda value: held.extend('x' * 100000))
+    assert False, "a held bytearray was resized during the encode"
+except BufferError:
+    pass
+assert held == 'abc'
+
+# each next() writes one chunk, however large the string, data or
+# container being written; only the 32 byte trailer spans several
+for sliced in (u'\xe9' * 40000, u'a' * 80000, range(300, 30300),
+               dict.fromkeys(range(300, 20300)), bytearray(80000)):
+    chunks = plist.iterencode(sliced, chunk_size=16)
+    streamed, queued = [], []
+    for chunk in chunks:
+        streamed.append(chunk)
+        queued.append(chunks.queued)
+    assert max(queued[:-4]) == 0 and max(queued) <= 3
+    assert ''.join(streamed) == plist.encode(sliced)
+
+# transcode counts the refs it writes against max_expansion as validate
+# does, with the same default
+wide = ['leaf']
+for i in range(22):
+    wide = [wide, wide]
+wide = plist.encode(wide, unique="deep")
+for format in ('xml', 'json'):
+    for args in ((wide, format), (bomb, format, None, 16, 1024, 1000)):
+        try:
+            plist.transcode(*args)
+            assert False, "transcode expanded a bomb to %s" % format
+        except plist.Error:
+            pass
+    assert plist.transcode(bomb, format, chunk_size=16) == plist.transcode(bomb, format)
+for check in (plist.validate, lambda data, **kw: plist.transcode(data, 'json', **kw)):
+    check(text_plist, max_expansion=19)
+    try:
+        check(text_plist, max_expansion=18)
+        assert False, "max_expansion let 19 refs through a limit of 18"
+    except plist.Error:
+        pass
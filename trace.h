@@ -0,0 +1,157 @@
+/*
+ * Opt-in encoder instrumentation. Stats are plain counters filled in as
+ * the encoder runs; the trace is a fixed size ring of compact binary
+ * records that can be dumped after a slow encode. Both are reached
+ * through pointers that stay NULL unless asked for, so the cost when off
+ * is one branch.
+ *
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Object classes counted by the stats */
+enum
+{
+    STAT_NULL,
+    STAT_BOOL,
+    STAT_INT,
+    STAT_REAL,
+    STAT_DATE,
+    STAT_DATA,
+    STAT_ASCII,
+    STAT_UNICODE,
+    STAT_UID,
+    STAT_ARRAY,
+    STAT_DICT,
+    STAT_NATIVE,
+    STAT_KINDS
+};
+
+typedef struct {
+    /* Wall time of each phase */
+    uint64_t traverse_ns;
+    uint64_t size_ns;
+    uint64_t write_ns;
+    /* Objects written and their encoded bytes, by class */
+    Py_ssize_t objects[STAT_KINDS];
+    Py_ssize_t bytes[STAT_KINDS];
+    /* Layout chosen by encoder_size */
+    Py_ssize_t nobjects;
+    Py_ssize_t size;
+    int ref_size;
+    int offset_size;
+    /* Objects that pointed at an earlier equal object instead */
+    Py_ssize_t dedup_hits;
+    /* Subtrees copied in from the Encoder's cache */
+    Py_ssize_t cache_hits;
+    /* Output windows handed to the writer, their peak size, and flushes */
+    Py_ssize_t buffer_allocs;
+    Py_ssize_t peak_buffer;
+    Py_ssize_t flushes;
+    /* Threads the objects were written with */
+    int write_threads;
+} binaryplist_stats;
+
+/* Trace events, record layout is documented in binaryplist/__init__.py */
+enum
+{
+    TRACE_BEGIN = 1,
+    TRACE_END,
+    TRACE_OBJECT,
+    TRACE_UNIQUE,
+    TRACE_PUSH,
+    TRACE_POP,
+    TRACE_FLUSH,
+    TRACE_CACHE
+};
+
+/* Phases, the arg of TRACE_BEGIN and TRACE_END */
+enum
+{
+    TRACE_TRAVERSE = 1,
+    TRACE_SIZE,
+    TRACE_WRITE
+};
+
+typedef struct {
+    uint64_t ns;
+    uint32_t id;
+    uint32_t arg;
+    uint8_t event;
+    uint8_t kind;
+    uint16_t depth;
+    uint32_t pad;
+} binaryplist_trace_record;
+
+typedef struct {
+    binaryplist_trace_record *records;
+    uint32_t size;
+    uint32_t next;
+    /* Events recorded since the last reset, may exceed size */
+    uint64_t total;
+} binaryplist_trace;
+
+static inline uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int trace_init(binaryplist_trace *trace, uint32_t size)
+{
+    trace->records = (binaryplist_trace_record *)calloc(size, sizeof(binaryplist_trace_record));
+    trace->size = size;
+    trace->next = 0;
+    trace->total = 0;
+    return trace->records ? 0 : -1;
+}
+
+static inline void trace_free(binaryplist_trace *trace)
+{
+    free(trace->records);
+    trace->records = NULL;
+    trace->size = trace->next = 0;
+    trace->total = 0;
+}
+
+static inline void trace_reset(binaryplist_trace *trace)
+{
+    trace->next = 0;
+    trace->total = 0;
+}
+
+static inline void trace_event(binaryplist_trace *trace, uint8_t event, uint8_t kind,
+    long id, long arg, int depth)
+{
+    binaryplist_trace_record *r = &trace->records[trace->next];
+
+    r->ns = trace_now();
+    r->id = (uint32_t)id;
+    r->arg = (uint32_t)arg;
+    r->event = event;
+    r->kind = kind;
+    r->depth = (uint16_t)(depth > 0xFFFF ? 0xFFFF : depth);
+    r->pad = 0;
+    trace->next = (trace->next + 1 == trace->size) ? 0 : trace->next + 1;
+    trace->total++;
+}
+
+/* Number of records held, oldest first starting at trace_first */
+static inline uint32_t trace_count(const binaryplist_trace *trace)
+{
+    return trace->total < trace->size ? (uint32_t)trace->total : trace->size;
+}
+
+static inline uint32_t trace_first(const binaryplist_trace *trace)
+{
+    return trace->total < trace->size ? 0 : trace->next;
+}
+
+#endif
@@ -0,0 +1,643 @@
+#include "binaryplist.h"
+
+
+/*
+ * Binary plist to XML plist or JSON text without going through python
+ * objects. Objects are read in place through the offset table and the
+ * text is written through one fixed size chunk, so memory use does not
+ * grow with the input. An object referenced from several containers is
+ * written out everywhere it appears, so the refs written are counted
+ * against max_expansion the way validate() counts them.
+ *
+ * XML has no null, it is written as an empty string like convert_nulls
+ * does, and control characters XML 1.0 cannot hold become U+FFFD. JSON
+ * has no dates, data or uids: dates become ISO 8601 strings, data base64
+ * strings and uids {"CF$UID": n}. Non-finite reals are null.
+ *
+ */
+
+enum
+{
+    FORMAT_XML,
+    FORMAT_JSON
+};
+
+/* One container being written */
+typedef struct transcode_frame {
+    uint64_t ref;
+    /* Position of its refs, entry count and next entry to write */
+    uint64_t pos;
+    uint64_t count;
+    uint64_t next;
+    uint8_t kind;
+} transcode_frame;
+
+typedef struct binaryplist_transcoder {
+    binaryplist_decoder decoder;
+    int format;
+    /* Output window, passed to its flush whenever it fills up */
+    bplist_output out;
+    transcode_frame *stack;
+    int depth;
+    int stack_cap;
+    /* Refs of the containers opened so far */
+    uint64_t expansion;
+    uint64_t max_expansion;
+} binaryplist_transcoder;
+
+/* Output collected in memory when no file is given */
+typedef struct memory_sink {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} memory_sink;
+
+static int flush_memory(void *sink, const uint8_t *data, size_t len)
+{
+    memory_sink *m = sink;
+    uint8_t *grown;
+    size_t cap = m->cap ? m->cap : 4096;
+
+    while (cap - m->len < len) {
+        cap *= 2;
+    }
+    if (cap != m->cap) {
+        if (!(grown = realloc(m->data, cap))) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
+        }
+        m->data = grown;
+        m->cap = cap;
+    }
+    memcpy(m->data + m->len, data, len);
+    m->len += len;
+    return BINARYPLIST_OK;
+}
+
+static int transcode_error(const char *msg)
+{
+    PyErr_SetString(PLIST_Error, msg);
+    return BINARYPLIST_ERROR;
+}
+
+static inline void out_byte(binaryplist_transcoder *t, uint8_t b)
+{
+    bplist_out_byte(&t->out, b);
+}
+
+static void out_bytes(binaryplist_transcoder *t, const void *bytes, size_t len)
+{
+    bplist_out_bytes(&t->out, bytes, len);
+}
+
+static void out_str(binaryplist_transcoder *t, const char *s)
+{
+    out_bytes(t, s, strlen(s));
+}
+
+static void out_indent(binaryplist_transcoder *t, int depth)
+{
+    while (depth-- > 0) {
+        out_byte(t, '\t');
+    }
+}
+
+/* Escape text for the output format, runs that need none are copied whole */
+static void out_escaped(binaryplist_transcoder *t, const uint8_t *p, size_t len)
+{
+    size_t i, start = 0;
+    const char *rep;
+    char esc[8];
+
+    for (i = 0; i < len; i++) {
+        rep = NULL;
+        if (t->format == FORMAT_XML) {
+            if (p[i] == '&') rep = "&amp;";
+            else if (p[i] == '<') rep = "&lt;";
+            else if (p[i] == '>') rep = "&gt;";
+            else if (p[i] < 0x20 && p[i] != '\t' && p[i] != '\n' && p[i] != '\r') {
+                rep = "\xEF\xBF\xBD";
+            }
+        } else if (p[i] == '"') {
+            rep = "\\\"";
+        } else if (p[i] == '\\') {
+            rep = "\\\\";
+        } else if (p[i] < 0x20) {
+            switch (p[i]) {
+            case '\n': rep = "\\n"; break;
+            case '\r': rep = "\\r"; break;
+            case '\t': rep = "\\t"; break;
+            case '\b': rep = "\\b"; break;
+            case '\f': rep = "\\f"; break;
+            default:
+                snprintf(esc, sizeof(esc), "\\u%04x", p[i]);
+                rep = esc;
+            }
+        }
+        if (rep) {
+            out_bytes(t, p + start, i - start);
+            out_str(t, rep);
+            start = i + 1;
+        }
+    }
+    out_bytes(t, p + start, len - start);
+}
+
+/* UTF-16BE to escaped UTF-8, unpaired surrogates become U+FFFD */
+static void out_utf16(binaryplist_transcoder *t, const uint8_t *p, uint64_t n)
+{
+    uint8_t buf[1024];
+    size_t len = 0;
+    uint64_t i;
+    uint32_t c, lo;
+
+    for (i = 0; i < n; i++) {
+        c = (p[2 * i] << 8) | p[2 * i + 1];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < n) {
+            lo = (p[2 * i + 2] << 8) | p[2 * i + 3];
+            if (lo >= 0xDC00 && lo < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i++;
+            }
+        }
+        if (c >= 0xD800 && c < 0xE000) {
+            c = 0xFFFD;
+        }
+        if (len > sizeof(buf) - 4) {
+            out_escaped(t, buf, len);
+            len = 0;
+        }
+        if (c < 0x80) {
+            buf[len++] = c;
+        } else if (c < 0x800) {
+            buf[len++] = 0xC0 | (c >> 6);
+            buf[len++] = 0x80 | (c & 0x3F);
+        } else if (c < 0x10000) {
+            buf[len++] = 0xE0 | (c >> 12);
+            buf[len++] = 0x80 | ((c >> 6) & 0x3F);
+            buf[len++] = 0x80 | (c & 0x3F);
+        } else {
+            buf[len++] = 0xF0 | (c >> 18);
+            buf[len++] = 0x80 | ((c >> 12) & 0x3F);
+            buf[len++] = 0x80 | ((c >> 6) & 0x3F);
+            buf[len++] = 0x80 | (c & 0x3F);
+        }
+    }
+    out_escaped(t, buf, len);
+}
+
+static void out_base64(binaryplist_transcoder *t, const uint8_t *p, uint64_t n)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char buf[1024];
+    size_t len = 0;
+    uint32_t v;
+
+    for (; n >= 3; p += 3, n -= 3) {
+        if (len > sizeof(buf) - 4) {
+            out_bytes(t, buf, len);
+            len = 0;
+        }
+        v = (p[0] << 16) | (p[1] << 8) | p[2];
+        buf[len++] = table[v >> 18];
+        buf[len++] = table[(v >> 12) & 0x3F];
+        buf[len++] = table[(v >> 6) & 0x3F];
+        buf[len++] = table[v & 0x3F];
+    }
+    if (n) {
+        v = (p[0] << 16) | (n > 1 ? p[1] << 8 : 0);
+        buf[len++] = table[v >> 18];
+        buf[len++] = table[(v >> 12) & 0x3F];
+        buf[len++] = n > 1 ? table[(v >> 6) & 0x3F] : '=';
+        buf[len++] = '=';
+    }
+    out_bytes(t, buf, len);
+}
+
+/* Shortest %g that reads back as the same double */
+static void format_real(int format, double x, char *out, size_t size)
+{
+    int prec;
+
+    if (isnan(x) || isinf(x)) {
+        snprintf(out, size, "%s", format == FORMAT_JSON ? "null"
+            : isnan(x) ? "nan" : x > 0 ? "+infinity" : "-infinity");
+        return;
+    }
+    for (prec = 15; prec <= 17; prec++) {
+        snprintf(out, size, "%.*g", prec, x);
+        if (strtod(out, NULL) == x) {
+            break;
+        }
+    }
+    /* keep json reals apart from ints */
+    if (format == FORMAT_JSON && !strpbrk(out, ".e")) {
+        strncat(out, ".0", size - strlen(out) - 1);
+    }
+}
+
+static uint64_t read_be(const uint8_t *p, int nbytes)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < nbytes; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static double read_real(const uint8_t *p, int nbytes)
+{
+    uint64_t bits = read_be(p, nbytes);
+    uint32_t bits32 = (uint32_t)bits;
+    double d;
+    float f;
+
+    if (nbytes == 4) {
+        memcpy(&f, &bits32, sizeof f);
+        return f;
+    }
+    memcpy(&d, &bits, sizeof d);
+    return d;
+}
+
+static void out_tagged(binaryplist_transcoder *t, const char *tag, const char *text)
+{
+    if (t->format == FORMAT_XML) {
+        out_byte(t, '<');
+        out_str(t, tag);
+        out_byte(t, '>');
+        out_str(t, text);
+        out_str(t, "</");
+        out_str(t, tag);
+        out_byte(t, '>');
+    } else {
+        out_str(t, text);
+    }
+}
+
+/* A string or data payload, quoted for json */
+static int out_text(binaryplist_transcoder *t, uint64_t pos, const char *tag)
+{
+    binaryplist_decoder *decoder = &t->decoder;
+    uint8_t kind = decoder->data[pos] >> 4;
+    uint64_t length, end = decoder->offset_table;
+
+    if (decoder_read_length(decoder, &pos, &length) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    if (kind == BPLIST_UNICODE ? length > (end - pos) / 2 : length > end - pos) {
+        return transcode_error("invalid or truncated object");
+    }
+    if (t->format == FORMAT_XML) {
+        out_byte(t, '<');
+        out_str(t, tag);
+        out_byte(t, '>');
+    } else {
+        out_byte(t, '"');
+    }
+    if (kind == BPLIST_UNICODE) {
+        out_utf16(t, decoder->data + pos, length);
+    } else if (kind == BPLIST_DATA) {
+        out_base64(t, decoder->data + pos, length);
+    } else {
+        out_escaped(t, decoder->data + pos, length);
+    }
+    if (t->format == FORMAT_XML) {
+        out_str(t, "</");
+        out_str(t, tag);
+        out_byte(t, '>');
+    } else {
+        out_byte(t, '"');
+    }
+    return BINARYPLIST_OK;
+}
+
+static int out_scalar(binaryplist_transcoder *t, uint64_t pos)
+{
+    binaryplist_decoder *decoder = &t->decoder;
+    const uint8_t *p = decoder->data + pos;
+    uint8_t marker = *p;
+    uint64_t end = decoder->offset_table;
+    binaryplist_civil c;
+    char text[64];
+    int nbytes, xml = (t->format == FORMAT_XML);
+
+    switch (marker >> 4) {
+    case 0x0:
+        if (marker == BPLIST_NULL) {
+            out_str(t, xml ? "<string></string>" : "null");
+        } else if (marker == BPLIST_TRUE) {
+            out_str(t, xml ? "<true/>" : "true");
+        } else if (marker == BPLIST_FALSE) {
+            out_str(t, xml ? "<false/>" : "false");
+        } else {
+            break;
+        }
+        return BINARYPLIST_OK;
+    case BPLIST_UINT:
+        nbytes = 1 << (marker & 0x0F);
+        if (nbytes > 16 || pos + 1 + nbytes > end) {
+            break;
+        }
+        if (nbytes == 16) {
+            /* 128 bit ints only carry unsigned 64 bit values in the low half */
+            snprintf(text, sizeof(text), "%llu", (unsigned long long)read_be(p + 9, 8));
+        } else {
+            /* 8 byte ints are signed, shorter ones are always positive */
+            snprintf(text, sizeof(text), "%lld", (long long)read_be(p + 1, nbytes));
+        }
+        out_tagged(t, "integer", text);
+        return BINARYPLIST_OK;
+    case BPLIST_REAL:
+        nbytes = 1 << (marker & 0x0F);
+        if ((nbytes != 4 && nbytes != 8) || pos + 1 + nbytes > end) {
+            break;
+        }
+        format_real(t->format, read_real(p + 1, nbytes), text, sizeof(text));
+        out_tagged(t, "real", text);
+        return BINARYPLIST_OK;
+    case BPLIST_DATE:
+        if (marker != 0x33 || pos + 9 > end) {
+            break;
+        }
+        if (decoder_split_date(read_real(p + 1, 8), &c) != BINARYPLIST_OK) {
+            return transcode_error("date is out of range");
+        }
+        if (xml) {
+            /* the plist DTD has whole seconds only */
+            snprintf(text, sizeof(text), "<date>%04d-%02d-%02dT%02d:%02d:%02dZ</date>",
+                c.year, c.month, c.day, c.hour, c.minute, c.second);
+        } else if (c.usec) {
+            snprintf(text, sizeof(text), "\"%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\"",
+                c.year, c.month, c.day, c.hour, c.minute, c.second, c.usec);
+        } else {
+            snprintf(text, sizeof(text), "\"%04d-%02d-%02dT%02d:%02d:%02dZ\"",
+                c.year, c.month, c.day, c.hour, c.minute, c.second);
+        }
+        out_str(t, text);
+        return BINARYPLIST_OK;
+    case BPLIST_DATA:
+        return out_text(t, pos, "data");
+    case BPLIST_STRING:
+    case BPLIST_UNICODE:
+        return out_text(t, pos, "string");
+    case BPLIST_UID:
+        nbytes = (marker & 0x0F) + 1;
+        if (nbytes > 8 || pos + 1 + nbytes > end) {
+            break;
+        }
+        snprintf(text, sizeof(text), "%llu", (unsigned long long)read_be(p + 1, nbytes));
+        if (xml) {
+            /* the keyed archiver form */
+            out_str(t, "<dict>\n");
+            out_indent(t, t->depth + 1);
+            out_str(t, "<key>CF$UID</key>\n");
+            out_indent(t, t->depth + 1);
+            out_tagged(t, "integer", text);
+            out_byte(t, '\n');
+            out_indent(t, t->depth);
+            out_str(t, "</dict>");
+        } else {
+            out_str(t, "{\"CF$UID\":");
+            out_str(t, text);
+            out_byte(t, '}');
+        }
+        return BINARYPLIST_OK;
+    }
+    return transcode_error("invalid or truncated object");
+}
+
+/*
+ * Write a value, or open a container and push it so the caller writes
+ * its entries. pushed tells which happened.
+ */
+static int open_value(binaryplist_transcoder *t, uint64_t ref, int *pushed)
+{
+    binaryplist_decoder *decoder = &t->decoder;
+    transcode_frame *frame;
+    uint64_t pos, count, refs;
+    uint8_t kind;
+    int cap, xml = (t->format == FORMAT_XML);
+
+    *pushed = 0;
+    if (decoder_position(decoder, ref, &pos) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    kind = decoder->data[pos] >> 4;
+    if (kind != BPLIST_ARRAY && kind != BPLIST_SET && kind != BPLIST_DICT) {
+        return out_scalar(t, pos);
+    }
+    if (decoder_read_container(decoder, ref, &kind, &pos, &count) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    if (count == 0) {
+        out_str(t, kind == BPLIST_DICT ? (xml ? "<dict/>" : "{}") : (xml ? "<array/>" : "[]"));
+        return BINARYPLIST_OK;
+    }
+    if (decoder->inprogress[ref]) {
+        return transcode_error("a container with references to itself is not decodable");
+    }
+    if (t->depth + 1 >= decoder->max_recursion) {
+        return transcode_error("object depth exceeded max_recursion");
+    }
+    refs = kind == BPLIST_DICT ? 2 * count : count;
+    if (refs > t->max_expansion - t->expansion) {
+        return transcode_error("containers expand past max_expansion");
+    }
+    t->expansion += refs;
+    if (t->depth == t->stack_cap) {
+        cap = t->stack_cap ? t->stack_cap * 2 : 64;
+        if (!(frame = realloc(t->stack, cap * sizeof(transcode_frame)))) {
+            PyErr_NoMemory();
+            return BINARYPLIST_ERROR;
+        }
+        t->stack = frame;
+        t->stack_cap = cap;
+    }
+    frame = &t->stack[t->depth++];
+    frame->ref = ref;
+    frame->pos = pos;
+    frame->count = count;
+    frame->next = 0;
+    frame->kind = kind;
+    decoder->inprogress[ref] = 1;
+    out_str(t, kind == BPLIST_DICT ? (xml ? "<dict>\n" : "{") : (xml ? "<array>\n" : "["));
+    *pushed = 1;
+    return BINARYPLIST_OK;
+}
+
+static int out_key(binaryplist_transcoder *t, uint64_t ref)
+{
+    binaryplist_decoder *decoder = &t->decoder;
+    uint64_t pos;
+    uint8_t kind;
+
+    if (decoder_position(decoder, ref, &pos) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    kind = decoder->data[pos] >> 4;
+    if (kind != BPLIST_STRING && kind != BPLIST_UNICODE) {
+        return transcode_error("dict key is not a string");
+    }
+    if (t->format == FORMAT_XML) {
+        out_indent(t, t->depth);
+        if (out_text(t, pos, "key") != BINARYPLIST_OK) {
+            return BINARYPLIST_ERROR;
+        }
+        out_byte(t, '\n');
+        return BINARYPLIST_OK;
+    }
+    if (out_text(t, pos, NULL) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    out_byte(t, ':');
+    return BINARYPLIST_OK;
+}
+
+static int transcode_write(binaryplist_transcoder *t)
+{
+    binaryplist_decoder *decoder = &t->decoder;
+    transcode_frame *frame;
+    uint64_t ref;
+    int pushed, xml = (t->format == FORMAT_XML);
+
+    if (xml) {
+        out_str(t, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "
+            "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+            "<plist version=\"1.0\">\n");
+    }
+    if (open_value(t, decoder->root, &pushed) != BINARYPLIST_OK) {
+        return BINARYPLIST_ERROR;
+    }
+    if (xml && !pushed) {
+        out_byte(t, '\n');
+    }
+    while (t->depth > 0 && !t->out.failed) {
+        frame = &t->stack[t->depth - 1];
+        if (frame->next == frame->count) {
+            decoder->inprogress[frame->ref] = 0;
+            t->depth--;
+            if (xml) {
+                out_indent(t, t->depth);
+                out_str(t, frame->kind == BPLIST_DICT ? "</dict>\n" : "</array>\n");
+            } else {
+                out_byte(t, frame->kind == BPLIST_DICT ? '}' : ']');
+            }
+            continue;
+        }
+        if (!xml && frame->next) {
+            out_byte(t, ',');
+        }
+        if (frame->kind == BPLIST_DICT) {
+            if (out_key(t, decoder_read_ref(decoder, frame->pos, frame->next))
+                != BINARYPLIST_OK) {
+                return BINARYPLIST_ERROR;
+            }
+            ref = decoder_read_ref(decoder, frame->pos, frame->count + frame->next);
+        } else {
+            ref = decoder_read_ref(decoder, frame->pos, frame->next);
+        }
+        frame->next++;
+        if (xml) {
+            out_indent(t, t->depth);
+        }
+        if (open_value(t, ref, &pushed) != BINARYPLIST_OK) {
+            return BINARYPLIST_ERROR;
+        }
+        if (xml && !pushed) {
+            out_byte(t, '\n');
+        }
+    }
+    out_str(t, xml ? "</plist>\n" : "\n");
+    bplist_output_flush(&t->out);
+    return t->out.failed ? BINARYPLIST_ERROR : BINARYPLIST_OK;
+}
+
+PyObject *transcode(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "format", "file", "chunk_size", "max_recursion",
+        "max_expansion", NULL};
+    PyObject *oexpansion = Py_None, *newobj = NULL;
+    PyObject *ofile = Py_None;
+    const char *format = "xml";
+    Py_ssize_t chunk_size = DEFAULT_CHUNK_SIZE;
+    Py_buffer view;
+    binaryplist_transcoder t;
+    memory_sink memory;
+    bplist_flush flush;
+    void *sink;
+    uint8_t *chunk = NULL;
+    int fd, auto_expansion;
+
+    memset(&t, 0, sizeof(binaryplist_transcoder));
+    memset(&memory, 0, sizeof(memory_sink));
+    t.decoder.max_recursion = 1024*16;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*|sOniO", kwlist, &view, &format,
+        &ofile, &chunk_size, &(t.decoder.max_recursion), &oexpansion)) {
+        return NULL;
+    }
+    t.decoder.data = view.buf;
+    t.decoder.len = view.len;
+
+    if (!strcmp(format, "xml")) {
+        t.format = FORMAT_XML;
+    } else if (!strcmp(format, "json")) {
+        t.format = FORMAT_JSON;
+    } else {
+        transcode_error("format must be 'xml' or 'json'");
+        goto done;
+    }
+    if (chunk_size < 16) {
+        transcode_error("chunk_size is too small");
+        goto done;
+    }
+    if (parse_max_expansion(oexpansion, &t.max_expansion, &auto_expansion) != BINARYPLIST_OK) {
+        goto done;
+    }
+    if (ofile == Py_None) {
+        flush = flush_memory;
+        sink = &memory;
+    } else if (PyInt_Check(ofile) || PyLong_Check(ofile)) {
+        fd = PyInt_AsLong(ofile);
+        flush = flush_fd;
+        sink = &fd;
+    } else if (PyObject_HasAttrString(ofile, "write")) {
+        flush = flush_file;
+        sink = ofile;
+    } else {
+        transcode_error("file must be a file descriptor or have a write method");
+        goto done;
+    }
+
+    /* only the cycle check is per object, the decoded object cache is not needed */
+    if (decoder_read_trailer(&t.decoder) != BINARYPLIST_OK) {
+        goto done;
+    }
+    if (auto_expansion) {
+        /* as many refs as the objects have room for, no pass to count them */
+        t.max_expansion = default_expansion(t.decoder.offset_table / t.decoder.ref_id_sz);
+    }
+    if (!(t.decoder.inprogress = calloc(t.decoder.nobjects, sizeof(uint8_t)))
+        || !(chunk = malloc(chunk_size))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    bplist_output_init(&t.out, chunk, chunk_size, flush, sink);
+    if (transcode_write(&t) == BINARYPLIST_OK) {
+        newobj = (ofile == Py_None)
+            ? PyString_FromStringAndSize((const char *)memory.data, memory.len)
+            : PyInt_FromSsize_t((Py_ssize_t)t.out.flushed);
+    }
+
+done:
+    free(chunk);
+    free(t.stack);
+    free(memory.data);
+    decoder_free(&t.decoder);
+    PyBuffer_Release(&view);
+    return newobj;
+}
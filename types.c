@@ -0,0 +1,223 @@
+#include "binaryplist.h"
+#include <datetime.h>
+
+
+/*
+ * Type dispatch for the encoder. Every python type is classified once:
+ * the common builtins by exact type in types_lookup, everything else by
+ * walking its mro here, where the nearest base that is either a plist
+ * type or registered with register_type wins. The result is cached per
+ * type, so isinstance checks and converter lookups are not repeated per
+ * object. Cached types are kept alive so their addresses cannot be
+ * reused, and the cache is dropped whenever the registry changes.
+ *
+ */
+
+const binaryplist_dispatch types_builtin[TYPE_CLASSES] = {
+    {TYPE_UNKNOWN, NULL, NULL},
+    {TYPE_NONE, NULL, NULL},
+    {TYPE_BOOL, NULL, NULL},
+    {TYPE_INT, NULL, NULL},
+    {TYPE_FLOAT, NULL, NULL},
+    {TYPE_STRING, NULL, NULL},
+    {TYPE_UNICODE, NULL, NULL},
+    {TYPE_DATE, NULL, NULL},
+    {TYPE_DATA, NULL, NULL},
+    {TYPE_UID, NULL, NULL},
+    {TYPE_ARRAY, NULL, NULL},
+    {TYPE_DICT, NULL, NULL},
+    {TYPE_BUFFER, NULL, NULL},
+    {TYPE_FROZEN, NULL, NULL}
+};
+
+/* Bumped whenever the registry changes, for caches of converted output */
+unsigned long types_generation = 0;
+
+/* Registered converters keyed on type */
+static PyObject *registry = NULL;
+/* Types classified so far, owns them; cache maps each to its record */
+static PyObject *cached_types = NULL;
+static binaryplist_dispatch *records = NULL;
+static Py_ssize_t records_cap = 0;
+static ptrmap cache;
+
+static PyObject *array_type = NULL;
+static PyTypeObject *date_type = NULL;
+
+/* Builtin class of exactly this type, TYPE_UNKNOWN if it has none */
+static int builtin_class(PyObject *type)
+{
+    if (type == binaryplist_data_type) return TYPE_DATA;
+    if (type == binaryplist_uid_type) return TYPE_UID;
+    if (type == (PyObject *)&PyBool_Type) return TYPE_BOOL;
+    if (type == (PyObject *)&PyInt_Type || type == (PyObject *)&PyLong_Type) return TYPE_INT;
+    if (type == (PyObject *)&PyFloat_Type) return TYPE_FLOAT;
+    if (type == (PyObject *)&PyString_Type) return TYPE_STRING;
+    if (type == (PyObject *)&PyUnicode_Type) return TYPE_UNICODE;
+    if (type == (PyObject *)date_type) return TYPE_DATE;
+    if (type == (PyObject *)&PyList_Type || type == (PyObject *)&PyTuple_Type) return TYPE_ARRAY;
+    if (type == (PyObject *)&PyDict_Type) return TYPE_DICT;
+    if (type == (PyObject *)Py_TYPE(Py_None)) return TYPE_NONE;
+    if (type == array_type) return TYPE_BUFFER;
+    if (type == binaryplist_frozen_type) return TYPE_FROZEN;
+    return TYPE_UNKNOWN;
+}
+
+/* Types that types_lookup matches by exact type, before any converter */
+static int has_fast_path(PyObject *type)
+{
+    return type == (PyObject *)&PyString_Type || type == (PyObject *)&PyUnicode_Type
+        || type == (PyObject *)&PyInt_Type || type == (PyObject *)&PyFloat_Type
+        || type == (PyObject *)&PyDict_Type || type == (PyObject *)&PyList_Type
+        || type == (PyObject *)&PyTuple_Type || type == (PyObject *)&PyBool_Type
+        || type == (PyObject *)Py_TYPE(Py_None);
+}
+
+static int classify(PyTypeObject *type, binaryplist_dispatch *record)
+{
+    PyObject *mro, *base, *converter;
+    Py_ssize_t i, n;
+
+    /* some extension types, array.array among them, are readied lazily */
+    if (!type->tp_mro && PyType_Ready(type) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    mro = type->tp_mro;
+    n = mro ? PyTuple_GET_SIZE(mro) : 0;
+    memset(record, 0, sizeof(binaryplist_dispatch));
+    for (i = 0; i < n; i++) {
+        base = PyTuple_GET_ITEM(mro, i);
+        if ((converter = PyDict_GetItem(registry, base))) {
+            record->converter = converter;
+            if (PyCapsule_CheckExact(converter)) {
+                record->cls = TYPE_NATIVE;
+                record->native = PyCapsule_GetPointer(converter, BINARYPLIST_CONVERTER_CAPSULE);
+            } else {
+                record->cls = TYPE_CONVERTER;
+            }
+            return BINARYPLIST_OK;
+        }
+        if ((record->cls = builtin_class(base)) != TYPE_UNKNOWN) {
+            return BINARYPLIST_OK;
+        }
+    }
+    if (type->tp_as_buffer && ((PyType_HasFeature(type, Py_TPFLAGS_HAVE_NEWBUFFER)
+        && type->tp_as_buffer->bf_getbuffer) || type->tp_as_buffer->bf_getreadbuffer)) {
+        /* numeric and byte buffers are tried, others still go to the object_hook */
+        record->cls = TYPE_BUFFER;
+    }
+    return BINARYPLIST_OK;
+}
+
+/*
+ * Dispatch record of a type that has no exact type fast path. The record
+ * may move when other types are added, copy it before calling back into
+ * python. Returns NULL with an exception set on failure.
+ */
+const binaryplist_dispatch *types_resolve(PyTypeObject *type)
+{
+    binaryplist_dispatch *grown;
+    long index;
+
+    if (ptrmap_get(&cache, type, &index)) {
+        return &records[index];
+    }
+    index = PyList_GET_SIZE(cached_types);
+    if (index == records_cap) {
+        grown = realloc(records, (records_cap ? records_cap * 2 : 32) * sizeof(binaryplist_dispatch));
+        if (!grown) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        records = grown;
+        records_cap = records_cap ? records_cap * 2 : 32;
+    }
+    if (classify(type, &records[index]) != BINARYPLIST_OK
+        || PyList_Append(cached_types, (PyObject *)type) < 0) {
+        return NULL;
+    }
+    if (ptrmap_set(&cache, type, index) != 0) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return &records[index];
+}
+
+static int clear_cache(void)
+{
+    ptrmap_clear(&cache);
+    return PyList_SetSlice(cached_types, 0, PyList_GET_SIZE(cached_types), NULL);
+}
+
+/*
+ * register_type(cls, converter): encode instances of cls, and of its
+ * subclasses unless a nearer base is registered, through converter. A
+ * callable returns the object to encode in place of the instance; a
+ * capsule holding a binaryplist_converter writes the plist bytes itself.
+ * None removes the registration.
+ */
+PyObject *types_register(PyObject *self, PyObject *args)
+{
+    PyObject *cls, *converter;
+
+    if (!PyArg_ParseTuple(args, "OO", &cls, &converter)) {
+        return NULL;
+    }
+    if (!PyType_Check(cls)) {
+        PyErr_SetString(PyExc_TypeError, "register_type() needs a new style class");
+        return NULL;
+    }
+    if (has_fast_path(cls)) {
+        PyErr_SetString(PLIST_Error, "cannot register a converter for a builtin plist type");
+        return NULL;
+    }
+    if (converter == Py_None) {
+        if (PyDict_GetItem(registry, cls) && PyDict_DelItem(registry, cls) < 0) {
+            return NULL;
+        }
+    } else if (PyCapsule_CheckExact(converter)) {
+        if (!PyCapsule_IsValid(converter, BINARYPLIST_CONVERTER_CAPSULE)) {
+            PyErr_SetString(PyExc_TypeError,
+                "converter capsule is not a " BINARYPLIST_CONVERTER_CAPSULE);
+            return NULL;
+        }
+        if (PyDict_SetItem(registry, cls, converter) < 0) {
+            return NULL;
+        }
+    } else if (!PyCallable_Check(converter)) {
+        PyErr_SetString(PyExc_TypeError, "converter is not callable");
+        return NULL;
+    } else if (PyDict_SetItem(registry, cls, converter) < 0) {
+        return NULL;
+    }
+    types_generation++;
+    if (clear_cache() < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+void types_init(void)
+{
+    PyObject *module;
+
+    /*
+     * Compiler voodoo ( static ), must be called from within this file.
+     */
+    PyDateTime_IMPORT;
+    if (PyDateTimeAPI) {
+        date_type = PyDateTimeAPI->DateType;
+    }
+    if (!array_type && (module = PyImport_ImportModule("array"))) {
+        array_type = PyObject_GetAttrString(module, "ArrayType");
+        Py_DECREF(module);
+    }
+    PyErr_Clear();
+    if (!registry) {
+        registry = PyDict_New();
+        cached_types = PyList_New(0);
+        if (ptrmap_init(&cache, 0) != 0) {
+            PyErr_NoMemory();
+        }
+    }
+}
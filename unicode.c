@@ -0,0 +1,187 @@
+#include "binaryplist.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH 1
+#endif
+
+
+/*
+ * Unicode kernels for the encoder. One scan decides between the ASCII
+ * (0x5) and UTF-16BE (0x6) forms and counts surrogate pairs, then the
+ * chosen form is transcoded straight into the output buffer.
+ *
+ * The vector paths assume 4 byte Py_UNICODE (wide builds) and fall
+ * back to the scalar loops everywhere else.
+ *
+ */
+
+static void scan_scalar(const Py_UNICODE *u, Py_ssize_t n, Py_UCS4 *bits, Py_ssize_t *astral)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++) {
+        *bits |= u[i];
+#if Py_UNICODE_SIZE == 4
+        *astral += (u[i] > 0xFFFF);
+#endif
+    }
+}
+
+#if Py_UNICODE_SIZE == 4 && defined(__SSE2__)
+
+static Py_ssize_t scan_sse2(const Py_UNICODE *u, Py_ssize_t n, Py_UCS4 *bits, Py_ssize_t *astral)
+{
+    Py_ssize_t i = 0;
+    __m128i acc = _mm_setzero_si128();
+    __m128i count = _mm_setzero_si128();
+    __m128i bmp = _mm_set1_epi32(0xFFFF);
+    uint32_t lanes[4];
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(u + i));
+        acc = _mm_or_si128(acc, v);
+        /* code points fit in 21 bits so the signed compare is safe */
+        count = _mm_sub_epi32(count, _mm_cmpgt_epi32(v, bmp));
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    *bits |= lanes[0] | lanes[1] | lanes[2] | lanes[3];
+    _mm_storeu_si128((__m128i *)lanes, count);
+    *astral += (Py_ssize_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return i;
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static Py_ssize_t scan_avx2(const Py_UNICODE *u, Py_ssize_t n, Py_UCS4 *bits, Py_ssize_t *astral)
+{
+    Py_ssize_t i = 0;
+    __m256i acc = _mm256_setzero_si256();
+    __m256i count = _mm256_setzero_si256();
+    __m256i bmp = _mm256_set1_epi32(0xFFFF);
+    uint32_t lanes[8];
+    int k;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(u + i));
+        acc = _mm256_or_si256(acc, v);
+        count = _mm256_sub_epi32(count, _mm256_cmpgt_epi32(v, bmp));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    for (k = 0; k < 8; k++) {
+        *bits |= lanes[k];
+    }
+    _mm256_storeu_si256((__m256i *)lanes, count);
+    for (k = 0; k < 8; k++) {
+        *astral += lanes[k];
+    }
+    return i;
+}
+
+static int have_avx2 = -1;
+#endif
+
+#endif
+
+/*
+ * OR of every code unit (so bits < 0x80 means pure ASCII) and the number
+ * of chars outside the BMP, each of which needs a surrogate pair.
+ */
+void unicode_scan(const Py_UNICODE *u, Py_ssize_t n, Py_UCS4 *bits, Py_ssize_t *astral)
+{
+    Py_ssize_t i = 0;
+
+    *bits = 0;
+    *astral = 0;
+#if Py_UNICODE_SIZE == 4 && defined(__SSE2__)
+#ifdef HAVE_AVX2_DISPATCH
+    if (have_avx2 < 0) {
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    i = have_avx2 ? scan_avx2(u, n, bits, astral) : scan_sse2(u, n, bits, astral);
+#else
+    i = scan_sse2(u, n, bits, astral);
+#endif
+#endif
+    scan_scalar(u + i, n - i, bits, astral);
+}
+
+/* Narrow pure ASCII chars to one byte each. Returns the new end of out. */
+uint8_t *unicode_to_ascii(const Py_UNICODE *u, Py_ssize_t n, uint8_t *out)
+{
+    Py_ssize_t i = 0;
+
+#if Py_UNICODE_SIZE == 4 && defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        const __m128i *p = (const __m128i *)(u + i);
+        __m128i lo = _mm_packs_epi32(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+        __m128i hi = _mm_packs_epi32(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(lo, hi));
+        out += 16;
+    }
+#endif
+    for (; i < n; i++) {
+        *out++ = (uint8_t)u[i];
+    }
+    return out;
+}
+
+static uint8_t *utf16be_scalar(const Py_UNICODE *u, Py_ssize_t n, uint8_t *out)
+{
+    Py_ssize_t i;
+    Py_UCS4 c;
+
+    for (i = 0; i < n; i++) {
+        c = u[i];
+#if Py_UNICODE_SIZE == 4
+        if (c > 0xFFFF) {
+            c -= 0x10000;
+            *out++ = (uint8_t)((0xD800 | (c >> 10)) >> 8);
+            *out++ = (uint8_t)(0xD800 | (c >> 10));
+            c = 0xDC00 | (c & 0x3FF);
+        }
+#endif
+        *out++ = (uint8_t)(c >> 8);
+        *out++ = (uint8_t)c;
+    }
+    return out;
+}
+
+/*
+ * Transcode to UTF-16BE. out needs room for 2 bytes per char plus 2 more
+ * per astral char. Returns the new end of out.
+ */
+uint8_t *unicode_to_utf16be(const Py_UNICODE *u, Py_ssize_t n, uint8_t *out)
+{
+    Py_ssize_t i = 0;
+
+#if Py_UNICODE_SIZE == 4 && defined(__SSE2__)
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    const __m128i bmp = _mm_set1_epi32(0xFFFF);
+
+    for (; i + 8 <= n; i += 8) {
+        const __m128i *p = (const __m128i *)(u + i);
+        __m128i a = _mm_loadu_si128(p);
+        __m128i b = _mm_loadu_si128(p + 1);
+        __m128i v;
+
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi32(a, bmp),
+                                           _mm_cmpgt_epi32(b, bmp)))) {
+            /* surrogate pairs needed somewhere in this block */
+            out = utf16be_scalar(u + i, 8, out);
+            continue;
+        }
+        /* unsigned 32 -> 16 narrowing via a biased signed pack */
+        v = _mm_packs_epi32(_mm_sub_epi32(a, bias32), _mm_sub_epi32(b, bias32));
+        v = _mm_add_epi16(v, bias16);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)out, v);
+        out += 16;
+    }
+#endif
+    return utf16be_scalar(u + i, n - i, out);
+}
@@ -0,0 +1,171 @@
+#include "binaryplist.h"
+
+
+/*
+ * Append-only updates of a plist whose root is a dict. Only the changed
+ * values (and any new keys) are encoded; they are written after the end
+ * of the existing data together with a new root dict, a new offset table
+ * and a new trailer. Unchanged keys and values keep their old ids, so the
+ * old objects are never rewritten. The old offset table and trailer stay
+ * behind as dead bytes until the file is compacted.
+ *
+ * Refs must keep the width the old objects were written with. When the
+ * grown object count no longer fits, None is returned and the caller
+ * rewrites the file instead.
+ *
+ */
+
+enum
+{
+    KEEP,
+    REPLACE,
+    DROP
+};
+
+static int fits_ref_size(uint64_t max_id, int ref_id_sz)
+{
+    return ref_id_sz >= 8 || (max_id >> (8 * ref_id_sz)) == 0;
+}
+
+PyObject *update_encode(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "changes", "delete", "unique", "convert_nulls",
+                             "max_recursion", "object_hook", NULL};
+    PyObject *newobj = NULL;
+    PyObject *changes = NULL;
+    PyObject *odelete = NULL;
+    PyObject *ounique = NULL;
+    PyObject *orecursion = NULL;
+    PyObject *deleted = NULL, *old = NULL, *key, *value;
+    Py_buffer view;
+    binaryplist_decoder decoder;
+    binaryplist_encoder encoder;
+    uint8_t kind, *action = NULL;
+    uint64_t pos, count, i;
+    Py_ssize_t npairs, k = 0, at, dict_pos = 0;
+    long root, kref, vref, base;
+
+    memset(&decoder, 0, sizeof(binaryplist_decoder));
+    memset(&encoder, 0, sizeof(binaryplist_encoder));
+    decoder.max_recursion = 1024*16;
+    encoder.convert_nulls = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*O!|OOOOO", kwlist, &view,
+        &PyDict_Type, &changes, &odelete, &ounique, &(encoder.convert_nulls), &orecursion,
+        &(encoder.object_hook))) {
+        return NULL;
+    }
+    decoder.data = view.buf;
+    decoder.len = view.len;
+
+    if (decoder_read_trailer(&decoder) != BINARYPLIST_OK
+        || decoder_alloc(&decoder) != BINARYPLIST_OK
+        || decoder_read_container(&decoder, decoder.root, &kind, &pos, &count) != BINARYPLIST_OK) {
+        goto done;
+    }
+    if (kind != BPLIST_DICT) {
+        PyErr_SetString(PLIST_Error, "root object is not a dict");
+        goto done;
+    }
+    if (!(deleted = odelete ? PySet_New(odelete) : PySet_New(NULL))
+        || !(old = PyDict_New())
+        || !(action = malloc(count ? count : 1))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* classify the existing keys, changed keys win over deleted ones */
+    npairs = 0;
+    for (i = 0; i < count; i++) {
+        if (!(key = decoder_decode_object(&decoder, decoder_read_ref(&decoder, pos, i)))
+            || PyDict_SetItem(old, key, Py_None) < 0) {
+            goto done;
+        }
+        if (PyDict_Contains(changes, key)) {
+            action[i] = REPLACE;
+        } else if (PySet_Contains(deleted, key) == 1) {
+            action[i] = DROP;
+            continue;
+        } else {
+            action[i] = KEEP;
+        }
+        npairs++;
+    }
+    while (PyDict_Next(changes, &dict_pos, &key, &value)) {
+        if (!PyDict_Contains(old, key)) {
+            npairs++;
+        }
+    }
+    if (PyErr_Occurred()) {
+        goto done;
+    }
+
+    /* new objects are numbered and placed after everything already there */
+    if (encoder_setup(&encoder, ounique, NULL, orecursion) != BINARYPLIST_OK) {
+        goto done;
+    }
+    base = encoder.id_base = (long)decoder.nobjects;
+    encoder.offset_base = decoder.len;
+    encoder.ref_id_sz = decoder.ref_id_sz;
+    encoder.old_offsets = decoder.data + decoder.offset_table;
+    encoder.old_off_sz = decoder.offset_sz;
+    if ((root = encoder_add_container(&encoder, BPLIST_DICT, npairs * 2)) < 0) {
+        goto done;
+    }
+    at = encoder.entries[root].refs_at;
+
+    for (i = 0; i < count; i++) {
+        if (action[i] == DROP) {
+            continue;
+        }
+        kref = (long)decoder_read_ref(&decoder, pos, i) - base;
+        if (action[i] == REPLACE) {
+            key = decoder_decode_object(&decoder, decoder_read_ref(&decoder, pos, i));
+            if (encoder_encode_object(&encoder, PyDict_GetItem(changes, key), &vref)
+                != BINARYPLIST_OK) {
+                goto done;
+            }
+        } else {
+            vref = (long)decoder_read_ref(&decoder, pos, count + i) - base;
+        }
+        encoder.refs[at + k] = kref;
+        encoder.refs[at + npairs + k] = vref;
+        k++;
+    }
+    dict_pos = 0;
+    while (PyDict_Next(changes, &dict_pos, &key, &value)) {
+        if (PyDict_Contains(old, key)) {
+            continue;
+        }
+        if (encoder_encode_object(&encoder, key, &kref) != BINARYPLIST_OK
+            || encoder_encode_object(&encoder, value, &vref) != BINARYPLIST_OK) {
+            goto done;
+        }
+        encoder.refs[at + k] = kref;
+        encoder.refs[at + npairs + k] = vref;
+        k++;
+    }
+
+    if (!fits_ref_size(decoder.nobjects + encoder.nobjects - 1, decoder.ref_id_sz)) {
+        Py_INCREF(Py_None);
+        newobj = Py_None;
+        goto done;
+    }
+    if (encoder_size(&encoder) >= 0
+        && (newobj = PyString_FromStringAndSize(NULL, encoder.size))) {
+        bplist_output_init(&encoder.out, (uint8_t *)PyString_AS_STRING(newobj),
+            encoder.size, NULL, NULL);
+        if (encoder_write(&encoder) != BINARYPLIST_OK) {
+            encoder_set_error(&encoder);
+            Py_CLEAR(newobj);
+        }
+    }
+
+done:
+    free(action);
+    Py_XDECREF(deleted);
+    Py_XDECREF(old);
+    encoder_free(&encoder);
+    decoder_free(&decoder);
+    PyBuffer_Release(&view);
+    return newobj;
+}
@@ -0,0 +1,641 @@
+#include "binaryplist.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH 1
+#endif
+
+
+/*
+ * Validation of untrusted binary plists before decode. Anything it
+ * accepts decodes, and no python object is built on the way, so bad input
+ * is turned away before any memory is spent on it. It is stricter than
+ * decode in one way: objects the root does not reach must be well formed
+ * too, where decode never looks at them.
+ *
+ * Once the trailer checks out the GIL is released for three passes:
+ * the offset table is range checked as one array, every object is then
+ * parsed as decode_uncached would (container refs range checked as
+ * arrays too), and the reachable graph is walked in decode order for
+ * loops, depth and expansion. The array checks load big endian values
+ * with SSE2, or AVX2 where the CPU has it, like the kernels in unicode.c.
+ *
+ * Expansion is the number of refs the containers would hold with every
+ * shared container written out in full, which is what transcode() or a
+ * recursive walk of the decoded objects costs. A few kilobytes of
+ * containers pointing twice at the next one expand past any memory.
+ *
+ */
+
+/* Default max_expansion is this many times the refs in the plist... */
+#define EXPANSION_FACTOR 64
+/* ...but never below this */
+#define EXPANSION_MIN (1 << 20)
+
+enum
+{
+    STATE_NEW,
+    STATE_OPEN,
+    STATE_DONE
+};
+
+typedef struct validate_frame {
+    uint64_t ref;
+    /* Next ref to follow, dicts go key 0, value 0, key 1... */
+    uint64_t next;
+} validate_frame;
+
+typedef struct binaryplist_validator {
+    binaryplist_decoder decoder;
+    uint64_t max_expansion;
+    /* Kind nibble and walk state per object */
+    uint8_t *kinds;
+    uint8_t *state;
+    /* Start of the refs and entry count of each container */
+    uint64_t *pos;
+    uint64_t *count;
+    /* Expanded refs below each container, final once it is done */
+    uint64_t *expansion;
+    uint64_t total_refs;
+    validate_frame *stack;
+    int nomemory;
+} binaryplist_validator;
+
+static uint64_t read_multi_be(const uint8_t *p, int nbytes)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < nbytes; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+/* 1 if all n big endian values of width bytes lie in lo..hi */
+static int range_scalar(const uint8_t *p, uint64_t n, int width, uint64_t lo, uint64_t hi)
+{
+    uint64_t i, v;
+    int bad = 0;
+
+    switch (width) {
+    case 1:
+        for (i = 0; i < n; i++) {
+            v = p[i];
+            bad |= (v < lo) | (v > hi);
+        }
+        break;
+    case 2:
+        for (i = 0; i < n; i++, p += 2) {
+            v = (uint64_t)p[0] << 8 | p[1];
+            bad |= (v < lo) | (v > hi);
+        }
+        break;
+    case 4:
+        for (i = 0; i < n; i++, p += 4) {
+            v = (uint64_t)p[0] << 24 | (uint64_t)p[1] << 16 | (uint64_t)p[2] << 8 | p[3];
+            bad |= (v < lo) | (v > hi);
+        }
+        break;
+    case 8:
+        for (i = 0; i < n; i++, p += 8) {
+            memcpy(&v, p, 8);
+            v = bplist_to_be64(v);
+            bad |= (v < lo) | (v > hi);
+        }
+        break;
+    default:
+        for (i = 0; i < n; i++, p += width) {
+            v = read_multi_be(p, width);
+            bad |= (v < lo) | (v > hi);
+        }
+    }
+    return !bad;
+}
+
+/* Code units before the first one that is a surrogate half */
+static uint64_t utf16_plain_scalar(const uint8_t *p, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n && (p[2 * i] & 0xF8) != 0xD8; i++) {
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+
+/*
+ * The range kernels return how many values they checked and clear *ok
+ * when one falls outside lo..hi. Both bounds fit the width. There are
+ * only signed compares, so values and bounds get their top bit flipped.
+ */
+static uint64_t range16_sse2(const uint8_t *p, uint64_t n, uint64_t lo, uint64_t hi, int *ok)
+{
+    uint64_t i = 0;
+    __m128i flip = _mm_set1_epi16((short)0x8000);
+    __m128i vlo = _mm_xor_si128(_mm_set1_epi16((short)lo), flip);
+    __m128i vhi = _mm_xor_si128(_mm_set1_epi16((short)hi), flip);
+    __m128i bad = _mm_setzero_si128();
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 2 * i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_xor_si128(v, flip);
+        bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi16(v, vlo), _mm_cmpgt_epi16(v, vhi)));
+    }
+    if (_mm_movemask_epi8(bad)) {
+        *ok = 0;
+    }
+    return i;
+}
+
+static uint64_t range32_sse2(const uint8_t *p, uint64_t n, uint64_t lo, uint64_t hi, int *ok)
+{
+    uint64_t i = 0;
+    __m128i flip = _mm_set1_epi32((int)0x80000000u);
+    __m128i vlo = _mm_xor_si128(_mm_set1_epi32((int)(uint32_t)lo), flip);
+    __m128i vhi = _mm_xor_si128(_mm_set1_epi32((int)(uint32_t)hi), flip);
+    __m128i bad = _mm_setzero_si128();
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 4 * i));
+        /* swap the bytes of each half, then the halves */
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+        v = _mm_xor_si128(v, flip);
+        bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi32(v, vlo), _mm_cmpgt_epi32(v, vhi)));
+    }
+    if (_mm_movemask_epi8(bad)) {
+        *ok = 0;
+    }
+    return i;
+}
+
+static uint64_t utf16_plain_sse2(const uint8_t *p, uint64_t n)
+{
+    uint64_t i = 0;
+    /* the high byte of a big endian unit is the low byte of the lane */
+    __m128i mask = _mm_set1_epi16(0x00F8);
+    __m128i half = _mm_set1_epi16(0x00D8);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 2 * i)), mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, half))) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static uint64_t range16_avx2(const uint8_t *p, uint64_t n, uint64_t lo, uint64_t hi, int *ok)
+{
+    uint64_t i = 0;
+    __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    __m256i flip = _mm256_set1_epi16((short)0x8000);
+    __m256i vlo = _mm256_xor_si256(_mm256_set1_epi16((short)lo), flip);
+    __m256i vhi = _mm256_xor_si256(_mm256_set1_epi16((short)hi), flip);
+    __m256i bad = _mm256_setzero_si256();
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + 2 * i));
+        v = _mm256_xor_si256(_mm256_shuffle_epi8(v, swap), flip);
+        bad = _mm256_or_si256(bad, _mm256_or_si256(_mm256_cmpgt_epi16(vlo, v),
+            _mm256_cmpgt_epi16(v, vhi)));
+    }
+    if (_mm256_movemask_epi8(bad)) {
+        *ok = 0;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static uint64_t range32_avx2(const uint8_t *p, uint64_t n, uint64_t lo, uint64_t hi, int *ok)
+{
+    uint64_t i = 0;
+    __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i flip = _mm256_set1_epi32((int)0x80000000u);
+    __m256i vlo = _mm256_xor_si256(_mm256_set1_epi32((int)(uint32_t)lo), flip);
+    __m256i vhi = _mm256_xor_si256(_mm256_set1_epi32((int)(uint32_t)hi), flip);
+    __m256i bad = _mm256_setzero_si256();
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + 4 * i));
+        v = _mm256_xor_si256(_mm256_shuffle_epi8(v, swap), flip);
+        bad = _mm256_or_si256(bad, _mm256_or_si256(_mm256_cmpgt_epi32(vlo, v),
+            _mm256_cmpgt_epi32(v, vhi)));
+    }
+    if (_mm256_movemask_epi8(bad)) {
+        *ok = 0;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static uint64_t utf16_plain_avx2(const uint8_t *p, uint64_t n)
+{
+    uint64_t i = 0;
+    __m256i mask = _mm256_set1_epi16(0x00F8);
+    __m256i half = _mm256_set1_epi16(0x00D8);
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + 2 * i)), mask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, half))) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int have_avx2 = -1;
+#endif
+
+#endif
+
+/* 1 if all n big endian values of width bytes at p lie in lo..hi */
+static int in_range(const uint8_t *p, uint64_t n, int width, uint64_t lo, uint64_t hi)
+{
+    uint64_t i = 0;
+    int ok = 1;
+
+    if (width < 8 && hi >> (8 * width)) {
+        hi = ((uint64_t)1 << (8 * width)) - 1;
+    }
+    if (lo > hi) {
+        return n == 0;
+    }
+#ifdef __SSE2__
+#ifdef HAVE_AVX2_DISPATCH
+    if (have_avx2 < 0) {
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (width == 2) {
+        i = have_avx2 ? range16_avx2(p, n, lo, hi, &ok) : range16_sse2(p, n, lo, hi, &ok);
+    } else if (width == 4) {
+        i = have_avx2 ? range32_avx2(p, n, lo, hi, &ok) : range32_sse2(p, n, lo, hi, &ok);
+    }
+#else
+    if (width == 2) {
+        i = range16_sse2(p, n, lo, hi, &ok);
+    } else if (width == 4) {
+        i = range32_sse2(p, n, lo, hi, &ok);
+    }
+#endif
+#endif
+    return ok && range_scalar(p + i * width, n - i, width, lo, hi);
+}
+
+/*
+ * 1 if n UTF-16BE code units decode, that is every high surrogate is
+ * followed by a low one and no low one stands alone.
+ */
+static int utf16_valid(const uint8_t *p, uint64_t n)
+{
+    uint64_t i = 0;
+    unsigned int c;
+
+#ifdef __SSE2__
+#ifdef HAVE_AVX2_DISPATCH
+    if (have_avx2 < 0) {
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    i = have_avx2 ? utf16_plain_avx2(p, n) : utf16_plain_sse2(p, n);
+#else
+    i = utf16_plain_sse2(p, n);
+#endif
+#endif
+    for (i += utf16_plain_scalar(p + 2 * i, n - i); i < n; i++) {
+        c = (unsigned int)p[2 * i] << 8 | p[2 * i + 1];
+        if (c >= 0xD800 && c < 0xDC00) {
+            if (++i == n || (p[2 * i] & 0xFC) != 0xDC) {
+                return 0;
+            }
+        } else if (c >= 0xDC00 && c < 0xE000) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* decoder_read_length without raising */
+static int read_length(binaryplist_validator *v, uint64_t *pos, uint64_t *length)
+{
+    const uint8_t *data = v->decoder.data;
+    uint64_t end = v->decoder.offset_table;
+    int nbytes;
+
+    if ((data[(*pos)++] & 0x0F) != 0x0F) {
+        *length = data[*pos - 1] & 0x0F;
+        return 1;
+    }
+    if (*pos >= end || (data[*pos] >> 4) != BPLIST_UINT) {
+        return 0;
+    }
+    nbytes = 1 << (data[(*pos)++] & 0x0F);
+    if (nbytes > 8 || *pos + nbytes > end) {
+        return 0;
+    }
+    *length = read_multi_be(data + *pos, nbytes);
+    *pos += nbytes;
+    return 1;
+}
+
+/* Check one object the way decode_uncached reads it, NULL when it decodes */
+static const char *check_object(binaryplist_validator *v, uint64_t ref)
+{
+    binaryplist_decoder *decoder = &v->decoder;
+    const uint8_t *data = decoder->data;
+    uint64_t end = decoder->offset_table, nrefs, length;
+    uint64_t pos = read_multi_be(data + end + ref * decoder->offset_sz, decoder->offset_sz);
+    uint8_t marker = data[pos], kind = marker >> 4;
+    binaryplist_civil civil;
+    uint64_t bits;
+    double seconds;
+    int nbytes;
+
+    v->kinds[ref] = kind;
+    switch (kind) {
+    case 0x0:
+        if (marker == BPLIST_NULL || marker == BPLIST_FALSE || marker == BPLIST_TRUE) {
+            return NULL;
+        }
+        break;
+    case BPLIST_UINT:
+        nbytes = 1 << (marker & 0x0F);
+        if (nbytes <= 16 && pos + 1 + nbytes <= end) {
+            return NULL;
+        }
+        break;
+    case BPLIST_REAL:
+        nbytes = 1 << (marker & 0x0F);
+        if ((nbytes == 4 || nbytes == 8) && pos + 1 + nbytes <= end) {
+            return NULL;
+        }
+        break;
+    case BPLIST_DATE:
+        if (marker != 0x33 || pos + 9 > end) {
+            break;
+        }
+        bits = read_multi_be(data + pos + 1, 8);
+        memcpy(&seconds, &bits, sizeof seconds);
+        /* far outside years 1..9999, and keeps NaN out of the int math */
+        if (!(seconds > -1e15 && seconds < 1e15)
+            || decoder_split_date(seconds, &civil) != BINARYPLIST_OK) {
+            return "date is out of range";
+        }
+        return NULL;
+    case BPLIST_DATA:
+    case BPLIST_STRING:
+    case BPLIST_UNICODE:
+        if (!read_length(v, &pos, &length)) {
+            return "invalid length header";
+        }
+        if (kind != BPLIST_UNICODE) {
+            if (length <= end - pos) {
+                return NULL;
+            }
+        } else if (length <= (end - pos) / 2) {
+            return utf16_valid(data + pos, length) ? NULL : "invalid UTF-16 in unicode string";
+        }
+        break;
+    case BPLIST_UID:
+        nbytes = (marker & 0x0F) + 1;
+        if (nbytes > 8 || pos + 1 + nbytes > end) {
+            break;
+        }
+        /* decoded as a Uid, an int subclass */
+        return read_multi_be(data + pos + 1, nbytes) <= LONG_MAX ? NULL : "uid is out of range";
+    case BPLIST_ARRAY:
+    case BPLIST_SET:
+    case BPLIST_DICT:
+        if (!read_length(v, &pos, &length)) {
+            return "invalid length header";
+        }
+        nrefs = (end - pos) / decoder->ref_id_sz;
+        if (length > nrefs || (kind == BPLIST_DICT && length > nrefs / 2)) {
+            return "container references are out of bounds";
+        }
+        v->pos[ref] = pos;
+        v->count[ref] = length;
+        nrefs = kind == BPLIST_DICT ? 2 * length : length;
+        v->total_refs += nrefs;
+        if (!in_range(data + pos, nrefs, decoder->ref_id_sz, 0, decoder->nobjects - 1)) {
+            return "object reference is out of range";
+        }
+        return NULL;
+    }
+    return "invalid or truncated object";
+}
+
+static int is_container(uint8_t kind)
+{
+    return kind == BPLIST_ARRAY || kind == BPLIST_SET || kind == BPLIST_DICT;
+}
+
+static uint64_t child_refs(binaryplist_validator *v, uint64_t ref)
+{
+    return v->kinds[ref] == BPLIST_DICT ? 2 * v->count[ref] : v->count[ref];
+}
+
+/* Add n to the expansion of ref, NULL while within max_expansion */
+static const char *expand(binaryplist_validator *v, uint64_t ref, uint64_t n)
+{
+    uint64_t *e = &v->expansion[ref];
+
+    *e = *e + n < *e ? UINT64_MAX : *e + n;
+    if (*e > v->max_expansion) {
+        return "containers expand past max_expansion";
+    }
+    return NULL;
+}
+
+/*
+ * Walk everything reachable from the root in the order decode visits
+ * it, with the same depth count, so loops and max_recursion are caught
+ * where decode would hit them.
+ */
+static const char *check_graph(binaryplist_validator *v)
+{
+    binaryplist_decoder *decoder = &v->decoder;
+    validate_frame *frame;
+    uint64_t j, child, ref, count, cap;
+    const char *error;
+    uint8_t kind;
+    int depth = 0;
+
+    if (decoder->max_recursion <= 1) {
+        return "object depth exceeded max_recursion";
+    }
+    if (!is_container(v->kinds[decoder->root])) {
+        return NULL;
+    }
+    /* without loops no path holds more containers than there are objects */
+    cap = decoder->nobjects < (uint64_t)decoder->max_recursion ? decoder->nobjects
+        : (uint64_t)decoder->max_recursion;
+    if (!(v->stack = malloc(cap * sizeof(validate_frame)))) {
+        v->nomemory = 1;
+        return NULL;
+    }
+    v->stack[depth].ref = decoder->root;
+    v->stack[depth++].next = 0;
+    v->state[decoder->root] = STATE_OPEN;
+    if ((error = expand(v, decoder->root, child_refs(v, decoder->root)))) {
+        return error;
+    }
+
+    while (depth) {
+        frame = &v->stack[depth - 1];
+        ref = frame->ref;
+        kind = v->kinds[ref];
+        count = v->count[ref];
+        if (frame->next == child_refs(v, ref)) {
+            v->state[ref] = STATE_DONE;
+            if (--depth && (error = expand(v, v->stack[depth - 1].ref, v->expansion[ref]))) {
+                return error;
+            }
+            continue;
+        }
+        j = frame->next++;
+        if (kind == BPLIST_DICT) {
+            j = j & 1 ? count + j / 2 : j / 2;
+        }
+        child = read_multi_be(decoder->data + v->pos[ref] + j * decoder->ref_id_sz,
+            decoder->ref_id_sz);
+        if ((kind == BPLIST_SET || (kind == BPLIST_DICT && j < count))
+            && is_container(v->kinds[child])) {
+            return "dict keys and set members must not be containers";
+        }
+        if (v->state[child] == STATE_DONE) {
+            if (is_container(v->kinds[child])
+                && (error = expand(v, ref, v->expansion[child]))) {
+                return error;
+            }
+            continue;
+        }
+        if (v->state[child] == STATE_OPEN) {
+            return "a container with references to itself is not decodable";
+        }
+        if (depth + 1 >= decoder->max_recursion) {
+            return "object depth exceeded max_recursion";
+        }
+        if (!is_container(v->kinds[child])) {
+            v->state[child] = STATE_DONE;
+            continue;
+        }
+        v->state[child] = STATE_OPEN;
+        if ((error = expand(v, child, child_refs(v, child)))) {
+            return error;
+        }
+        v->stack[depth].ref = child;
+        v->stack[depth++].next = 0;
+    }
+    return NULL;
+}
+
+/* max_expansion when the caller passes None, for a plist holding refs refs */
+uint64_t default_expansion(uint64_t refs)
+{
+    return refs > (UINT64_MAX - EXPANSION_MIN) / EXPANSION_FACTOR
+        ? UINT64_MAX : EXPANSION_FACTOR * refs + EXPANSION_MIN;
+}
+
+/* The max_expansion argument, *auto_expansion is set for None */
+int parse_max_expansion(PyObject *oexpansion, uint64_t *max_expansion, int *auto_expansion)
+{
+    Py_ssize_t expansion = 0;
+
+    *auto_expansion = (oexpansion == Py_None);
+    if (!*auto_expansion
+        && ((expansion = PyNumber_AsSsize_t(oexpansion, PyExc_OverflowError)) < 0)) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PLIST_Error, "max_expansion must not be negative");
+        }
+        return BINARYPLIST_ERROR;
+    }
+    *max_expansion = (uint64_t)expansion;
+    return BINARYPLIST_OK;
+}
+
+/* Runs without the GIL, returns why the plist would not decode or NULL */
+static const char *validate_plist(binaryplist_validator *v, int auto_expansion)
+{
+    binaryplist_decoder *decoder = &v->decoder;
+    uint64_t n = decoder->nobjects, ref;
+    const char *error;
+
+    if (!in_range(decoder->data + decoder->offset_table, n, decoder->offset_sz,
+        BPLIST_MAGIC_SIZE + 2, decoder->offset_table - 1)) {
+        return "object offset is out of bounds";
+    }
+    v->kinds = malloc(n);
+    v->state = calloc(n, 1);
+    v->pos = malloc(n * sizeof(uint64_t));
+    v->count = calloc(n, sizeof(uint64_t));
+    v->expansion = calloc(n, sizeof(uint64_t));
+    if (!v->kinds || !v->state || !v->pos || !v->count || !v->expansion) {
+        v->nomemory = 1;
+        return NULL;
+    }
+    for (ref = 0; ref < n; ref++) {
+        if ((error = check_object(v, ref))) {
+            return error;
+        }
+    }
+    if (auto_expansion) {
+        v->max_expansion = default_expansion(v->total_refs);
+    }
+    return check_graph(v);
+}
+
+PyObject *validate(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "max_recursion", "max_expansion", NULL};
+    PyObject *oexpansion = Py_None, *newobj = NULL;
+    binaryplist_validator v;
+    const char *error = NULL;
+    Py_buffer view;
+    int auto_expansion;
+
+    memset(&v, 0, sizeof(binaryplist_validator));
+    v.decoder.max_recursion = 1024*16;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*|iO", kwlist, &view,
+        &(v.decoder.max_recursion), &oexpansion)) {
+        return NULL;
+    }
+    if (parse_max_expansion(oexpansion, &v.max_expansion, &auto_expansion) != BINARYPLIST_OK) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    v.decoder.data = view.buf;
+    v.decoder.len = view.len;
+
+    if (decoder_read_trailer(&v.decoder) == BINARYPLIST_OK) {
+        Py_BEGIN_ALLOW_THREADS
+        error = validate_plist(&v, auto_expansion);
+        Py_END_ALLOW_THREADS
+        if (v.nomemory) {
+            PyErr_NoMemory();
+        } else if (error) {
+            PyErr_SetString(PLIST_Error, error);
+        } else {
+            Py_INCREF(Py_None);
+            newobj = Py_None;
+        }
+    }
+
+    free(v.kinds);
+    free(v.state);
+    free(v.pos);
+    free(v.count);
+    free(v.expansion);
+    free(v.stack);
+    PyBuffer_Release(&view);
+    return newobj;
+}
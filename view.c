@@ -0,0 +1,185 @@
+#include "binaryplist.h"
+#include <structmember.h>
+
+
+/*
+ * Lazy access to a binary plist held in any buffer. Nothing is decoded
+ * up front; the python proxies in binaryplist/__init__.py walk containers
+ * by reference id and only materialize the objects they are asked for.
+ *
+ */
+
+typedef struct {
+    PyObject_HEAD
+    Py_buffer view;
+    binaryplist_decoder decoder;
+    PyObject *root;
+} binaryplist_view;
+
+static void view_dealloc(binaryplist_view *self)
+{
+    decoder_free(&self->decoder);
+    if (self->decoder.data) {
+        PyBuffer_Release(&self->view);
+    }
+    Py_XDECREF(self->root);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int view_tp_init(binaryplist_view *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "max_recursion", NULL};
+
+    if (self->decoder.data) {
+        PyErr_SetString(PLIST_Error, "view is already initialized");
+        return -1;
+    }
+    self->decoder.max_recursion = 1024*16;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s*|i", kwlist, &self->view,
+        &(self->decoder.max_recursion))) {
+        return -1;
+    }
+    self->decoder.data = self->view.buf;
+    self->decoder.len = self->view.len;
+    if (decoder_read_trailer(&self->decoder) != BINARYPLIST_OK
+        || decoder_alloc(&self->decoder) != BINARYPLIST_OK) {
+        return -1;
+    }
+    self->root = PyLong_FromUnsignedLongLong(self->decoder.root);
+    return self->root ? 0 : -1;
+}
+
+static int view_check(binaryplist_view *self)
+{
+    if (!self->decoder.data) {
+        PyErr_SetString(PLIST_Error, "view is not initialized");
+        return BINARYPLIST_ERROR;
+    }
+    return BINARYPLIST_OK;
+}
+
+static PyObject *view_kind(binaryplist_view *self, PyObject *args)
+{
+    unsigned PY_LONG_LONG ref;
+    int kind;
+
+    if (!PyArg_ParseTuple(args, "K", &ref) || view_check(self) != BINARYPLIST_OK) {
+        return NULL;
+    }
+    if ((kind = decoder_object_kind(&self->decoder, ref)) < 0) {
+        return NULL;
+    }
+    return PyInt_FromLong(kind);
+}
+
+static PyObject *view_refs(binaryplist_view *self, PyObject *args)
+{
+    unsigned PY_LONG_LONG ref;
+    uint8_t kind;
+    uint64_t i, pos, count;
+    PyObject *refs, *id;
+
+    if (!PyArg_ParseTuple(args, "K", &ref) || view_check(self) != BINARYPLIST_OK) {
+        return NULL;
+    }
+    if (decoder_read_container(&self->decoder, ref, &kind, &pos, &count) != BINARYPLIST_OK) {
+        return NULL;
+    }
+    if (kind == BPLIST_DICT) {
+        count *= 2;
+    }
+    if (!(refs = PyTuple_New(count))) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (!(id = PyInt_FromSsize_t(decoder_read_ref(&self->decoder, pos, i)))) {
+            Py_DECREF(refs);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(refs, i, id);
+    }
+    return refs;
+}
+
+static PyObject *view_value(binaryplist_view *self, PyObject *args)
+{
+    unsigned PY_LONG_LONG ref;
+    PyObject *object;
+
+    if (!PyArg_ParseTuple(args, "K", &ref) || view_check(self) != BINARYPLIST_OK) {
+        return NULL;
+    }
+    if ((object = decoder_decode_object(&self->decoder, ref))) {
+        Py_INCREF(object);
+    }
+    return object;
+}
+
+static PyMethodDef view_methods[] =
+{
+    {"kind", (PyCFunction)view_kind, METH_VARARGS,
+     "Type nibble of the object with the given reference id."},
+    {"refs", (PyCFunction)view_refs, METH_VARARGS,
+     "Child reference ids of a container. Dicts return keys then values."},
+    {"value", (PyCFunction)view_value, METH_VARARGS,
+     "Fully decode the object with the given reference id."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef view_members[] =
+{
+    {"root", T_OBJECT, offsetof(binaryplist_view, root), READONLY,
+     "Reference id of the root object."},
+    {NULL, 0, 0, 0, NULL}
+};
+
+static PyTypeObject binaryplist_view_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libbinaryplist.View",                      /* tp_name */
+    sizeof(binaryplist_view),                   /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)view_dealloc,                   /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Reference id level access to a binary plist buffer.", /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    view_methods,                               /* tp_methods */
+    view_members,                               /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)view_tp_init,                     /* tp_init */
+    0,                                          /* tp_alloc */
+    PyType_GenericNew,                          /* tp_new */
+};
+
+int view_init(PyObject *module)
+{
+    if (PyType_Ready(&binaryplist_view_type) < 0) {
+        return BINARYPLIST_ERROR;
+    }
+    Py_INCREF(&binaryplist_view_type);
+    PyModule_AddObject(module, "View", (PyObject *)&binaryplist_view_type);
+    return BINARYPLIST_OK;
+}